@@ -0,0 +1,470 @@
+// Benchmarks for the public API. The corpora are generated at startup from
+// a fixed seed, so every run measures the same input. The library is built
+// into this file, with MJSON_REALLOC and MJSON_FREE redirected to counters.
+//
+// Usage: bench [-t SECONDS] [FILTER]
+//
+// Runs every benchmark whose name contains FILTER for about SECONDS each,
+// default 0.2, and prints one JSON object per line:
+//   {"bench":"find","corpus":"twitter","ops":100000,"bytes":423168,
+//    "ns_per_op":81.2,"mb_per_s":5214.6,"allocs_per_op":0,
+//    "alloc_bytes_per_op":0}
+// bytes is the input size of one operation, 0 for benchmarks that only
+// print, and mb_per_s is the input throughput.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void *bench_realloc(void *p, size_t n);
+static void bench_free(void *p);
+#define MJSON_REALLOC bench_realloc
+#define MJSON_FREE bench_free
+#include "mjson.c"
+
+static unsigned long s_allocs, s_alloc_bytes;
+
+static void *bench_realloc(void *p, size_t n) {
+  s_allocs++, s_alloc_bytes += n;
+  return realloc(p, n);
+}
+
+static void bench_free(void *p) {
+  free(p);
+}
+
+static unsigned s_seed = 2463534242U;
+
+static unsigned rnd(unsigned n) {
+  s_seed ^= s_seed << 13, s_seed ^= s_seed >> 17, s_seed ^= s_seed << 5;
+  return s_seed % n;
+}
+
+static const char *word(void) {
+  static const char *words[] = {
+      "lorem", "ipsum", "dolor",  "sit",    "amet", "consectetur",
+      "elit",  "sed",   "tempor", "labore", "magna", "aliqua",
+      "\u00e9t\u00e9", "\"quoted\"", "tab\there", "line\nbreak",
+  };
+  return words[rnd(sizeof(words) / sizeof(words[0]))];
+}
+
+// Random text of n words, may need escaping
+static const char *text(int n) {
+  static char buf[512];
+  int i, len = 0;
+  for (i = 0; i < n; i++) {
+    len += snprintf(buf + len, sizeof(buf) - (size_t) len, "%s%s",
+                    i == 0 ? "" : " ", word());
+  }
+  return buf;
+}
+
+static double coord(double base) {
+  return base + (double) rnd(2000000) / 1e6 - 1;
+}
+
+// Social network feed: strings, nested user objects, small arrays
+static char *gen_twitter(void) {
+  char *s = NULL;
+  int i;
+  mjson_printf(mjson_print_dynamic_buf, &s, "{%Q:[", "statuses");
+  for (i = 0; i < 500; i++) {
+    mjson_printf(mjson_print_dynamic_buf, &s, "%s{%Q:%lu,%Q:%Q,",
+                 i == 0 ? "" : ",", "id",
+                 505874924095815681UL + (unsigned long) i, "text", text(12));
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "%Q:{%Q:%d,%Q:\"user_%u\",%Q:%Q,%Q:%d,%Q:%B},", "user",
+                 "id", 1186275104 + i, "screen_name", rnd(100000), "location",
+                 word(), "followers_count", (int) rnd(10000), "verified",
+                 (int) rnd(2));
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "%Q:{%Q:[%Q,%Q],%Q:[]},%Q:%B,%Q:%d,%Q:%Q,%Q:null}",
+                 "entities", "hashtags", word(), word(), "urls", "retweeted",
+                 (int) rnd(2), "retweet_count", (int) rnd(1000), "lang", "en",
+                 "in_reply_to_status_id");
+  }
+  mjson_printf(mjson_print_dynamic_buf, &s, "],%Q:{%Q:%g,%Q:%d}}",
+               "search_metadata", "completed_in", 0.087, "count", 500);
+  return s;
+}
+
+// Geographic polygons: long arrays of floating point numbers
+static char *gen_canada(void) {
+  char *s = NULL;
+  int i, j;
+  mjson_printf(mjson_print_dynamic_buf, &s, "{%Q:%Q,%Q:[", "type",
+               "FeatureCollection", "features");
+  for (i = 0; i < 10; i++) {
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "%s{%Q:%Q,%Q:{%Q:%Q},%Q:{%Q:%Q,%Q:[[", i == 0 ? "" : ",",
+                 "type", "Feature", "properties", "name", "Canada",
+                 "geometry", "type", "Polygon", "coordinates");
+    for (j = 0; j < 2000; j++) {
+      mjson_printf(mjson_print_dynamic_buf, &s, "%s[%.*g,%.*g]",
+                   j == 0 ? "" : ",", 15, coord(-65.6), 15, coord(43.5));
+    }
+    mjson_printf(mjson_print_dynamic_buf, &s, "]]}}");
+  }
+  mjson_printf(mjson_print_dynamic_buf, &s, "]}");
+  return s;
+}
+
+// Event catalog: deeply nested objects and arrays of small integers
+static char *gen_citm(void) {
+  char *s = NULL;
+  int i, j;
+  mjson_printf(mjson_print_dynamic_buf, &s, "{%Q:{", "events");
+  for (i = 0; i < 300; i++) {
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "%s\"%d\":{%Q:%d,%Q:%Q,%Q:null,%Q:[%d,%d,%d],%Q:[]}",
+                 i == 0 ? "" : ",", 138586341 + i, "id", 138586341 + i,
+                 "name", word(), "logo", "subTopicIds", 337184 + i,
+                 337185 + i, 337186 + i, "topicIds");
+  }
+  mjson_printf(mjson_print_dynamic_buf, &s, "},%Q:[", "performances");
+  for (i = 0; i < 600; i++) {
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "%s{%Q:%d,%Q:%d,%Q:[", i == 0 ? "" : ",", "id",
+                 339887544 + i, "eventId", 138586341 + (int) rnd(300),
+                 "prices");
+    for (j = 0; j < 3; j++) {
+      mjson_printf(mjson_print_dynamic_buf, &s, "%s{%Q:%d,%Q:%d}",
+                   j == 0 ? "" : ",", "amount", (int) rnd(100000),
+                   "seatCategoryId", 338937295 + j);
+    }
+    mjson_printf(mjson_print_dynamic_buf, &s, "],%Q:[", "seatCategories");
+    for (j = 0; j < 3; j++) {
+      mjson_printf(mjson_print_dynamic_buf, &s,
+                   "%s{%Q:[{%Q:%d,%Q:[]},{%Q:%d,%Q:[]}],%Q:%d}",
+                   j == 0 ? "" : ",", "areas", "areaId", 205705999 + j,
+                   "blockIds", "areaId", 205706000 + j, "blockIds",
+                   "seatCategoryId", 338937295 + j);
+    }
+    mjson_printf(mjson_print_dynamic_buf, &s, "],%Q:%lu,%Q:%Q}", "start",
+                 1372615200000UL + (unsigned long) i * 86400000UL, "venueCode",
+                 "PLEYEL_PLEYEL");
+  }
+  mjson_printf(mjson_print_dynamic_buf, &s, "]}");
+  return s;
+}
+
+// Log records, one JSON object per line
+static char *gen_ndjson(void) {
+  static const char *levels[] = {"debug", "info", "warn", "error"};
+  static const char *methods[] = {"GET", "POST", "PUT", "DELETE"};
+  char *s = NULL;
+  int i;
+  for (i = 0; i < 5000; i++) {
+    mjson_printf(mjson_print_dynamic_buf, &s,
+                 "{%Q:%lu,%Q:%Q,%Q:%Q,%Q:{%Q:%Q,%Q:\"/api/v1/%s/%u\","
+                 "%Q:%d,%Q:%g}}\n",
+                 "ts", 1600000000000UL + (unsigned long) i * 137UL, "level",
+                 levels[rnd(4)], "msg", text(2), "req", "method",
+                 methods[rnd(4)], "path", word(), rnd(1000), "status",
+                 rnd(10) == 0 ? 500 : 200, "ms", (double) rnd(100000) / 100);
+  }
+  return s;
+}
+
+// Binary blob, as base64 and hex strings
+static char *gen_blob(int base64) {
+  char *s = NULL, *bin = (char *) malloc(65536);
+  int i;
+  for (i = 0; i < 65536; i++) bin[i] = (char) rnd(256);
+  mjson_printf(mjson_print_dynamic_buf, &s, base64 ? "{%Q:%V}" : "{%Q:%H}",
+               "data", 65536, bin);
+  free(bin);
+  return s;
+}
+
+struct corpus {
+  const char *name;
+  char *buf;
+  int len;
+};
+
+static struct corpus s_corpora[] = {
+    {"twitter", NULL, 0}, {"canada", NULL, 0}, {"citm", NULL, 0},
+    {"ndjson", NULL, 0},  {"base64", NULL, 0}, {"hex", NULL, 0},
+};
+
+static const struct corpus *corpus(const char *name) {
+  size_t i;
+  for (i = 0; i < sizeof(s_corpora) / sizeof(s_corpora[0]); i++) {
+    if (strcmp(s_corpora[i].name, name) == 0) return &s_corpora[i];
+  }
+  abort();
+}
+
+struct bench {
+  const char *name;    // Benchmark name
+  const char *corpus;  // Corpus name, or NULL
+  const char *arg;     // Path or patch, or the input if there is no corpus
+  int (*fn)(const struct bench *b, const char *buf, int len);
+};
+
+static int b_validate(const struct bench *b, const char *buf, int len) {
+  (void) b;
+  return mjson(buf, len, NULL, NULL);
+}
+
+static int b_find(const struct bench *b, const char *buf, int len) {
+  const char *p;
+  int n;
+  return mjson_find(buf, len, b->arg, &p, &n);
+}
+
+static int b_get_number(const struct bench *b, const char *buf, int len) {
+  double v = 0;
+  return mjson_get_number(buf, len, b->arg, &v) + (int) v;
+}
+
+static int b_get_string(const struct bench *b, const char *buf, int len) {
+  char tmp[256];
+  return mjson_get_string(buf, len, b->arg, tmp, sizeof(tmp));
+}
+
+static int b_get_bool(const struct bench *b, const char *buf, int len) {
+  int v = 0;
+  return mjson_get_bool(buf, len, b->arg, &v) + v;
+}
+
+// Iterate over the elements of an array or object
+static int b_next(const struct bench *b, const char *buf, int len) {
+  int koff, klen, voff, vlen, vtype, off = 0, n = 0;
+  const char *p;
+  if (mjson_find(buf, len, b->arg, &p, &len) == MJSON_TOK_INVALID) return 0;
+  while ((off = mjson_next(p, len, off, &koff, &klen, &voff, &vlen,
+                           &vtype)) != 0) {
+    n++;
+  }
+  return n;
+}
+
+// Validate every line, and read one field from it
+static int b_ndjson(const struct bench *b, const char *buf, int len) {
+  const char *end = buf + len, *nl;
+  int n = 0;
+  for (; buf < end; buf = nl + 1) {
+    double v = 0;
+    nl = (const char *) memchr(buf, '\n', (size_t) (end - buf));
+    if (nl == NULL) nl = end;
+    if (mjson(buf, (int) (nl - buf), NULL, NULL) <= 0) continue;
+    n += mjson_get_number(buf, (int) (nl - buf), b->arg, &v);
+  }
+  return n;
+}
+
+static char s_out[1 << 20];
+static char s_blob[65536];
+static const char s_str[] = "Lorem \"ipsum\" dolor\tsit amet, \u00e9t\u00e9\n";
+
+static int b_printf_int(const struct bench *b, const char *buf, int len) {
+  struct mjson_fixedbuf fb = {s_out, sizeof(s_out), 0};
+  (void) b, (void) buf, (void) len;
+  return mjson_printf(mjson_print_fixed_buf, &fb, "{%Q:%d,%Q:%u,%Q:%ld}", "a",
+                      -123456, "b", 4000000000U, "c", 1234567890123L);
+}
+
+static int b_printf_double(const struct bench *b, const char *buf, int len) {
+  struct mjson_fixedbuf fb = {s_out, sizeof(s_out), 0};
+  (void) b, (void) buf, (void) len;
+  return mjson_printf(mjson_print_fixed_buf, &fb, "[%g,%g,%.*g]", 3.14159,
+                      -1e-7, 15, 1234567.891);
+}
+
+static int b_printf_string(const struct bench *b, const char *buf, int len) {
+  struct mjson_fixedbuf fb = {s_out, sizeof(s_out), 0};
+  (void) b, (void) buf, (void) len;
+  return mjson_printf(mjson_print_fixed_buf, &fb, "{%Q:%Q,%Q:%B}", "s", s_str,
+                      "b", 1);
+}
+
+static int b_printf_base64(const struct bench *b, const char *buf, int len) {
+  struct mjson_fixedbuf fb = {s_out, sizeof(s_out), 0};
+  (void) b, (void) buf, (void) len;
+  return mjson_printf(mjson_print_fixed_buf, &fb, "%V", 4096, s_blob);
+}
+
+static int b_printf_hex(const struct bench *b, const char *buf, int len) {
+  struct mjson_fixedbuf fb = {s_out, sizeof(s_out), 0};
+  (void) b, (void) buf, (void) len;
+  return mjson_printf(mjson_print_fixed_buf, &fb, "%H", 4096, s_blob);
+}
+
+static int b_aprintf(const struct bench *b, const char *buf, int len) {
+  char *s = mjson_aprintf("{%Q:%d,%Q:%Q}", "id", 42, "s", s_str);
+  (void) b, (void) buf, (void) len;
+  len = (int) strlen(s);
+  free(s);
+  return len;
+}
+
+static int b_pretty(const struct bench *b, const char *buf, int len) {
+  return mjson_pretty(buf, len, b->arg, mjson_print_null, NULL);
+}
+
+static int b_minify(const struct bench *b, const char *buf, int len) {
+  (void) b;
+  return mjson_minify(buf, len, mjson_print_null, NULL);
+}
+
+static int b_merge(const struct bench *b, const char *buf, int len) {
+  return mjson_merge(buf, len, b->arg, (int) strlen(b->arg), mjson_print_null,
+                     NULL);
+}
+
+static int b_get_base64(const struct bench *b, const char *buf, int len) {
+  return mjson_get_base64(buf, len, b->arg, s_out, sizeof(s_out));
+}
+
+static int b_get_hex(const struct bench *b, const char *buf, int len) {
+  return mjson_get_hex(buf, len, b->arg, s_out, sizeof(s_out));
+}
+
+static struct jsonrpc_ctx s_ctx;
+
+static void rpc_sum(struct jsonrpc_request *r) {
+  double a = 0, c = 0;
+  mjson_get_number(r->params, r->params_len, "$[0]", &a);
+  mjson_get_number(r->params, r->params_len, "$[1]", &c);
+  jsonrpc_return_success(r, "%g", a + c);
+}
+
+static void rpc_echo(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "%.*s", r->params_len, r->params);
+}
+
+static int b_rpc(const struct bench *b, const char *buf, int len) {
+  (void) b;
+  jsonrpc_ctx_process(&s_ctx, buf, len, mjson_print_null, NULL, NULL);
+  return 1;
+}
+
+static const struct bench s_benches[] = {
+    {"validate", "twitter", NULL, b_validate},
+    {"validate", "canada", NULL, b_validate},
+    {"validate", "citm", NULL, b_validate},
+    {"find", "twitter", "$.statuses[450].user.screen_name", b_find},
+    {"find", "citm", "$.performances[550].seatCategories[2].areas[1]", b_find},
+    {"get_number", "canada", "$.features[9].geometry.coordinates[0][1999][1]",
+     b_get_number},
+    {"get_string", "twitter", "$.statuses[450].text", b_get_string},
+    {"get_bool", "twitter", "$.statuses[499].user.verified", b_get_bool},
+    {"next", "twitter", "$.statuses", b_next},
+    {"next", "canada", "$.features[0].geometry.coordinates[0]", b_next},
+    {"next", "citm", "$.events", b_next},
+    {"ndjson", "ndjson", "$.req.status", b_ndjson},
+    {"printf_int", NULL, NULL, b_printf_int},
+    {"printf_double", NULL, NULL, b_printf_double},
+    {"printf_string", NULL, NULL, b_printf_string},
+    {"printf_base64", NULL, NULL, b_printf_base64},
+    {"printf_hex", NULL, NULL, b_printf_hex},
+    {"aprintf", NULL, NULL, b_aprintf},
+    {"pretty", "citm", "  ", b_pretty},
+    {"minify", "twitter", NULL, b_minify},
+    {"merge", "citm", "{\"events\":{\"138586341\":null},\"areaNames\":{}}",
+     b_merge},
+    {"get_base64", "base64", "$.data", b_get_base64},
+    {"get_hex", "hex", "$.data", b_get_hex},
+    {"rpc_sum", NULL, "{\"id\":1,\"method\":\"sum\",\"params\":[1,2]}", b_rpc},
+    {"rpc_echo", NULL,
+     "{\"id\":1,\"method\":\"echo\",\"params\":{\"a\":[1,2,3],\"b\":\"xyz\"}}",
+     b_rpc},
+    {"rpc_not_found", NULL, "{\"id\":1,\"method\":\"nope\"}", b_rpc},
+};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static int print_stdout(const char *buf, int len, void *fn_data) {
+  (void) fn_data;
+  return (int) fwrite(buf, 1, (size_t) len, stdout);
+}
+
+static volatile int s_sink;
+
+static void run(const struct bench *b, double seconds) {
+  const struct corpus *c = b->corpus == NULL ? NULL : corpus(b->corpus);
+  const char *buf = c != NULL ? c->buf : b->arg;
+  int len = c != NULL ? c->len : buf != NULL ? (int) strlen(buf) : 0;
+  unsigned long i, ops = 1, allocs, alloc_bytes;
+  double t, elapsed;
+
+  // Warm up, and find the number of operations that takes long enough
+  for (;;) {
+    t = now();
+    for (i = 0; i < ops; i++) s_sink += b->fn(b, buf, len);
+    if ((elapsed = now() - t) >= seconds / 10) break;
+    ops *= 2;
+  }
+  ops = (unsigned long) ((double) ops * seconds / elapsed) + 1;
+
+  allocs = s_allocs, alloc_bytes = s_alloc_bytes;
+  t = now();
+  for (i = 0; i < ops; i++) s_sink += b->fn(b, buf, len);
+  elapsed = now() - t;
+  allocs = s_allocs - allocs, alloc_bytes = s_alloc_bytes - alloc_bytes;
+
+  mjson_printf(print_stdout, NULL,
+               "{%Q:%Q,%Q:%Q,%Q:%lu,%Q:%d,%Q:%.*g,%Q:%.*g,%Q:%.*g,%Q:%.*g}\n",
+               "bench", b->name, "corpus", c == NULL ? "" : c->name, "ops",
+               ops, "bytes", len, "ns_per_op", 4, elapsed * 1e9 / (double) ops,
+               "mb_per_s", 4, (double) len * (double) ops / elapsed / 1e6,
+               "allocs_per_op", 4, (double) allocs / (double) ops,
+               "alloc_bytes_per_op", 4, (double) alloc_bytes / (double) ops);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  const char *filter = NULL;
+  double seconds = 0.2;
+  size_t i;
+
+  for (i = 1; i < (size_t) argc; i++) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < (size_t) argc) {
+      seconds = atof(argv[++i]);
+    } else if (argv[i][0] != '-' && filter == NULL) {
+      filter = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [-t SECONDS] [FILTER]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  s_corpora[0].buf = gen_twitter();
+  s_corpora[1].buf = gen_canada();
+  s_corpora[2].buf = gen_citm();
+  s_corpora[3].buf = gen_ndjson();
+  s_corpora[4].buf = gen_blob(1);
+  s_corpora[5].buf = gen_blob(0);
+  for (i = 0; i < sizeof(s_corpora) / sizeof(s_corpora[0]); i++) {
+    s_corpora[i].len = (int) strlen(s_corpora[i].buf);
+  }
+  for (i = 0; i < sizeof(s_blob); i++) s_blob[i] = (char) rnd(256);
+
+  jsonrpc_ctx_init(&s_ctx, NULL, NULL);
+  if (jsonrpc_ctx_export(&s_ctx, "sum", rpc_sum) != 0 ||
+      jsonrpc_ctx_export(&s_ctx, "echo", rpc_echo) != 0) {
+    fprintf(stderr, "Cannot export methods\n");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < sizeof(s_benches) / sizeof(s_benches[0]); i++) {
+    const struct bench *b = &s_benches[i];
+    if (filter != NULL && strstr(b->name, filter) == NULL) continue;
+    run(b, seconds);
+  }
+
+  jsonrpc_ctx_free(&s_ctx);
+  for (i = 0; i < sizeof(s_corpora) / sizeof(s_corpora[0]); i++) {
+    free(s_corpora[i].buf);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+// Load generator for rpc_server. Each connection runs in its own thread,
+// keeps up to DEPTH requests in flight, and records the latency of every
+// response. Reports requests per second and latency percentiles.
+//
+// Usage: rpc_load [-l SOCKET_PATH] [-c CONNECTIONS] [-d SECONDS]
+//                 [-p DEPTH] [-s PAYLOAD_BYTES] [-m METHOD:WEIGHT,...]
+//
+// Example: rpc_load -c 8 -p 4 -s 256 -m noop:1,echo:2,sum:1
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mjson.h"
+
+#define MAX_METHODS 8
+#define MAX_DEPTH 256
+
+struct method {
+  char name[32];
+  unsigned weight;
+  char *params;  // Pre-built params of the configured payload size
+};
+
+struct options {
+  const char *path;
+  int connections, depth;
+  double seconds;
+  size_t payload;
+  struct method methods[MAX_METHODS];
+  int num_methods;
+  unsigned total_weight;
+};
+
+struct worker {
+  pthread_t thread;
+  const struct options *opts;
+  unsigned seed;
+  unsigned long long *lat;  // Latencies, nanoseconds
+  size_t num_lat, lat_size;
+  unsigned long errors;
+  int failed;
+};
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ULL +
+         (unsigned long long) ts.tv_nsec;
+}
+
+static unsigned xorshift(unsigned *s) {
+  *s ^= *s << 13, *s ^= *s >> 17, *s ^= *s << 5;
+  return *s;
+}
+
+static const struct method *pick(const struct options *o, unsigned *seed) {
+  unsigned r = xorshift(seed) % o->total_weight;
+  int i;
+  for (i = 0; i < o->num_methods - 1; i++) {
+    if (r < o->methods[i].weight) break;
+    r -= o->methods[i].weight;
+  }
+  return &o->methods[i];
+}
+
+static int add_latency(struct worker *w, unsigned long long ns) {
+  if (w->num_lat == w->lat_size) {
+    size_t size = w->lat_size == 0 ? 65536 : w->lat_size * 2;
+    void *p = realloc(w->lat, size * sizeof(*w->lat));
+    if (p == NULL) return -1;
+    w->lat = (unsigned long long *) p, w->lat_size = size;
+  }
+  w->lat[w->num_lat++] = ns;
+  return 0;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return -1;
+    buf += n, len -= (size_t) n;
+  }
+  return 0;
+}
+
+static int send_request(struct worker *w, int fd, unsigned long id) {
+  const struct method *m = pick(w->opts, &w->seed);
+  char *frame = NULL;
+  int ok;
+  if (m->params == NULL) {
+    frame = mjson_aprintf("{%Q:%lu,%Q:%Q}\n", "id", id, "method", m->name);
+  } else {
+    frame = mjson_aprintf("{%Q:%lu,%Q:%Q,%Q:%s}\n", "id", id, "method",
+                          m->name, "params", m->params);
+  }
+  ok = frame != NULL && send_all(fd, frame, strlen(frame)) == 0;
+  free(frame);
+  return ok ? 0 : -1;
+}
+
+static void *worker_loop(void *arg) {
+  struct worker *w = (struct worker *) arg;
+  const struct options *o = w->opts;
+  unsigned long long sent[MAX_DEPTH], deadline;
+  unsigned long next_id = 0, done = 0;
+  struct sockaddr_un sa;
+  char buf[65536];
+  size_t len = 0;
+  int fd;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", o->path);
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *) &sa, sizeof(sa)) != 0) {
+    perror(o->path);
+    w->failed = 1;
+    if (fd >= 0) close(fd);
+    return NULL;
+  }
+
+  deadline = now_ns() + (unsigned long long) (o->seconds * 1e9);
+  for (;;) {
+    unsigned long long t = now_ns();
+    char *nl;
+    ssize_t n;
+    while (t < deadline && next_id - done < (unsigned long) o->depth) {
+      sent[next_id % (unsigned long) o->depth] = t;
+      if (send_request(w, fd, next_id++) != 0) goto fail;
+    }
+    if (done == next_id) break;
+    n = read(fd, buf + len, sizeof(buf) - len);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) goto fail;
+    len += (size_t) n;
+    t = now_ns();
+    while ((nl = (char *) memchr(buf, '\n', len)) != NULL) {
+      int flen = (int) (nl - buf);
+      double id = -1;
+      mjson_get_number(buf, flen, "$.id", &id);
+      if (id != (double) done) goto fail;  // Responses come in order
+      if (mjson_find(buf, flen, "$.error", NULL, NULL) != MJSON_TOK_INVALID) {
+        w->errors++;
+      }
+      if (add_latency(w, t - sent[done % (unsigned long) o->depth]) != 0) {
+        goto fail;
+      }
+      done++;
+      len -= (size_t) (nl + 1 - buf);
+      memmove(buf, nl + 1, len);
+    }
+    if (len == sizeof(buf)) goto fail;  // Response too long
+  }
+  close(fd);
+  return NULL;
+
+fail:
+  fprintf(stderr, "connection failed after %lu responses\n", done);
+  w->failed = 1;
+  close(fd);
+  return NULL;
+}
+
+// Build params of about the given size: a string for echo, numbers for sum
+static char *make_params(const char *method, size_t size) {
+  char *p = (char *) malloc(size + 16), *s = p;
+  if (p == NULL) return NULL;
+  if (strcmp(method, "noop") == 0) {
+    free(p);
+    return NULL;
+  } else if (strcmp(method, "sum") == 0) {
+    *s++ = '[';
+    while ((size_t) (s - p) + 4 < size || s - p < 2) s += sprintf(s, "%d,", 7);
+    s[-1] = ']', *s = '\0';
+  } else {
+    *s++ = '[', *s++ = '"';
+    while ((size_t) (s - p) + 2 < size) *s++ = 'x';
+    *s++ = '"', *s++ = ']', *s = '\0';
+  }
+  return p;
+}
+
+static int parse_mix(struct options *o, const char *mix) {
+  const char *s = mix;
+  while (*s != '\0' && o->num_methods < MAX_METHODS) {
+    struct method *m = &o->methods[o->num_methods];
+    size_t n = strcspn(s, ":,");
+    if (n == 0 || n >= sizeof(m->name)) return -1;
+    memcpy(m->name, s, n);
+    m->name[n] = '\0';
+    s += n;
+    m->weight = 1;
+    if (*s == ':') m->weight = (unsigned) strtoul(s + 1, (char **) &s, 10);
+    if (*s == ',') s++;
+    if (m->weight == 0) continue;
+    o->total_weight += m->weight;
+    o->num_methods++;
+  }
+  return *s == '\0' && o->num_methods > 0 ? 0 : -1;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *) a;
+  unsigned long long y = *(const unsigned long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const unsigned long long *v, size_t n, double p) {
+  size_t i = (size_t) (p * (double) (n - 1) + 0.5);
+  return n == 0 ? 0 : (double) v[i] / 1e3;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-l SOCKET_PATH] [-c CONNECTIONS] [-d SECONDS]\n"
+          "          [-p DEPTH] [-s PAYLOAD_BYTES] [-m METHOD:WEIGHT,...]\n",
+          prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  struct options o;
+  struct worker *w;
+  unsigned long long *all, start, elapsed;
+  unsigned long errors = 0;
+  size_t total = 0;
+  const char *mix = "noop:1,echo:1,sum:1";
+  int i, failed = 0;
+
+  memset(&o, 0, sizeof(o));
+  o.path = "/tmp/mjson-bench.sock";
+  o.connections = 4, o.depth = 1, o.seconds = 5, o.payload = 64;
+  for (i = 1; i < argc; i++) {
+    const char *v = i + 1 < argc ? argv[i + 1] : NULL;
+    if (v == NULL) usage(argv[0]);
+    if (strcmp(argv[i], "-l") == 0) {
+      o.path = v;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      o.connections = atoi(v);
+    } else if (strcmp(argv[i], "-d") == 0) {
+      o.seconds = atof(v);
+    } else if (strcmp(argv[i], "-p") == 0) {
+      o.depth = atoi(v);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      o.payload = (size_t) atol(v);
+    } else if (strcmp(argv[i], "-m") == 0) {
+      mix = v;
+    } else {
+      usage(argv[0]);
+    }
+    i++;
+  }
+  if (o.connections < 1 || o.depth < 1 || o.depth > MAX_DEPTH ||
+      o.seconds <= 0 || parse_mix(&o, mix) != 0) {
+    usage(argv[0]);
+  }
+  for (i = 0; i < o.num_methods; i++) {
+    o.methods[i].params = make_params(o.methods[i].name, o.payload);
+  }
+
+  w = (struct worker *) calloc((size_t) o.connections, sizeof(*w));
+  if (w == NULL) return EXIT_FAILURE;
+  start = now_ns();
+  for (i = 0; i < o.connections; i++) {
+    w[i].opts = &o;
+    w[i].seed = 2463534242U + (unsigned) i;
+    pthread_create(&w[i].thread, NULL, worker_loop, &w[i]);
+  }
+  for (i = 0; i < o.connections; i++) {
+    pthread_join(w[i].thread, NULL);
+    total += w[i].num_lat, errors += w[i].errors, failed |= w[i].failed;
+  }
+  elapsed = now_ns() - start;
+
+  all = (unsigned long long *) malloc((total + 1) * sizeof(*all));
+  if (all == NULL) return EXIT_FAILURE;
+  for (total = 0, i = 0; i < o.connections; i++) {
+    memcpy(all + total, w[i].lat, w[i].num_lat * sizeof(*all));
+    total += w[i].num_lat;
+    free(w[i].lat);
+  }
+  qsort(all, total, sizeof(*all), cmp_u64);
+
+  printf("connections %d, depth %d, payload %lu, mix %s\n", o.connections,
+         o.depth, (unsigned long) o.payload, mix);
+  printf("requests %lu, errors %lu, %.0f req/s\n", (unsigned long) total,
+         errors, (double) total * 1e9 / (double) elapsed);
+  printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+         percentile(all, total, 0.5), percentile(all, total, 0.99),
+         percentile(all, total, 0.999), percentile(all, total, 1));
+
+  for (i = 0; i < o.num_methods; i++) free(o.methods[i].params);
+  free(all);
+  free(w);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,198 @@
+// JSON-RPC server on a Unix domain socket, for throughput measurements.
+// A single-threaded epoll loop feeds each connection into a jsonrpc_stream,
+// and buffers the responses until the socket is writable.
+//
+// Usage: rpc_server [-l SOCKET_PATH]
+//
+// Methods:
+//   noop         returns true
+//   echo         returns the params
+//   sum          returns the sum of the numbers in the params array
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "mjson.h"
+
+#define MAX_FRAME 65536
+#define MAX_EVENTS 64
+
+struct conn {
+  int fd;
+  struct jsonrpc_stream stream;
+  char frame[MAX_FRAME];  // Frames split between reads
+  char *out;              // Responses not written yet
+  size_t out_len, out_size;
+};
+
+static volatile sig_atomic_t s_stop;
+
+static void on_signal(int sig) {
+  s_stop = sig;
+}
+
+static void noop(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "true");
+}
+
+static void echo(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "%.*s", r->params_len, r->params);
+}
+
+static void sum(struct jsonrpc_request *r) {
+  int koff, klen, voff, vlen, vtype, off = 0;
+  double v = 0;
+  while ((off = mjson_next(r->params, r->params_len, off, &koff, &klen, &voff,
+                           &vlen, &vtype)) != 0) {
+    if (vtype == MJSON_TOK_NUMBER) v += strtod(r->params + voff, NULL);
+  }
+  jsonrpc_return_success(r, "%g", v);
+}
+
+// Printer that appends to the connection output buffer
+static int conn_print(const char *buf, int len, void *fn_data) {
+  struct conn *c = (struct conn *) fn_data;
+  if (c->out_len + (size_t) len > c->out_size) {
+    size_t size = c->out_size == 0 ? 4096 : c->out_size;
+    char *p;
+    while (size < c->out_len + (size_t) len) size *= 2;
+    if ((p = (char *) realloc(c->out, size)) == NULL) return 0;
+    c->out = p, c->out_size = size;
+  }
+  memcpy(c->out + c->out_len, buf, (size_t) len);
+  c->out_len += (size_t) len;
+  return len;
+}
+
+// Write buffered responses. Return -1 if the connection is broken
+static int conn_flush(struct conn *c) {
+  size_t n = 0;
+  while (n < c->out_len) {
+    ssize_t w = write(c->fd, c->out + n, c->out_len - n);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && errno == EAGAIN) break;
+    if (w <= 0) return -1;
+    n += (size_t) w;
+  }
+  memmove(c->out, c->out + n, c->out_len - n);
+  c->out_len -= n;
+  return 0;
+}
+
+static void conn_close(int ep, struct conn *c) {
+  epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  free(c->out);
+  free(c);
+}
+
+static void conn_watch(int ep, struct conn *c, int op) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (c->out_len > 0 ? EPOLLOUT : 0);
+  ev.data.ptr = c;
+  epoll_ctl(ep, op, c->fd, &ev);
+}
+
+static void accept_all(int ep, int lfd, struct jsonrpc_ctx *ctx) {
+  int fd;
+  while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+    struct conn *c = (struct conn *) calloc(1, sizeof(*c));
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    jsonrpc_stream_init(&c->stream, ctx, c->frame, sizeof(c->frame),
+                        conn_print, c, NULL);
+    conn_watch(ep, c, EPOLL_CTL_ADD);
+  }
+}
+
+// Handle a readable or writable connection. Return -1 to close it
+static int conn_serve(int ep, struct conn *c, unsigned events) {
+  char buf[16384];
+  size_t pending = c->out_len;
+  if (events & EPOLLIN) {
+    for (;;) {
+      ssize_t n = read(c->fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      if (n < 0 && errno == EAGAIN) break;
+      if (n <= 0) return -1;
+      jsonrpc_stream_feed(&c->stream, buf, (int) n);
+    }
+  } else if (events & (EPOLLERR | EPOLLHUP)) {
+    return -1;
+  }
+  if (conn_flush(c) != 0) return -1;
+  if ((pending > 0) != (c->out_len > 0)) conn_watch(ep, c, EPOLL_CTL_MOD);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = "/tmp/mjson-bench.sock";
+  struct epoll_event events[MAX_EVENTS], ev;
+  struct sockaddr_un sa;
+  struct jsonrpc_ctx ctx;
+  int i, ep, lfd;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      path = argv[++i];
+    } else {
+      fprintf(stderr, "Usage: %s [-l SOCKET_PATH]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", path);
+  unlink(path);
+  lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *) &sa, sizeof(sa)) != 0 ||
+      listen(lfd, 128) != 0 || (ep = epoll_create1(0)) < 0) {
+    perror(path);
+    return EXIT_FAILURE;
+  }
+  ev.events = EPOLLIN, ev.data.ptr = NULL;
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+  signal(SIGINT, on_signal);
+  signal(SIGTERM, on_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  if (jsonrpc_ctx_export(&ctx, "noop", noop) != 0 ||
+      jsonrpc_ctx_export(&ctx, "echo", echo) != 0 ||
+      jsonrpc_ctx_export(&ctx, "sum", sum) != 0) {
+    fprintf(stderr, "Cannot export methods\n");
+    return EXIT_FAILURE;
+  }
+  fprintf(stderr, "Listening on %s\n", path);
+
+  while (!s_stop) {
+    int n = epoll_wait(ep, events, MAX_EVENTS, 1000);
+    for (i = 0; i < n; i++) {
+      struct conn *c = (struct conn *) events[i].data.ptr;
+      if (c == NULL) {
+        accept_all(ep, lfd, &ctx);
+      } else if (conn_serve(ep, c, events[i].events) != 0) {
+        conn_close(ep, c);
+      }
+    }
+  }
+
+  jsonrpc_ctx_free(&ctx);
+  close(lfd);
+  unlink(path);
+  return EXIT_SUCCESS;
+}
@@ -23,18 +23,25 @@ static void shadowDeltaHandler(struct jsonrpc_request *r) {
 }
 
 void setup() {
-  jsonrpc_init(NULL, NULL);
-  jsonrpc_export("Shadow.Delta", shadowDeltaHandler);
-
   pinMode(LED_BUILTIN, OUTPUT);  // Configure LED pin
   Serial.begin(115200);          // Init serial comms
+  jsonrpc_init(NULL, NULL);
+  if (jsonrpc_export("Shadow.Delta", shadowDeltaHandler) != 0) {
+    Serial.println("Out of memory");  // Delta updates would be ignored
+  }
   reportState();                 // Let shadow know our state
 }
 
 void loop() {
-  char buf[800];
+  static char frame[800];
+  static struct jsonrpc_stream st;
+  char buf[64];
+  if (st.ctx == NULL) {
+    jsonrpc_stream_init(&st, &jsonrpc_default_context, frame, sizeof(frame),
+                        sender, NULL, NULL);
+  }
   if (Serial.available() > 0) {
     int len = Serial.readBytes(buf, sizeof(buf));
-    jsonrpc_process(buf, len, sender, NULL, NULL);
+    jsonrpc_stream_feed(&st, buf, len);
   }
 }
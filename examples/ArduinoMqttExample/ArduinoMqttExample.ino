@@ -26,16 +26,24 @@ void setup() {
   Serial.begin(115200);                     // Init serial comms
   pinMode(LED_BUILTIN, OUTPUT);             // Configure LED pin
   jsonrpc_init(NULL, NULL);                 // Init JSON-RPC engine
-  jsonrpc_export("MQTT.Message", mqtt_cb);  // Set MQTT message callback
-  jsonrpc_export("Sys.Init", sys_init_cb);  // Set init callback
+  if (jsonrpc_export("MQTT.Message", mqtt_cb) != 0 ||  // MQTT callback
+      jsonrpc_export("Sys.Init", sys_init_cb) != 0) {   // Init callback
+    Serial.println("Out of memory");
+  }
   sys_init_cb(NULL);
 }
 
 void loop() {
-  char buf[800];
+  static char frame[800];
+  static struct jsonrpc_stream st;
+  char buf[64];
+  if (st.ctx == NULL) {
+    jsonrpc_stream_init(&st, &jsonrpc_default_context, frame, sizeof(frame),
+                        wfn, NULL, NULL);
+  }
   if (Serial.available() > 0) {
     int len = Serial.readBytes(buf, sizeof(buf));
-    jsonrpc_process(buf, len, wfn, NULL, NULL);
+    jsonrpc_stream_feed(&st, buf, len);
   }
 
   // Publish to MQTT approximately every 5000 milliseconds.
@@ -0,0 +1,114 @@
+// JSON-RPC between two Linux processes over shared memory rings.
+// Build: cc ring.c ../../src/mjson.c -I../../src -o ring
+//
+// The parent sends requests through one ring, the child answers through
+// the other. Frames are printed into the ring and dispatched from it, and
+// an eventfd per ring wakes up a waiting consumer.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mjson.h"
+
+#define RING_MEM (sizeof(struct jsonrpc_ring) + 4096)
+
+// Wait until the ring has frames
+static void ring_wait(struct jsonrpc_ring *ring, int efd) {
+  eventfd_t v;
+  if (jsonrpc_ring_idle(ring)) eventfd_read(efd, &v);
+}
+
+// Wake up the consumer, if it waits
+static void ring_wake(struct jsonrpc_ring *ring, int efd) {
+  if (jsonrpc_ring_waiting(ring)) eventfd_write(efd, 1);
+}
+
+static void sum(struct jsonrpc_request *r) {
+  double a = 0, b = 0;
+  mjson_get_number(r->params, r->params_len, "$[0]", &a);
+  mjson_get_number(r->params, r->params_len, "$[1]", &b);
+  jsonrpc_return_success(r, "%g", a + b);
+}
+
+static void quit(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "true");
+  *(int *) r->userdata = 1;
+}
+
+static int print_response(const char *buf, int len, void *fn_data) {
+  (void) fn_data;
+  return (int) fwrite(buf, 1, (size_t) len, stdout);
+}
+
+static void server(struct jsonrpc_ring *req, int req_efd,
+                   struct jsonrpc_ring *resp, int resp_efd) {
+  struct jsonrpc_ctx ctx;
+  int done = 0;
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  if (jsonrpc_ctx_export(&ctx, "Sum", sum) != 0 ||
+      jsonrpc_ctx_export(&ctx, "Quit", quit) != 0) {
+    fprintf(stderr, "Cannot export methods\n");
+    exit(EXIT_FAILURE);
+  }
+  while (!done) {
+    ring_wait(req, req_efd);
+    if (jsonrpc_ring_process(&ctx, req, resp, &done) > 0) {
+      ring_wake(resp, resp_efd);
+    }
+  }
+  jsonrpc_ctx_free(&ctx);
+}
+
+static void client(struct jsonrpc_ring *req, int req_efd,
+                   struct jsonrpc_ring *resp, int resp_efd) {
+  struct jsonrpc_ctx ctx;
+  int i, n = 0;
+  jsonrpc_ctx_init(&ctx, print_response, NULL);
+  for (i = 1; i <= 10; i++) {
+    mjson_printf(jsonrpc_ring_print, req, "{%Q:%d,%Q:%Q,%Q:[%d,%d]}", "id", i,
+                 "method", "Sum", "params", i, i * 10);
+    jsonrpc_ring_commit(req);
+    ring_wake(req, req_efd);
+  }
+  mjson_printf(jsonrpc_ring_print, req, "{%Q:%d,%Q:%Q}", "id", i, "method",
+               "Quit");
+  jsonrpc_ring_commit(req);
+  ring_wake(req, req_efd);
+  while (n < i) {
+    ring_wait(resp, resp_efd);
+    n += jsonrpc_ring_process(&ctx, resp, NULL, NULL);
+  }
+  jsonrpc_ctx_free(&ctx);
+}
+
+int main(void) {
+  int fd = memfd_create("jsonrpc", 0);
+  int req_efd = eventfd(0, 0), resp_efd = eventfd(0, 0);
+  char *mem;
+  struct jsonrpc_ring *req, *resp;
+  if (fd < 0 || req_efd < 0 || resp_efd < 0 ||
+      ftruncate(fd, 2 * RING_MEM) != 0) {
+    perror("setup");
+    return EXIT_FAILURE;
+  }
+  mem = (char *) mmap(NULL, 2 * RING_MEM, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, 0);
+  if (mem == MAP_FAILED) {
+    perror("mmap");
+    return EXIT_FAILURE;
+  }
+  req = jsonrpc_ring_init(mem, RING_MEM);
+  resp = jsonrpc_ring_init(mem + RING_MEM, RING_MEM);
+  if (fork() == 0) {
+    server(req, req_efd, resp, resp_efd);
+    return EXIT_SUCCESS;
+  }
+  client(req, req_efd, resp, resp_efd);
+  wait(NULL);
+  return EXIT_SUCCESS;
+}
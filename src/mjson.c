@@ -24,10 +24,6 @@
 
 #include "mjson.h"
 
-#if defined(_MSC_VER)
-#define alloca(x) _alloca(x)
-#endif
-
 #if defined(_MSC_VER) && _MSC_VER < 1700
 #define va_copy(x, y) (x) = (y)
 #define isinf(x) !_finite(x)
@@ -48,6 +44,140 @@ static int mjson_escape(int c) {
   return mjson_esc(c, 1);
 }
 
+static int is_space(int c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+#if MJSON_ENABLE_MERGE || MJSON_ENABLE_RPC
+static unsigned mjson_hash(const char *s, int n) {
+  unsigned h = 2166136261U;  // FNV-1a
+  int i;
+  for (i = 0; i < n; i++) h = (h ^ (unsigned char) s[i]) * 16777619U;
+  return h;
+}
+#endif
+
+#if MJSON_ENABLE_STATS || MJSON_ENABLE_RPC_STATS
+#ifndef MJSON_THREAD_LOCAL
+#if defined(_MSC_VER)
+#define MJSON_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define MJSON_THREAD_LOCAL __thread
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define MJSON_THREAD_LOCAL _Thread_local
+#else
+#define MJSON_THREAD_LOCAL
+#endif
+#endif
+#endif
+
+#if MJSON_ENABLE_STATS
+static MJSON_THREAD_LOCAL struct mjson_stats s_mjson_stats;
+#define MJSON_STAT(name, n) (s_mjson_stats.name += (unsigned long) (n))
+
+void mjson_stats_get(struct mjson_stats *st) {
+  *st = s_mjson_stats;
+}
+
+void mjson_stats_reset(void) {
+  memset(&s_mjson_stats, 0, sizeof(s_mjson_stats));
+}
+#else
+#define MJSON_STAT(name, n) ((void) 0)
+#endif
+
+#if MJSON_ENABLE_ARENA
+// Header of an allocated chunk. Chunk memory follows it, aligned
+struct mjson_arena_chunk {
+  struct mjson_arena_chunk *next;
+};
+
+#define MJSON_ARENA_ALIGN 8
+#define MJSON_ARENA_HDR                                           \
+  ((sizeof(struct mjson_arena_chunk) + MJSON_ARENA_ALIGN - 1) & \
+   ~(size_t) (MJSON_ARENA_ALIGN - 1))
+
+void mjson_arena_init(struct mjson_arena *a, void *mem, size_t mem_size,
+                      size_t chunk) {
+  memset(a, 0, sizeof(*a));
+  a->mem = a->buf = (char *) mem;
+  a->mem_size = a->size = mem == NULL ? 0 : mem_size;
+  a->chunk = chunk;
+}
+
+// Allocate a chunk of at least size bytes and make it the current region
+static int mjson_arena_grow(struct mjson_arena *a, size_t size) {
+  struct mjson_arena_chunk *c;
+  if (size < a->chunk) size = a->chunk;
+  if (size > (size_t) -1 - MJSON_ARENA_HDR) return -1;
+  c = (struct mjson_arena_chunk *) MJSON_REALLOC(NULL, MJSON_ARENA_HDR + size);
+  if (c == NULL) return -1;
+  c->next = a->chunks, a->chunks = c;
+  a->used += a->len;
+  a->buf = (char *) c + MJSON_ARENA_HDR, a->size = size, a->len = 0;
+  return 0;
+}
+
+void *mjson_arena_alloc(struct mjson_arena *a, size_t size) {
+  size_t pad = (0 - ((size_t) a->buf + a->len)) & (MJSON_ARENA_ALIGN - 1);
+  char *p;
+  if (a->buf == NULL || a->len + pad > a->size ||
+      size > a->size - a->len - pad) {
+    if (a->chunk == 0 || mjson_arena_grow(a, size) != 0) return NULL;
+    pad = 0;
+  }
+  p = a->buf + a->len + pad;
+  a->len += pad + size;
+  return p;
+}
+
+// Resize the last allocation in place. Return 0 on success
+static int mjson_arena_extend(struct mjson_arena *a, char *p, size_t old_size,
+                              size_t size) {
+  if (p == NULL || p + old_size != a->buf + a->len) return -1;
+  if (size > a->size - (size_t) (p - a->buf)) return -1;
+  a->len = (size_t) (p - a->buf) + size;
+  return 0;
+}
+
+void *mjson_arena_realloc(struct mjson_arena *a, void *p, size_t old_size,
+                          size_t size) {
+  char *q;
+  if (mjson_arena_extend(a, (char *) p, old_size, size) == 0) return p;
+  if ((q = (char *) mjson_arena_alloc(a, size)) != NULL && p != NULL) {
+    memcpy(q, p, old_size < size ? old_size : size);
+  }
+  return q;
+}
+
+// If the last cycle did not fit in one region, replace all chunks with one
+// that fits it, so that the next cycles do not allocate
+void mjson_arena_reset(struct mjson_arena *a) {
+  if (a->used > 0) {
+    size_t total = a->used + a->len;
+    struct mjson_arena_chunk *c;
+    while ((c = a->chunks) != NULL) {
+      a->chunks = c->next;
+      total += MJSON_ARENA_ALIGN;  // Alignment lost at the region start
+      MJSON_FREE(c);
+    }
+    a->buf = a->mem, a->size = a->mem_size, a->len = a->used = 0;
+    if (total > a->mem_size) mjson_arena_grow(a, total);
+  } else {
+    a->len = 0;
+  }
+}
+
+void mjson_arena_free(struct mjson_arena *a) {
+  struct mjson_arena_chunk *c;
+  while ((c = a->chunks) != NULL) {
+    a->chunks = c->next;
+    MJSON_FREE(c);
+  }
+  mjson_arena_init(a, a->mem, a->mem_size, a->chunk);
+}
+#endif
+
 static int mjson_pass_string(const char *s, int len) {
   int i;
   for (i = 0; i < len; i++) {
@@ -66,8 +196,12 @@ int mjson(const char *s, int len, mjson_cb_t cb, void *ud) {
   enum { S_VALUE, S_KEY, S_COLON, S_COMMA_OR_EOO } expecting = S_VALUE;
   unsigned char nesting[MJSON_MAX_DEPTH];
   int i, depth = 0;
-#define MJSONCALL(ev) \
-  if (cb != NULL && cb(ev, s, start, i - start + 1, ud)) return i + 1;
+#define MJSONCALL(ev)                                                   \
+  MJSON_STAT(tokens, 1);                                                \
+  MJSON_STAT(bytes, i - start + 1);                                     \
+  if (cb != NULL &&                                                     \
+      (MJSON_STAT(callbacks, 1), cb(ev, s, start, i - start + 1, ud))) \
+    return i + 1;
 
 // In the ascii table, the distance between `[` and `]` is 2.
 // Ditto for `{` and `}`. Hence +2 in the code below.
@@ -85,7 +219,7 @@ int mjson(const char *s, int len, mjson_cb_t cb, void *ud) {
     int start = i;
     unsigned char c = ((const unsigned char *) s)[i];
     int tok = c;
-    if (c == ' ' || c == '\t' || c == '\n' || c == '\r') continue;
+    if (is_space(c)) continue;
     // printf("- %c [%.*s] %d %d\n", c, i, s, depth, expecting);
     switch (expecting) {
       case S_VALUE:
@@ -276,9 +410,22 @@ static int mjson_get_cb(int tok, const char *s, int off, int len, void *ud) {
 int mjson_find(const char *s, int n, const char *jp, const char **tp, int *tl) {
   struct msjon_get_data data = {jp, 1,  0,  0,  0,
                                 0,  -1, tp, tl, MJSON_TOK_INVALID};
-  if (jp[0] != '$') return MJSON_TOK_INVALID;
-  if (mjson(s, n, mjson_get_cb, &data) < 0) return MJSON_TOK_INVALID;
-  return data.tok;
+  int end;
+  if (jp[0] != '$') {
+    MJSON_STAT(find_misses, 1);
+    return MJSON_TOK_INVALID;
+  }
+  end = mjson(s, n, mjson_get_cb, &data);
+#if MJSON_ENABLE_STATS
+  if (end < 0 || data.tok == MJSON_TOK_INVALID) {
+    MJSON_STAT(find_misses, 1);
+  } else {
+    MJSON_STAT(find_hits, 1);
+  }
+  while (end > 0 && end < n && is_space(s[end])) end++;
+  if (end > 0 && end < n) MJSON_STAT(find_early_exits, 1);
+#endif
+  return end < 0 ? MJSON_TOK_INVALID : data.tok;
 }
 
 int mjson_get_number(const char *s, int len, const char *path, double *v) {
@@ -489,6 +636,7 @@ int mjson_print_dynamic_buf(const char *ptr, int len, void *fn_data) {
   size_t new_size = curlen + (size_t) len + 1 + MJSON_DYNBUF_CHUNK;
   new_size -= new_size % MJSON_DYNBUF_CHUNK;
 
+  MJSON_STAT(dynbuf_reallocs, 1);
   if ((s = (char *) MJSON_REALLOC(buf, new_size)) == NULL) {
     return 0;
   } else {
@@ -517,12 +665,108 @@ char *mjson_aprintf(const char *fmt, ...) {
   return result;
 }
 
+#if MJSON_ENABLE_ARENA
+// Grow in place while the output is the last allocation of the arena,
+// otherwise move it to a block twice as large
+int mjson_print_arena(const char *ptr, int len, void *fn_data) {
+  struct mjson_arenabuf *ab = (struct mjson_arenabuf *) fn_data;
+  size_t need = (size_t) ab->len + (size_t) len + 1;
+  if (need > (size_t) ab->size &&
+      mjson_arena_extend(ab->arena, ab->ptr, (size_t) ab->size, need) != 0) {
+    size_t size = need * 2 < 64 ? 64 : need * 2;
+    char *p;
+    if (size > 0x7fffffff) return 0;
+    p = (char *) mjson_arena_realloc(ab->arena, ab->ptr, (size_t) ab->size,
+                                     size);
+    if (p == NULL) return 0;
+    ab->ptr = p, ab->size = (int) size;
+  } else if (need > (size_t) ab->size) {
+    ab->size = (int) need;
+  }
+  memcpy(ab->ptr + ab->len, ptr, (size_t) len);
+  ab->len += len;
+  ab->ptr[ab->len] = '\0';
+  return len;
+}
+
+char *mjson_arena_printf(struct mjson_arena *a, const char *fmt, ...) {
+  va_list ap;
+  struct mjson_arenabuf ab = {a, NULL, 0, 0};
+  va_start(ap, fmt);
+  mjson_vprintf(mjson_print_arena, &ab, fmt, &ap);
+  va_end(ap);
+  return ab.ptr;
+}
+#endif
+
+#if MJSON_ENABLE_MERGE || MJSON_ENABLE_RPC
+#if MJSON_ENABLE_ARENA
+// Calls that print into an arena take their scratch memory from it too
+static struct mjson_arena *mjson_arena_of(mjson_print_fn_t fn, void *data) {
+  if (fn != mjson_print_arena) return NULL;
+  return ((struct mjson_arenabuf *) data)->arena;
+}
+
+static void *mjson_scratch_realloc(struct mjson_arena *a, void *p,
+                                   size_t old_size, size_t size) {
+  if (a == NULL) return MJSON_REALLOC(p, size);
+  return mjson_arena_realloc(a, p, old_size, size);
+}
+
+// Arena memory is given back only if it is the last allocation
+static void mjson_scratch_free(struct mjson_arena *a, void *p, size_t size) {
+  if (a == NULL) {
+    MJSON_FREE(p);
+  } else {
+    mjson_arena_extend(a, (char *) p, size, 0);
+  }
+}
+#else
+struct mjson_arena;
+#define mjson_arena_of(fn, data) \
+  ((void) (fn), (void) (data), (struct mjson_arena *) NULL)
+#define mjson_scratch_realloc(a, p, old_size, size) \
+  ((void) (a), (void) (old_size), MJSON_REALLOC((p), (size)))
+#define mjson_scratch_free(a, p, size) \
+  ((void) (a), (void) (size), MJSON_FREE(p))
+#endif
+#endif
+
 int mjson_print_null(const char *ptr, int len, void *userdata) {
   (void) ptr;
   (void) userdata;
   return len;
 }
 
+#if MJSON_ENABLE_MARSHAL || MJSON_ENABLE_PRETTY
+// Write buffer, that coalesces many small writes into one printer call.
+// Used by the functions that produce lots of short tokens.
+struct mjson_wbuf {
+  mjson_print_fn_t fn;  // Underlying printer function
+  void *fn_data;        // Underlying printer function data
+  int len;              // Number of bytes buffered
+  int total;            // Number of bytes flushed
+  char buf[MJSON_WBUF_SIZE];
+};
+
+static void mjson_wbuf_flush(struct mjson_wbuf *w) {
+  if (w->len > 0) w->total += w->fn(w->buf, w->len, w->fn_data);
+  w->len = 0;
+}
+
+static int mjson_print_wbuf(const char *ptr, int len, void *fn_data) {
+  struct mjson_wbuf *w = (struct mjson_wbuf *) fn_data;
+  if (w->len + len > (int) sizeof(w->buf)) mjson_wbuf_flush(w);
+  if (len > (int) sizeof(w->buf)) {
+    w->total += w->fn(ptr, len, w->fn_data);  // Too big, pass through
+  } else {
+    memcpy(w->buf + w->len, ptr, (size_t) len);
+    w->len += len;
+  }
+  return len;
+}
+#endif
+
 int mjson_print_buf(mjson_print_fn_t fn, void *fnd, const char *buf, int len) {
   return fn(buf, len, fnd);
 }
@@ -618,16 +862,18 @@ int mjson_print_dbl(mjson_print_fn_t fn, void *fnd, double d, int width) {
 }
 
 int mjson_print_str(mjson_print_fn_t fn, void *fnd, const char *s, int len) {
-  int i, n = fn("\"", 1, fnd);
-  for (i = 0; i < len; i++) {
+  int i, j, n = fn("\"", 1, fnd);
+  // Print runs of characters that do not need escaping in one go
+  for (i = j = 0; i < len; i++) {
     char c = (char) (unsigned char) mjson_escape(s[i]);
     if (c) {
-      n += fn("\\", 1, fnd);
-      n += fn(&c, 1, fnd);
-    } else {
-      n += fn(&s[i], 1, fnd);
+      char esc[2] = {'\\', c};
+      if (i > j) n += fn(&s[j], i - j, fnd);
+      n += fn(esc, sizeof(esc), fnd);
+      j = i + 1;
     }
   }
+  if (i > j) n += fn(&s[j], i - j, fnd);
   return n + fn("\"", 1, fnd);
 }
 
@@ -648,9 +894,32 @@ int mjson_print_b64(mjson_print_fn_t fn, void *fnd, const unsigned char *s,
 }
 #endif /* MJSON_ENABLE_BASE64 */
 
+#if MJSON_ENABLE_STATS
+struct mjson_stats_printer {
+  mjson_print_fn_t fn;
+  void *fn_data;
+};
+
+// Counts the printer calls of mjson_vprintf(). %M callbacks get the
+// caller's printer, not this one, and count their own nested calls
+static int mjson_stats_print(const char *buf, int len, void *fn_data) {
+  struct mjson_stats_printer *sp = (struct mjson_stats_printer *) fn_data;
+  MJSON_STAT(print_calls, 1);
+  MJSON_STAT(print_bytes, len);
+  return sp->fn(buf, len, sp->fn_data);
+}
+#endif
+
 int mjson_vprintf(mjson_print_fn_t fn, void *fnd, const char *fmt,
                   va_list *ap) {
   int i = 0, n = 0;
+  mjson_print_fn_t cfn = fn;  // Caller's printer, handed to %M callbacks
+  void *cfnd = fnd;
+#if MJSON_ENABLE_STATS
+  struct mjson_stats_printer sp;
+  sp.fn = fn, sp.fn_data = fnd;
+  fn = mjson_stats_print, fnd = &sp;
+#endif
   while (fmt[i] != '\0') {
     if (fmt[i] == '%') {
       char fc = fmt[++i];
@@ -713,7 +982,7 @@ int mjson_vprintf(mjson_print_fn_t fn, void *fnd, const char *fmt,
         n += fn("\"", 1, fnd);
       } else if (fc == 'M') {
         mjson_vprint_fn_t vfn = va_arg(*ap, mjson_vprint_fn_t);
-        n += vfn(fn, fnd, ap);
+        n += vfn(cfn, cfnd, ap);  // Callbacks may dispatch on the printer
       }
       i++;
     } else {
@@ -731,6 +1000,70 @@ int mjson_printf(mjson_print_fn_t fn, void *fnd, const char *fmt, ...) {
   va_end(ap);
   return len;
 }
+
+#if MJSON_ENABLE_MARSHAL
+static void mjson_marshal_obj(struct mjson_wbuf *w,
+                              const struct mjson_field *desc, int n,
+                              const char *base) {
+  int i;
+  mjson_print_wbuf("{", 1, w);
+  for (i = 0; i < n; i++) {
+    const struct mjson_field *f = &desc[i];
+    const char *p = base + f->offset;
+    if (i > 0) mjson_print_wbuf(",", 1, w);
+    mjson_print_wbuf(f->key, f->key_len, w);
+    switch (f->type) {
+      case MJSON_TYPE_BOOL:
+        if (*(const int *) p) {
+          mjson_print_wbuf("true", 4, w);
+        } else {
+          mjson_print_wbuf("false", 5, w);
+        }
+        break;
+      case MJSON_TYPE_INT:
+        mjson_print_int(mjson_print_wbuf, w, *(const int *) p, 1);
+        break;
+      case MJSON_TYPE_LONG:
+        mjson_print_long(mjson_print_wbuf, w, *(const long *) p, 1);
+        break;
+      case MJSON_TYPE_DOUBLE:
+        mjson_print_dbl(mjson_print_wbuf, w, *(const double *) p, 6);
+        break;
+      case MJSON_TYPE_STRING: {
+        const char *end = (const char *) memchr(p, '\0', (size_t) f->size);
+        int len = end == NULL ? f->size : (int) (end - p);
+        mjson_print_str(mjson_print_wbuf, w, p, len);
+        break;
+      }
+      case MJSON_TYPE_STRPTR: {
+        const char *str = *(const char *const *) p;
+        if (str == NULL) {
+          mjson_print_wbuf("null", 4, w);
+        } else {
+          mjson_print_str(mjson_print_wbuf, w, str, (int) strlen(str));
+        }
+        break;
+      }
+      case MJSON_TYPE_OBJECT:
+        mjson_marshal_obj(w, f->sub, f->nsub, p);
+        break;
+      default:
+        mjson_print_wbuf("null", 4, w);
+        break;
+    }
+  }
+  mjson_print_wbuf("}", 1, w);
+}
+
+int mjson_marshal(mjson_print_fn_t fn, void *fnd,
+                  const struct mjson_field *desc, int n, const void *in) {
+  struct mjson_wbuf w;
+  w.fn = fn, w.fn_data = fnd, w.len = w.total = 0;
+  mjson_marshal_obj(&w, desc, n, (const char *) in);
+  mjson_wbuf_flush(&w);
+  return w.total;
+}
+#endif  // MJSON_ENABLE_MARSHAL
 #endif /* MJSON_ENABLE_PRINT */
 
 static int is_digit(int c) {
@@ -815,49 +1148,352 @@ done:
 }
 
 #if MJSON_ENABLE_MERGE
-int mjson_merge(const char *s, int n, const char *s2, int n2,
-                mjson_print_fn_t fn, void *userdata) {
-  int koff, klen, voff, vlen, t, t2, k, off = 0, len = 0, comma = 0;
+#define MJSON_KV_STACK 8   // Number of object members collected on stack
+#define MJSON_DOC_STACK 4  // Number of nested patches collected on stack
+
+struct mjson_kv {
+  const char *k;  // Key, including quotes
+  const char *v;  // Value
+  int klen;       // Key length
+  int vlen;       // Value length
+  int type;       // Value type
+  int doc;        // Index of the document this member belongs to
+  int next;       // Next member with the same key in the later documents
+  int tail;       // For the first member with this key, last chain element
+  int mark;       // Merge: first member with this key. Diff: matched member
+};
+
+// Table of object members. It starts in a caller-provided array and, if
+// `grow` is set, moves to scratch memory once the array is full
+struct mjson_kvtab {
+  struct mjson_kv *kv;        // Members
+  int max;                    // Table size
+  int n;                      // Number of members seen, can be larger than max
+  int grow;                   // Set if the table can grow
+  void *mem;                  // Scratch memory of the table, or NULL
+  size_t size;                // Scratch memory size
+  struct mjson_arena *arena;  // Arena of the scratch memory, or NULL
+};
+
+struct mjson_kvdata {
+  struct mjson_kvtab *t;  // Destination table
+  int depth;              // Current nesting depth
+  int is_object;          // Set if the top level value is an object
+  struct mjson_kv cur;    // Member that is being parsed
+};
+
+// Resize the scratch memory of the table to size bytes. Members stay at
+// its start. Return 0 on success, or -1 on allocation failure
+static int mjson_kvtab_resize(struct mjson_kvtab *t, size_t size) {
+  void *p = mjson_scratch_realloc(t->arena, t->mem, t->size, size);
+  if (p == NULL) return -1;
+  if (t->mem == NULL) {
+    memcpy(p, t->kv, (size_t) (t->n < t->max ? t->n : t->max) * sizeof(*t->kv));
+  }
+  t->kv = (struct mjson_kv *) p, t->mem = p, t->size = size;
+  return 0;
+}
+
+static void mjson_kvtab_free(struct mjson_kvtab *t) {
+  if (t->mem != NULL) mjson_scratch_free(t->arena, t->mem, t->size);
+}
+
+static void mjson_kv_add(struct mjson_kvdata *d) {
+  struct mjson_kvtab *t = d->t;
+  if (t->n >= t->max && t->grow) {
+    if (mjson_kvtab_resize(t, (size_t) t->max * 2 * sizeof(*t->kv)) == 0) {
+      t->max *= 2;
+    } else {
+      t->grow = 0;  // Keep counting, the caller sees n > max
+    }
+  }
+  if (t->n < t->max) t->kv[t->n] = d->cur;
+  t->n++;
+}
+
+static int mjson_kv_cb(int tok, const char *s, int off, int len, void *ud) {
+  struct mjson_kvdata *d = (struct mjson_kvdata *) ud;
+  if (tok == '{' || tok == '[') {
+    if (d->depth == 0) d->is_object = tok == '{';
+    if (d->depth == 1) {
+      d->cur.v = s + off;
+      d->cur.type = tok == '{' ? MJSON_TOK_OBJECT : MJSON_TOK_ARRAY;
+    }
+    d->depth++;
+  } else if (tok == '}' || tok == ']') {
+    d->depth--;
+    if (d->depth == 1) {
+      d->cur.vlen = (int) (s + off + len - d->cur.v);
+      mjson_kv_add(d);
+    }
+  } else if (d->depth == 1 && tok == MJSON_TOK_KEY) {
+    d->cur.k = s + off, d->cur.klen = len;
+  } else if (d->depth == 1 && MJSON_TOK_IS_VALUE(tok)) {
+    d->cur.v = s + off, d->cur.vlen = len, d->cur.type = tok;
+    mjson_kv_add(d);
+  }
+  return 0;
+}
+
+// Append top level members of an object to the kv table.
+// Return the number of members, or -1 if s, n is not a valid object.
+static int mjson_kv_collect(struct mjson_kvtab *t, const char *s, int n,
+                            int doc) {
+  struct mjson_kvdata d;
+  int start = t->n;
+  memset(&d, 0, sizeof(d));
+  d.t = t, d.cur.doc = doc;
+  if (mjson(s, n, mjson_kv_cb, &d) < 0 || !d.is_object) {
+    t->n = start;
+    return -1;
+  }
+  return t->n - start;
+}
+
+// Open addressing hash index over the kv table keys, slots hold index + 1.
+// Return the index of the member with the same key. If not found, return -1
+// and insert member `add` into the index.
+static int mjson_kv_index(struct mjson_kv *kv, int *ht, int hsize, int add) {
+  const char *k = kv[add].k;
+  int klen = kv[add].klen;
+  unsigned i = mjson_hash(k, klen) & (unsigned) (hsize - 1);
+  while (ht[i] != 0) {
+    struct mjson_kv *e = &kv[ht[i] - 1];
+    if (e->klen == klen && memcmp(e->k, k, (size_t) klen) == 0) {
+      return ht[i] - 1;
+    }
+    i = (i + 1) & (unsigned) (hsize - 1);
+  }
+  ht[i] = add + 1;
+  return -1;
+}
+
+static int mjson_hsize(int n) {
+  int size = 4;
+  while (size < n * 2) size *= 2;
+  return size;
+}
+
+static int mjson_is_object(const char *s, int n) {
+  int i = 0;
+  while (i < n && is_space(s[i])) i++;
+  return i < n && s[i] == '{';
+}
+
+int mjson_merge_many(const char *s, int n, const char **p, const int *pn,
+                     int np, mjson_print_fn_t fn, void *userdata) {
+  struct mjson_kv kvs[MJSON_KV_STACK], *kv;
+  int hts[MJSON_KV_STACK * 2], *ht = hts;
+  const char *cps[MJSON_DOC_STACK], **cp = cps;
+  int cns[MJSON_DOC_STACK], *cn = cns;
+  int i, j, nc, hsize, total, len = 0, comma = 0, err = 0;
+  struct mjson_kvtab t;
+
   if (n < 2) return len;
+
+  // A patch that is not an object replaces everything before it.
+  // Invalid patches are ignored, i.e. treated as empty objects.
+  for (i = np - 1; i >= 0; i--) {
+    if (!mjson_is_object(p[i], pn[i]) && mjson(p[i], pn[i], NULL, NULL) > 0)
+      break;
+  }
+  if (i >= 0) {
+    if (i == np - 1) return fn(p[i], pn[i], userdata);
+    s = "{}", n = 2, p += i + 1, pn += i + 1, np -= i + 1;
+  }
+
+  // Collect members of the original and all patches in a single pass.
+  // If the stack tables are too small, the member table moves to a scratch
+  // block, that is then extended to hold the other tables too.
+  memset(&t, 0, sizeof(t));
+  t.kv = kvs, t.max = MJSON_KV_STACK, t.grow = 1;
+  t.arena = mjson_arena_of(fn, userdata);
+  for (i = 0; i <= np; i++) {
+    mjson_kv_collect(&t, i == 0 ? s : p[i - 1], i == 0 ? n : pn[i - 1], i);
+  }
+  total = t.n, hsize = mjson_hsize(total);
+  if (total > t.max) {
+    mjson_kvtab_free(&t);
+    return -1;
+  } else if (total > MJSON_KV_STACK || np >= MJSON_DOC_STACK) {
+    size_t size = (size_t) total * sizeof(*kv);
+    size += (size_t) (np + 1) * (sizeof(*cp) + sizeof(*cn));
+    size += (size_t) hsize * sizeof(*ht);
+    if (mjson_kvtab_resize(&t, size) != 0) {
+      mjson_kvtab_free(&t);
+      return -1;
+    }
+    cp = (const char **) (t.kv + total);
+    cn = (int *) (cp + np + 1);
+    ht = cn + np + 1;
+  }
+  kv = t.kv;
+
+  // Chain members with the same key, in the order of documents
+  memset(ht, 0, (size_t) hsize * sizeof(*ht));
+  for (i = 0; i < total; i++) {
+    kv[i].next = -1, kv[i].tail = i, kv[i].mark = 0;
+    if ((j = mjson_kv_index(kv, ht, hsize, i)) < 0) {
+      kv[i].mark = 1;
+    } else if (kv[kv[j].tail].doc != kv[i].doc) {
+      kv[kv[j].tail].next = i;  // Duplicate keys in one document: first wins
+      kv[j].tail = i;
+    }
+  }
+
   len += fn("{", 1, userdata);
-  while ((off = mjson_next(s, n, off, &koff, &klen, &voff, &vlen, &t)) != 0) {
-    char *path = (char *) alloca((size_t) klen + 1);
-    const char *val;
-    memcpy(path, "$.", 2);
-    memcpy(path + 2, s + koff + 1, (size_t) (klen - 2));
-    path[klen] = '\0';
-    if ((t2 = mjson_find(s2, n2, path, &val, &k)) != MJSON_TOK_INVALID) {
-      if (t2 == MJSON_TOK_NULL) continue;  // null deletes the key
-    } else {
-      val = s + voff;  // Key is not found in the update. Copy the old value.
+  for (i = 0; i < total; i++) {
+    int last = -1, k;
+    if (!kv[i].mark) continue;
+    // Find the last non-object value. All values after it are objects, and
+    // they are merged together. If there are none, the last value wins.
+    for (j = i; j >= 0; j = kv[j].next) {
+      if (kv[j].type != MJSON_TOK_OBJECT) last = j;
+    }
+    for (nc = 0, j = last < 0 ? i : kv[last].next; j >= 0; j = kv[j].next) {
+      cp[nc] = kv[j].v, cn[nc++] = kv[j].vlen;
+    }
+    if (nc == 0 && kv[last].doc > 0 && kv[last].type == MJSON_TOK_NULL) {
+      continue;  // null deletes the key
     }
     if (comma) len += fn(",", 1, userdata);
-    len += fn(s + koff, klen, userdata);
+    len += fn(kv[i].k, kv[i].klen, userdata);
     len += fn(":", 1, userdata);
-    if (t == MJSON_TOK_OBJECT && t2 == MJSON_TOK_OBJECT) {
-      len += mjson_merge(s + voff, vlen, val, k, fn, userdata);
+    if (nc == 0) {
+      k = fn(kv[last].v, kv[last].vlen, userdata);
+    } else if (last < 0 && kv[i].doc == 0) {
+      k = mjson_merge_many(cp[0], cn[0], cp + 1, cn + 1, nc - 1, fn, userdata);
     } else {
-      if (t2 != MJSON_TOK_INVALID) vlen = k;
-      len += fn(val, vlen, userdata);
+      // Patching non-object with an object is a patch of an empty object
+      k = mjson_merge_many("{}", 2, cp, cn, nc, fn, userdata);
     }
+    if (k < 0) err = 1;
+    len += k;
     comma = 1;
   }
-  // Add missing keys
-  off = 0;
-  while ((off = mjson_next(s2, n2, off, &koff, &klen, &voff, &vlen, &t)) != 0) {
-    char *path = (char *) alloca((size_t) klen + 1);
-    const char *val;
-    if (t == MJSON_TOK_NULL) continue;
-    memcpy(path, "$.", 2);
-    memcpy(path + 2, s2 + koff + 1, (size_t) (klen - 2));
-    path[klen] = '\0';
-    if (mjson_find(s, n, path, &val, &vlen) != MJSON_TOK_INVALID) continue;
-    if (comma) len += fn(",", 1, userdata);
-    len += fn(s2 + koff, klen, userdata);
-    len += fn(":", 1, userdata);
-    len += fn(s2 + voff, vlen, userdata);
-    comma = 1;
+  len += fn("}", 1, userdata);
+  mjson_kvtab_free(&t);
+  return err ? -1 : len;
+}
+
+int mjson_merge(const char *s, int n, const char *s2, int n2,
+                mjson_print_fn_t fn, void *userdata) {
+  return mjson_merge_many(s, n, &s2, &n2, 1, fn, userdata);
+}
+
+struct mjson_diffdata {
+  struct mjson_diffdata *parent;  // Enclosing object, NULL for the top level
+  const char *k;                  // Key of this object in the parent
+  int klen;                       // Key length
+  int opened;                     // Set when the opening brace is printed
+  int comma;                      // Set when a member is printed
+  mjson_print_fn_t fn;            // Printer function
+  void *fn_data;                  // Printer function data
+  int *len;                       // Number of bytes printed
+};
+
+// Nested objects are printed lazily, only if they contain a change
+static void mjson_diff_open(struct mjson_diffdata *d) {
+  if (d->opened) return;
+  if (d->parent != NULL) {
+    mjson_diff_open(d->parent);
+    if (d->parent->comma) *d->len += d->fn(",", 1, d->fn_data);
+    *d->len += d->fn(d->k, d->klen, d->fn_data);
+    *d->len += d->fn(":", 1, d->fn_data);
+    d->parent->comma = 1;
+  }
+  *d->len += d->fn("{", 1, d->fn_data);
+  d->opened = 1;
+}
+
+static void mjson_diff_member(struct mjson_diffdata *d, const char *k,
+                              int klen, const char *v, int vlen) {
+  mjson_diff_open(d);
+  if (d->comma) *d->len += d->fn(",", 1, d->fn_data);
+  *d->len += d->fn(k, klen, d->fn_data);
+  *d->len += d->fn(":", 1, d->fn_data);
+  *d->len += d->fn(v, vlen, d->fn_data);
+  d->comma = 1;
+}
+
+static int mjson_diff_obj(struct mjson_diffdata *d, const char *s, int n,
+                          const char *s2, int n2) {
+  struct mjson_kv kvs[MJSON_KV_STACK], *kv;
+  int hts[MJSON_KV_STACK * 2], *ht = hts;
+  int i, j, n1, total, hsize, err = 0;
+  struct mjson_kvtab t;
+
+  memset(&t, 0, sizeof(t));
+  t.kv = kvs, t.max = MJSON_KV_STACK, t.grow = 1;
+  t.arena = mjson_arena_of(d->fn, d->fn_data);
+  if ((n1 = mjson_kv_collect(&t, s, n, 0)) < 0) return -1;
+  if (mjson_kv_collect(&t, s2, n2, 1) < 0 || t.n > t.max) {
+    mjson_kvtab_free(&t);
+    return -1;
+  }
+  total = t.n, hsize = mjson_hsize(total);
+  if (total > MJSON_KV_STACK) {
+    size_t size = (size_t) total * sizeof(*kv) + (size_t) hsize * sizeof(*ht);
+    if (mjson_kvtab_resize(&t, size) != 0) {
+      mjson_kvtab_free(&t);
+      return -1;
+    }
+    ht = (int *) (t.kv + total);
+  }
+  kv = t.kv;
+
+  // Index old members. Duplicates are marked as matched, first one wins
+  memset(ht, 0, (size_t) hsize * sizeof(*ht));
+  for (i = 0; i < n1; i++) kv[i].mark = mjson_kv_index(kv, ht, hsize, i) >= 0;
+
+  for (i = n1; i < total; i++) {
+    struct mjson_kv *a, *b = &kv[i];
+    if ((j = mjson_kv_index(kv, ht, hsize, i)) < 0) {
+      mjson_diff_member(d, b->k, b->klen, b->v, b->vlen);  // Added
+      continue;
+    } else if (j >= n1) {
+      continue;  // Duplicate key in the new object
+    }
+    a = &kv[j];
+    a->mark = 1;
+    if (a->vlen == b->vlen && memcmp(a->v, b->v, (size_t) a->vlen) == 0) {
+      continue;  // Unchanged
+    } else if (a->type == MJSON_TOK_OBJECT && b->type == MJSON_TOK_OBJECT) {
+      struct mjson_diffdata child;
+      memset(&child, 0, sizeof(child));
+      child.parent = d, child.k = b->k, child.klen = b->klen;
+      child.fn = d->fn, child.fn_data = d->fn_data, child.len = d->len;
+      if (mjson_diff_obj(&child, a->v, a->vlen, b->v, b->vlen) < 0) err = 1;
+      if (child.opened) *d->len += d->fn("}", 1, d->fn_data);
+    } else {
+      mjson_diff_member(d, b->k, b->klen, b->v, b->vlen);  // Changed
+    }
+  }
+
+  // Deleted members
+  for (i = 0; i < n1; i++) {
+    if (!kv[i].mark) mjson_diff_member(d, kv[i].k, kv[i].klen, "null", 4);
+  }
+
+  mjson_kvtab_free(&t);
+  return err ? -1 : 0;
+}
+
+int mjson_diff(const char *s, int n, const char *s2, int n2,
+               mjson_print_fn_t fn, void *userdata) {
+  struct mjson_diffdata d;
+  int len = 0;
+  if (mjson(s, n, NULL, NULL) < 0 || mjson(s2, n2, NULL, NULL) < 0) {
+    return -1;  // Nothing is printed for invalid documents
+  } else if (!mjson_is_object(s2, n2)) {
+    return fn(s2, n2, userdata);  // Non-object patch replaces the target
+  } else if (!mjson_is_object(s, n)) {
+    return fn(s2, n2, userdata);  // Object patch for non-object target
   }
+  memset(&d, 0, sizeof(d));
+  d.fn = fn, d.fn_data = userdata, d.len = &len;
+  mjson_diff_open(&d);
+  if (mjson_diff_obj(&d, s, n, s2, n2) < 0) return -1;
   len += fn("}", 1, userdata);
   return len;
 }
@@ -865,72 +1501,193 @@ int mjson_merge(const char *s, int n, const char *s2, int n2,
 
 #if MJSON_ENABLE_PRETTY
 struct prettydata {
-  int level;
-  int len;
-  int prev;
-  const char *pad;
-  int padlen;
-  mjson_print_fn_t fn;
-  void *userdata;
+  struct mjson_pretty_stream ps;  // Pad, level and previous token
+  struct mjson_wbuf *w;
 };
 
+// Fill nl with a newline followed by the indentation of as many levels as
+// fit, up to the max depth. Return the number of levels
+static int mjson_pretty_nl_init(char *nl, int size, const char *pad,
+                                int padlen) {
+  int i, levels = padlen > 0 ? (size - 1) / padlen : 0;
+  if (levels > MJSON_MAX_DEPTH) levels = MJSON_MAX_DEPTH;
+  nl[0] = '\n';
+  for (i = 0; i < levels; i++) {
+    memcpy(nl + 1 + i * padlen, pad, (size_t) padlen);
+  }
+  return levels;
+}
+
+// Print a newline followed by the indentation of the current level, with a
+// single write. Only levels deeper than the precomputed ones need more
+static void mjson_pretty_nl(struct mjson_wbuf *w,
+                            const struct mjson_pretty_stream *ps) {
+  int n = ps->level < 0 ? 0 : ps->level;
+  if (ps->padlen <= 0) return;
+  if (n > ps->nl_levels) n = ps->nl_levels;
+  mjson_print_wbuf(ps->nl, 1 + n * ps->padlen, w);
+  for (; n < ps->level; n++) mjson_print_wbuf(ps->pad, ps->padlen, w);
+}
+
 static int pretty_cb(int ev, const char *s, int off, int len, void *ud) {
   struct prettydata *d = (struct prettydata *) ud;
-  int i;
   switch (ev) {
     case '{':
     case '[':
-      d->level++;
-      d->len += d->fn(s + off, len, d->userdata);
+      d->ps.level++;
+      mjson_print_wbuf(s + off, len, d->w);
       break;
     case '}':
     case ']':
-      d->level--;
-      if (d->prev != '[' && d->prev != '{' && d->padlen > 0) {
-        d->len += d->fn("\n", 1, d->userdata);
-        for (i = 0; i < d->level; i++)
-          d->len += d->fn(d->pad, d->padlen, d->userdata);
-      }
-      d->len += d->fn(s + off, len, d->userdata);
+      d->ps.level--;
+      if (d->ps.prev != '[' && d->ps.prev != '{') mjson_pretty_nl(d->w, &d->ps);
+      mjson_print_wbuf(s + off, len, d->w);
       break;
     case ',':
-      d->len += d->fn(s + off, len, d->userdata);
-      if (d->padlen > 0) {
-        d->len += d->fn("\n", 1, d->userdata);
-        for (i = 0; i < d->level; i++)
-          d->len += d->fn(d->pad, d->padlen, d->userdata);
-      }
+      mjson_print_wbuf(s + off, len, d->w);
+      mjson_pretty_nl(d->w, &d->ps);
       break;
     case ':':
-      d->len += d->fn(s + off, len, d->userdata);
-      if (d->padlen > 0) d->len += d->fn(" ", 1, d->userdata);
+      mjson_print_wbuf(s + off, len, d->w);
+      if (d->ps.padlen > 0) mjson_print_wbuf(" ", 1, d->w);
       break;
     case MJSON_TOK_KEY:
-      if (d->prev == '{' && d->padlen > 0) {
-        d->len += d->fn("\n", 1, d->userdata);
-        for (i = 0; i < d->level; i++)
-          d->len += d->fn(d->pad, d->padlen, d->userdata);
-      }
-      d->len += d->fn(s + off, len, d->userdata);
+      if (d->ps.prev == '{') mjson_pretty_nl(d->w, &d->ps);
+      mjson_print_wbuf(s + off, len, d->w);
       break;
     default:
-      if (d->prev == '[' && d->padlen > 0) {
-        d->len += d->fn("\n", 1, d->userdata);
-        for (i = 0; i < d->level; i++)
-          d->len += d->fn(d->pad, d->padlen, d->userdata);
-      }
-      d->len += d->fn(s + off, len, d->userdata);
+      if (d->ps.prev == '[') mjson_pretty_nl(d->w, &d->ps);
+      mjson_print_wbuf(s + off, len, d->w);
       break;
   }
-  d->prev = ev;
+  d->ps.prev = ev;
   return 0;
 }
 
 int mjson_pretty(const char *s, int n, const char *pad, mjson_print_fn_t fn,
                  void *userdata) {
-  struct prettydata d = {0, 0, 0, pad, (int) strlen(pad), fn, userdata};
+  struct mjson_wbuf w;
+  struct prettydata d;
+  mjson_pretty_init(&d.ps, pad, fn, userdata);
+  d.w = &w;
+  w.fn = fn, w.fn_data = userdata, w.len = w.total = 0;
   if (mjson(s, n, pretty_cb, &d) < 0) return -1;
-  return d.len;
+  mjson_wbuf_flush(&w);
+  return w.total;
+}
+
+void mjson_pretty_init(struct mjson_pretty_stream *ps, const char *pad,
+                       mjson_print_fn_t fn, void *userdata) {
+  memset(ps, 0, sizeof(*ps));
+  ps->pad = pad, ps->padlen = (int) strlen(pad);
+  ps->fn = fn, ps->fn_data = userdata;
+  ps->nl_levels =
+      mjson_pretty_nl_init(ps->nl, (int) sizeof(ps->nl), pad, ps->padlen);
+}
+
+// Character-level variant of the pretty_cb(), that does not need the whole
+// document in memory. The output is the same for valid input.
+int mjson_pretty_feed(struct mjson_pretty_stream *ps, const char *s, int n) {
+  struct mjson_wbuf w;
+  int i, j;
+  w.fn = ps->fn, w.fn_data = ps->fn_data, w.len = w.total = 0;
+  for (i = 0; i < n && ps->level >= 0; i++) {
+    char c = s[i];
+    if (ps->escaped) {
+      ps->escaped = 0;
+      mjson_print_wbuf(&c, 1, &w);
+      continue;
+    } else if (ps->in_string) {
+      // Copy the string up to the closing quote or an escape
+      j = i;
+      while (i < n && s[i] != '"' && s[i] != '\\') i++;
+      if (i > j) mjson_print_wbuf(s + j, i - j, &w);
+      if (i >= n) break;
+      c = s[i];
+      if (c == '\\') {
+        ps->escaped = 1;
+      } else {
+        ps->in_string = 0;
+      }
+      mjson_print_wbuf(&c, 1, &w);
+      continue;
+    }
+    switch (c) {
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\n':
+        continue;
+      case '{':
+      case '[':
+        ps->level++;
+        mjson_print_wbuf(&c, 1, &w);
+        break;
+      case '}':
+      case ']':
+        ps->level--;
+        if (ps->prev != '[' && ps->prev != '{') {
+          mjson_pretty_nl(&w, ps);
+        }
+        mjson_print_wbuf(&c, 1, &w);
+        break;
+      case ',':
+        mjson_print_wbuf(&c, 1, &w);
+        mjson_pretty_nl(&w, ps);
+        break;
+      case ':':
+        mjson_print_wbuf(&c, 1, &w);
+        if (ps->padlen > 0) mjson_print_wbuf(" ", 1, &w);
+        break;
+      default:
+        // Key, string or scalar value. Scalars are printed char by char,
+        // and prev is reset on the first one to not break them apart
+        if (ps->prev == '[' || ps->prev == '{') {
+          mjson_pretty_nl(&w, ps);
+        }
+        if (c == '"') ps->in_string = 1;
+        mjson_print_wbuf(&c, 1, &w);
+        c = 'v';
+        break;
+    }
+    ps->prev = c;
+  }
+  mjson_wbuf_flush(&w);
+  ps->len += w.total;
+  return ps->level < 0 ? -1 : w.total;
+}
+
+int mjson_minify(const char *s, int n, mjson_print_fn_t fn, void *userdata) {
+  int i = 0, j, len = 0;
+  while (i < n) {
+    while (i < n && is_space(s[i])) i++;
+    // Find the end of a span of significant characters. Strings can contain
+    // whitespace, so they're always a part of the span
+    for (j = i; i < n && !is_space(s[i]); i++) {
+      if (s[i] != '"') continue;
+      for (i++; i < n && s[i] != '"'; i++) {
+        if (s[i] == '\\') i++;
+      }
+      if (i >= n) return -1;  // Unterminated string
+    }
+    if (i > j) len += fn(s + j, i - j, userdata);
+  }
+  return len;
+}
+
+static int mjson_print_inplace(const char *ptr, int len, void *userdata) {
+  struct mjson_fixedbuf *fb = (struct mjson_fixedbuf *) userdata;
+  // Output never overtakes input, so it's safe to move the data in place
+  if (fb->ptr + fb->len != ptr) memmove(fb->ptr + fb->len, ptr, (size_t) len);
+  fb->len += len;
+  return len;
+}
+
+int mjson_minify_inplace(char *s, int n) {
+  struct mjson_fixedbuf fb = {s, n, 0};
+  if (mjson_minify(s, n, mjson_print_inplace, &fb) < 0) return -1;
+  if (fb.len < n) s[fb.len] = '\0';
+  return fb.len;
 }
 #endif  // MJSON_ENABLE_PRETTY
 
@@ -944,7 +1701,7 @@ int mjson_globmatch(const char *s1, int n1, const char *s2, int n2) {
       i++, j++;
     } else if (i < n1 && (s1[i] == '*' || s1[i] == '#')) {
       ni = i, nj = j + 1, i++;
-    } else if (nj > 0 && nj <= n2 && (s1[i - 1] == '#' || s2[j] != '/')) {
+    } else if (nj > 0 && nj <= n2 && (s1[ni] == '#' || s2[nj - 1] != '/')) {
       i = ni, j = nj;
     } else {
       return 0;
@@ -953,21 +1710,963 @@ int mjson_globmatch(const char *s1, int n1, const char *s2, int n2) {
   return 1;
 }
 
-void jsonrpc_return_errorv(struct jsonrpc_request *r, int code,
-                           const char *message, const char *data_fmt,
-                           va_list *ap) {
-  if (r->id_len == 0) return;
-  mjson_printf(r->fn, r->fn_data,
-               "{\"id\":%.*s,\"error\":{\"code\":%d,\"message\":%Q", r->id_len,
-               r->id, code, message == NULL ? "" : message);
-  if (data_fmt != NULL) {
-    mjson_printf(r->fn, r->fn_data, ",\"data\":");
-    mjson_vprintf(r->fn, r->fn_data, data_fmt, ap);
+#if MJSON_ENABLE_GLOBSET
+// A globset is a trie of pattern segments. Literal segments are edges in a
+// hash table, a "*" segment is a direct child, other segments with '*' are
+// matched with mjson_globmatch(). A segment with '?' or '#' may match across
+// '/', so it ends the trie path, and the pattern tail is matched as a whole.
+struct mjson_globnode {
+  int star;   // Child for the "*" segment, or 0
+  int ids;    // List of ids of patterns that end here
+  int globs;  // List of wildcard segments
+  int tails;  // List of pattern tails
+};
+
+struct mjson_globedge {
+  unsigned hash;
+  int node, child;  // Child 0 marks an empty slot
+  int name, len;    // Offset and length of the segment name in names
+};
+
+struct mjson_globitem {
+  int next;       // Next item in the list, or -1
+  int name, len;  // Segment name or pattern tail, offset in names
+  int val;        // Pattern id, or child node for wildcard segments
+};
+
+static int mjson_globset_grow(void **p, int *size, int need, size_t esize) {
+  int n = *size == 0 ? 8 : *size;
+  void *q;
+  if (need <= *size) return 0;
+  while (n < need) n *= 2;
+  if ((q = MJSON_REALLOC(*p, (size_t) n * esize)) == NULL) return -1;
+  *p = q, *size = n;
+  return 0;
+}
+
+static int mjson_globset_node(struct mjson_globset *gs) {
+  struct mjson_globnode *n;
+  if (mjson_globset_grow((void **) &gs->nodes, &gs->nodes_size,
+                         gs->num_nodes + 1, sizeof(*n)) != 0) {
+    return -1;
   }
-  mjson_printf(r->fn, r->fn_data, "}}\n");
+  n = &gs->nodes[gs->num_nodes];
+  n->star = 0, n->ids = n->globs = n->tails = -1;
+  return gs->num_nodes++;
 }
 
-void jsonrpc_return_error(struct jsonrpc_request *r, int code,
+static int mjson_globset_item(struct mjson_globset *gs, int *list,
+                              const char *name, int len, int val) {
+  struct mjson_globitem *it;
+  if (mjson_globset_grow((void **) &gs->items, &gs->items_size,
+                         gs->num_items + 1, sizeof(*it)) != 0 ||
+      mjson_globset_grow((void **) &gs->names, &gs->names_size,
+                         gs->names_len + len, 1) != 0) {
+    return -1;
+  }
+  it = &gs->items[gs->num_items];
+  it->next = *list, it->name = gs->names_len, it->len = len, it->val = val;
+  if (len > 0) memcpy(gs->names + gs->names_len, name, (size_t) len);
+  gs->names_len += len;
+  *list = gs->num_items++;
+  return 0;
+}
+
+static unsigned mjson_globset_hash(int node, const char *s, int len) {
+  return mjson_hash(s, len) ^ ((unsigned) node * 2654435761U);
+}
+
+static const struct mjson_globedge *mjson_globset_edge(
+    const struct mjson_globset *gs, int node, const char *s, int len) {
+  unsigned h = mjson_globset_hash(node, s, len), mask, i;
+  if (gs->edges_size == 0) return NULL;
+  mask = (unsigned) gs->edges_size - 1;
+  for (i = h & mask; gs->edges[i].child != 0; i = (i + 1) & mask) {
+    const struct mjson_globedge *e = &gs->edges[i];
+    if (e->hash == h && e->node == node && e->len == len &&
+        (len == 0 || memcmp(gs->names + e->name, s, (size_t) len) == 0)) {
+      return e;
+    }
+  }
+  return &gs->edges[i];
+}
+
+// Keep the edge table at most half full
+static int mjson_globset_rehash(struct mjson_globset *gs) {
+  struct mjson_globedge *old = gs->edges, *e;
+  int i, n = gs->edges_size, size = n == 0 ? 16 : n * 2;
+  if ((gs->num_edges + 1) * 2 <= n) return 0;
+  e = (struct mjson_globedge *) MJSON_REALLOC(NULL, (size_t) size * sizeof(*e));
+  if (e == NULL) return -1;
+  memset(e, 0, (size_t) size * sizeof(*e));
+  gs->edges = e, gs->edges_size = size;
+  for (i = 0; i < n; i++) {
+    unsigned j, mask = (unsigned) size - 1;
+    if (old[i].child == 0) continue;
+    j = old[i].hash & mask;
+    while (e[j].child != 0) j = (j + 1) & mask;
+    e[j] = old[i];
+  }
+  MJSON_FREE(old);
+  return 0;
+}
+
+// Return the child of node for a segment, create it if it does not exist
+static int mjson_globset_child(struct mjson_globset *gs, int node,
+                               const char *s, int len) {
+  struct mjson_globedge *e;
+  int i, child, has_star = 0;
+  for (i = 0; i < len; i++) has_star |= s[i] == '*';
+  if (len == 1 && s[0] == '*') {
+    if (gs->nodes[node].star == 0) {
+      if ((child = mjson_globset_node(gs)) < 0) return -1;
+      gs->nodes[node].star = child;
+    }
+    return gs->nodes[node].star;
+  } else if (has_star) {
+    for (i = gs->nodes[node].globs; i >= 0; i = gs->items[i].next) {
+      const struct mjson_globitem *it = &gs->items[i];
+      if (it->len != len) continue;
+      if (memcmp(gs->names + it->name, s, (size_t) len) == 0) return it->val;
+    }
+    if ((child = mjson_globset_node(gs)) < 0 ||
+        mjson_globset_item(gs, &gs->nodes[node].globs, s, len, child) != 0) {
+      return -1;
+    }
+    return child;
+  }
+  if (mjson_globset_rehash(gs) != 0) return -1;
+  e = (struct mjson_globedge *) mjson_globset_edge(gs, node, s, len);
+  if (e->child != 0) return e->child;
+  if ((child = mjson_globset_node(gs)) < 0 ||
+      mjson_globset_grow((void **) &gs->names, &gs->names_size,
+                         gs->names_len + len, 1) != 0) {
+    return -1;
+  }
+  e->hash = mjson_globset_hash(node, s, len);
+  e->node = node, e->child = child, e->name = gs->names_len, e->len = len;
+  if (len > 0) memcpy(gs->names + gs->names_len, s, (size_t) len);
+  gs->names_len += len;
+  gs->num_edges++;
+  return child;
+}
+
+void mjson_globset_init(struct mjson_globset *gs) {
+  memset(gs, 0, sizeof(*gs));
+}
+
+// Add a pattern with the given id. Return 0, or -1 on allocation failure
+int mjson_globset_add(struct mjson_globset *gs, const char *pattern, int len,
+                      int id) {
+  int node = 0, start = 0, end, i;
+  if (gs->num_nodes == 0 && mjson_globset_node(gs) < 0) return -1;
+  while (start <= len) {
+    for (end = start; end < len && pattern[end] != '/';) end++;
+    for (i = start; i < end && pattern[i] != '?' && pattern[i] != '#';) i++;
+    if (i < end) {
+      return mjson_globset_item(gs, &gs->nodes[node].tails, pattern + start,
+                                len - start, id);
+    }
+    node = mjson_globset_child(gs, node, pattern + start, end - start);
+    if (node < 0) return -1;
+    start = end + 1;
+  }
+  return mjson_globset_item(gs, &gs->nodes[node].ids, NULL, 0, id);
+}
+
+static int mjson_globset_ids(const struct mjson_globset *gs, int i,
+                             void (*fn)(int, void *), void *fn_data) {
+  int n = 0;
+  for (; i >= 0; i = gs->items[i].next, n++) {
+    if (fn != NULL) fn(gs->items[i].val, fn_data);
+  }
+  return n;
+}
+
+// Match the rest of s, starting at segment start, against the node subtree.
+// Every trie level takes one segment, so recursion is as deep as the
+// longest pattern. Start past len means that all segments are taken
+static int mjson_globset_walk(const struct mjson_globset *gs, int node,
+                              const char *s, int len, int start,
+                              void (*fn)(int, void *), void *fn_data) {
+  const struct mjson_globnode *n = &gs->nodes[node];
+  const struct mjson_globedge *e;
+  int i, end, count = 0;
+  if (start > len) return mjson_globset_ids(gs, n->ids, fn, fn_data);
+  for (i = n->tails; i >= 0; i = gs->items[i].next) {
+    const struct mjson_globitem *it = &gs->items[i];
+    if (mjson_globmatch(gs->names + it->name, it->len, s + start,
+                        len - start)) {
+      count++;
+      if (fn != NULL) fn(it->val, fn_data);
+    }
+  }
+  for (end = start; end < len && s[end] != '/';) end++;
+  if ((e = mjson_globset_edge(gs, node, s + start, end - start)) != NULL &&
+      e->child != 0) {
+    count += mjson_globset_walk(gs, e->child, s, len, end + 1, fn, fn_data);
+  }
+  if (n->star != 0) {
+    count += mjson_globset_walk(gs, n->star, s, len, end + 1, fn, fn_data);
+  }
+  for (i = n->globs; i >= 0; i = gs->items[i].next) {
+    const struct mjson_globitem *it = &gs->items[i];
+    if (mjson_globmatch(gs->names + it->name, it->len, s + start,
+                        end - start)) {
+      count += mjson_globset_walk(gs, it->val, s, len, end + 1, fn, fn_data);
+    }
+  }
+  return count;
+}
+
+// Call fn for the id of every pattern that matches s, like
+// mjson_globmatch() would. Return the number of matches
+int mjson_globset_match(const struct mjson_globset *gs, const char *s, int len,
+                        void (*fn)(int id, void *fn_data), void *fn_data) {
+  if (gs->num_nodes == 0) return 0;
+  return mjson_globset_walk(gs, 0, s, len, 0, fn, fn_data);
+}
+
+void mjson_globset_free(struct mjson_globset *gs) {
+  MJSON_FREE(gs->nodes);
+  MJSON_FREE(gs->edges);
+  MJSON_FREE(gs->items);
+  MJSON_FREE(gs->names);
+  mjson_globset_init(gs);
+}
+#endif  // MJSON_ENABLE_GLOBSET
+
+static int jsonrpc_is_pattern(const char *s, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (s[i] == '*' || s[i] == '#' || s[i] == '?') return 1;
+  }
+  return 0;
+}
+
+// Method tables are immutable once published. Readers load the current
+// table with acquire semantics and never lock. Writers build a modified
+// copy and publish it with compare-and-swap, the old table is retired.
+#if defined(__GNUC__) || defined(__clang__)
+#define MJSON_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define MJSON_CAS_PTR(p, old, new_)                                   \
+  __atomic_compare_exchange_n((p), &(old), (new_), 0, __ATOMIC_ACQ_REL, \
+                              __ATOMIC_ACQUIRE)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define MJSON_LOAD_PTR(p) \
+  _InterlockedCompareExchangePointer((void *volatile *) (p), NULL, NULL)
+#define MJSON_CAS_PTR(p, old, new_)                                      \
+  (_InterlockedCompareExchangePointer((void *volatile *) (p), (new_), \
+                                      (old)) == (void *) (old))
+#else  // No atomics, all calls must be made from a single thread
+#define MJSON_LOAD_PTR(p) (*(p))
+#define MJSON_CAS_PTR(p, old, new_) (*(p) = (new_), 1)
+#endif
+
+// Add v to *p, return the old value. MJSON_ATOMIC_READ is the matching
+// relaxed load of an unsigned long that other threads add to
+#if defined(__GNUC__) || defined(__clang__)
+#define MJSON_ATOMIC_ADD(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define MJSON_ATOMIC_READ(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#elif defined(_MSC_VER)
+#define MJSON_ATOMIC_ADD(p, v) \
+  _InterlockedExchangeAdd((volatile long *) (p), (long) (v))
+#define MJSON_ATOMIC_READ(p) \
+  ((unsigned long) _InterlockedOr((volatile long *) (p), 0))
+#else
+#define MJSON_ATOMIC_ADD(p, v) ((*(p) += (v)) - (v))
+#define MJSON_ATOMIC_READ(p) (*(p))
+#endif
+
+// Sequentially consistent load and store of an unsigned int. Also work
+// across processes sharing memory
+#if defined(__GNUC__) || defined(__clang__)
+#define MJSON_LOAD(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define MJSON_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#elif defined(_MSC_VER)
+#define MJSON_LOAD(p) ((unsigned) _InterlockedOr((volatile long *) (p), 0))
+#define MJSON_STORE(p, v) \
+  _InterlockedExchange((volatile long *) (p), (long) (v))
+#else
+#define MJSON_LOAD(p) (*(volatile unsigned *) (p))
+#define MJSON_STORE(p, v) (*(volatile unsigned *) (p) = (v))
+#endif
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+// Queued request. Frame data follows the structure
+struct jsonrpc_job {
+  struct jsonrpc_job *next;
+  mjson_print_fn_t fn;  // Printer of the request
+  void *fn_data;        // Printer data
+  void *userdata;       // Request userdata
+  int len;              // Frame length
+};
+
+#endif
+
+#if MJSON_ENABLE_RPC_STATS
+// A set of method counters, padded to whole cache lines. Each thread adds to
+// its own shard, so workers do not bounce one line between their cores
+struct jsonrpc_stats_shard {
+  struct jsonrpc_method_stats st;
+  char pad[MJSON_CACHE_LINE -
+           sizeof(struct jsonrpc_method_stats) % MJSON_CACHE_LINE];
+};
+
+// Return zeroed shards aligned to a cache line. The pointer that
+// MJSON_REALLOC returned is kept right before the first shard
+static struct jsonrpc_stats_shard *jsonrpc_stats_new(void) {
+  size_t n = sizeof(struct jsonrpc_stats_shard) * MJSON_RPC_STATS_SHARDS;
+  char *p, *s;
+  p = (char *) MJSON_REALLOC(NULL, n + sizeof(p) + MJSON_CACHE_LINE);
+  if (p == NULL) return NULL;
+  s = p + sizeof(p);
+  s += (MJSON_CACHE_LINE - (size_t) s % MJSON_CACHE_LINE) % MJSON_CACHE_LINE;
+  memcpy(s - sizeof(p), &p, sizeof(p));
+  memset(s, 0, n);
+  return (struct jsonrpc_stats_shard *) (void *) s;
+}
+
+static void jsonrpc_stats_free(struct jsonrpc_stats_shard *sh) {
+  char *p;
+  if (sh == NULL) return;
+  memcpy(&p, (char *) sh - sizeof(p), sizeof(p));
+  MJSON_FREE(p);
+}
+#endif
+
+struct jsonrpc_table {
+  struct jsonrpc_table *retired;   // Next retired table
+#if MJSON_ENABLE_RPC_STATS
+  struct jsonrpc_stats_shard *dropped;  // Stats of the removed method
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+  struct jsonrpc_param *dropped_params;  // Schema of the replaced method
+#endif
+  int num_methods;                 // Number of methods
+  int num_patterns;                // Number of glob patterns
+  int hsize;                       // Hash index size, a power of 2
+  struct jsonrpc_method *methods;  // Methods, in registration order
+  int *patterns;                   // Indices of glob patterns, newest first
+  int *index;                      // Exact names index, slots hold index + 1
+};
+
+// Find a method with the exact name. Return its index, or -1
+static int jsonrpc_table_lookup(const struct jsonrpc_table *t, const char *name,
+                                int len) {
+  unsigned i = mjson_hash(name, len) & (unsigned) (t->hsize - 1);
+  while (t->index[i] != 0) {
+    const struct jsonrpc_method *m = &t->methods[t->index[i] - 1];
+    if (m->method_sz == len && memcmp(m->method, name, (size_t) len) == 0) {
+      return t->index[i] - 1;
+    }
+    i = (i + 1) & (unsigned) (t->hsize - 1);
+  }
+  return -1;
+}
+
+// Build a table from the methods of the old table, except the one with
+// index `skip`, followed by the method `add` if it is not NULL.
+// Methods and indices share a single allocation.
+static struct jsonrpc_table *jsonrpc_table_new(
+    const struct jsonrpc_table *old, int skip,
+    const struct jsonrpc_method *add) {
+  struct jsonrpc_table *t;
+  int i, n = 0, max = (old == NULL ? 0 : old->num_methods) + 1, hsize = 8;
+  size_t size;
+  while (hsize < max * 2) hsize *= 2;
+  size = sizeof(*t) + (size_t) max * sizeof(*t->methods) +
+         (size_t) (max + hsize) * sizeof(int);
+  if ((t = (struct jsonrpc_table *) MJSON_REALLOC(NULL, size)) == NULL) {
+    return NULL;
+  }
+  memset(t, 0, size);
+  t->methods = (struct jsonrpc_method *) (t + 1);
+  t->patterns = (int *) (t->methods + max);
+  t->index = t->patterns + max;
+  t->hsize = hsize;
+  for (i = 0; old != NULL && i < old->num_methods; i++) {
+    if (i != skip) t->methods[n++] = old->methods[i];
+  }
+  if (add != NULL) t->methods[n++] = *add;
+  t->num_methods = n;
+  for (i = n - 1; i >= 0; i--) {
+    struct jsonrpc_method *m = &t->methods[i];
+    if (jsonrpc_is_pattern(m->method, m->method_sz)) {
+      t->patterns[t->num_patterns++] = i;
+    } else {
+      unsigned j = mjson_hash(m->method, m->method_sz) & (unsigned) (hsize - 1);
+      while (t->index[j] != 0) j = (j + 1) & (unsigned) (hsize - 1);
+      t->index[j] = i + 1;
+    }
+  }
+  return t;
+}
+
+static void jsonrpc_table_retire(struct jsonrpc_ctx *ctx,
+                                 struct jsonrpc_table *t) {
+  struct jsonrpc_table *head = (struct jsonrpc_table *) MJSON_LOAD_PTR(
+      &ctx->retired);
+  do {
+    t->retired = head;
+  } while (!MJSON_CAS_PTR(&ctx->retired, head, t));
+}
+
+// Replace method `name` with `add`, or remove it if `add` is NULL.
+// Return 0 on success, or -1 on allocation failure or if there is nothing
+// to remove.
+static int jsonrpc_ctx_update(struct jsonrpc_ctx *ctx, const char *name,
+                              int len, const struct jsonrpc_method *add) {
+  struct jsonrpc_table *old, *t;
+  struct jsonrpc_method m;
+  int i, j;
+#if MJSON_ENABLE_RPC_STATS
+  struct jsonrpc_stats_shard *stats = NULL;
+  if (add != NULL && (stats = jsonrpc_stats_new()) == NULL) return -1;
+#endif
+  do {
+    old = (struct jsonrpc_table *) MJSON_LOAD_PTR(&ctx->table);
+    for (i = 0, j = -1; old != NULL && i < old->num_methods; i++) {
+      struct jsonrpc_method *e = &old->methods[i];
+      if (e->method_sz == len && memcmp(e->method, name, (size_t) len) == 0) {
+        j = i;
+      }
+    }
+    if (add == NULL && j < 0) return -1;
+    if (add != NULL) {
+      m = *add;
+#if MJSON_ENABLE_RPC_STATS
+      m.stats = j < 0 ? stats : old->methods[j].stats;  // Keep on replace
+#endif
+    }
+    if (add == NULL && old->num_methods == 1) {
+      t = NULL;
+    } else if ((t = jsonrpc_table_new(old, j, add == NULL ? NULL : &m)) ==
+               NULL) {
+#if MJSON_ENABLE_RPC_STATS
+      jsonrpc_stats_free(stats);
+#endif
+      return -1;
+    }
+    if (MJSON_CAS_PTR(&ctx->table, old, t)) break;
+    MJSON_FREE(t);
+  } while (1);
+#if MJSON_ENABLE_RPC_STATS
+  if (j >= 0 && add != NULL) jsonrpc_stats_free(stats);
+  if (j >= 0 && add == NULL) old->dropped = old->methods[j].stats;
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+  if (j >= 0) {  // Replaced or removed, either way the old schema goes
+    old->dropped_params = (struct jsonrpc_param *) old->methods[j].params;
+  }
+#endif
+  if (old != NULL) jsonrpc_table_retire(ctx, old);
+#if MJSON_ENABLE_RPC_CACHE
+  jsonrpc_ctx_cache_flush(ctx);  // Cached responses may be from the old one
+#endif
+  return 0;
+}
+
+int jsonrpc_ctx_register(struct jsonrpc_ctx *ctx, const char *name,
+                         void (*fn)(struct jsonrpc_request *)) {
+  struct jsonrpc_method m;
+  memset(&m, 0, sizeof(m));
+  m.method = name, m.method_sz = (int) strlen(name), m.cb = fn;
+  return jsonrpc_ctx_update(ctx, m.method, m.method_sz, &m);
+}
+
+#if MJSON_ENABLE_RPC_SCHEMA
+int jsonrpc_ctx_register_schema(struct jsonrpc_ctx *ctx, const char *name,
+                                jsonrpc_handler_t fn,
+                                const struct jsonrpc_param *params, int n) {
+  struct jsonrpc_method m;
+  struct jsonrpc_param *copy = NULL;
+  size_t size = sizeof(*params) * (size_t) n;
+  if (n < 0 || n > MJSON_RPC_MAX_PARAMS || (n > 0 && params == NULL)) return -1;
+  // Every registration owns its schema, so callers may reuse their array
+  if (n > 0) {
+    if ((copy = (struct jsonrpc_param *) MJSON_REALLOC(NULL, size)) == NULL) {
+      return -1;
+    }
+    memcpy(copy, params, size);
+  }
+  memset(&m, 0, sizeof(m));
+  m.method = name, m.method_sz = (int) strlen(name), m.cb = fn;
+  m.params = copy, m.num_params = n;
+  if (jsonrpc_ctx_update(ctx, m.method, m.method_sz, &m) != 0) {
+    MJSON_FREE(copy);
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+int jsonrpc_ctx_register_priority(struct jsonrpc_ctx *ctx, const char *name,
+                                  jsonrpc_handler_t fn, int priority) {
+  struct jsonrpc_method m;
+  if (priority < 0 || priority >= MJSON_RPC_PRIORITIES) return -1;
+  memset(&m, 0, sizeof(m));
+  m.method = name, m.method_sz = (int) strlen(name), m.cb = fn;
+  m.priority = priority;
+  return jsonrpc_ctx_update(ctx, m.method, m.method_sz, &m);
+}
+#endif
+
+int jsonrpc_ctx_unregister(struct jsonrpc_ctx *ctx, const char *name) {
+  return jsonrpc_ctx_update(ctx, name, (int) strlen(name), NULL);
+}
+
+void jsonrpc_ctx_reclaim(struct jsonrpc_ctx *ctx) {
+  struct jsonrpc_table *t, *head;
+  do {
+    head = (struct jsonrpc_table *) MJSON_LOAD_PTR(&ctx->retired);
+  } while (head != NULL && !MJSON_CAS_PTR(&ctx->retired, head, NULL));
+  while ((t = head) != NULL) {
+    head = t->retired;
+#if MJSON_ENABLE_RPC_STATS
+    jsonrpc_stats_free(t->dropped);
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+    MJSON_FREE(t->dropped_params);
+#endif
+    MJSON_FREE(t);
+  }
+}
+
+void jsonrpc_ctx_free(struct jsonrpc_ctx *ctx) {
+  jsonrpc_ctx_reclaim(ctx);
+#if MJSON_ENABLE_RPC_STATS
+  {
+    int i;
+    for (i = 0; ctx->table != NULL && i < ctx->table->num_methods; i++) {
+      jsonrpc_stats_free(ctx->table->methods[i].stats);
+    }
+  }
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+  {
+    int i;
+    for (i = 0; ctx->table != NULL && i < ctx->table->num_methods; i++) {
+      MJSON_FREE((void *) ctx->table->methods[i].params);
+    }
+  }
+#endif
+  MJSON_FREE(ctx->table);
+  ctx->table = NULL;
+#if MJSON_ENABLE_RPC_CACHE
+  jsonrpc_ctx_cache_flush(ctx);
+  MJSON_FREE(ctx->cache);
+  ctx->cache = NULL;
+#endif
+#if MJSON_ENABLE_RPC_EXECUTOR
+  if (ctx->executor != NULL) {  // Drop requests that were not run
+    int i;
+    for (i = 0; i < MJSON_RPC_PRIORITIES; i++) {
+      struct jsonrpc_job *j;
+      while ((j = ctx->executor->head[i]) != NULL) {
+        ctx->executor->head[i] = j->next;
+        MJSON_FREE(j);
+      }
+      ctx->executor->tail[i] = NULL;
+    }
+    ctx->executor->num_jobs = 0;
+  }
+#endif
+}
+
+// Exact names are looked up in the hash index, and win over patterns.
+// Patterns are matched in the reverse order of registration.
+static const struct jsonrpc_method *jsonrpc_ctx_find(struct jsonrpc_ctx *ctx,
+                                                     const char *name,
+                                                     int len) {
+  const struct jsonrpc_table *t =
+      (const struct jsonrpc_table *) MJSON_LOAD_PTR(&ctx->table);
+  int i;
+  if (t == NULL) return NULL;
+  if ((i = jsonrpc_table_lookup(t, name, len)) >= 0) return &t->methods[i];
+  for (i = 0; i < t->num_patterns; i++) {
+    const struct jsonrpc_method *m = &t->methods[t->patterns[i]];
+    if (mjson_globmatch(m->method, m->method_sz, name, len) > 0) return m;
+  }
+  return NULL;
+}
+
+#if MJSON_ENABLE_RPC_STATS || MJSON_ENABLE_RPC_CACHE
+#define MJSON_RPC_TAP 1
+
+// Printer that stands in for the request printer while a handler runs.
+// It counts response bytes and errors, and can keep a copy of the response
+struct jsonrpc_tap {
+  mjson_print_fn_t fn;        // Request printer
+  void *fn_data;              // Request printer data
+  unsigned long len;          // Number of bytes printed
+  int is_error;               // Set if the handler returned an error
+  int capture;                // Set if the response must be copied to buf
+  char *buf;                  // Copy of the response
+  int buf_len;                // Copy length
+  int buf_size;               // Allocated size of buf
+  struct mjson_arena *arena;  // Arena of the request printer, or NULL
+};
+
+static int jsonrpc_tap_print(const char *buf, int len, void *fn_data) {
+  struct jsonrpc_tap *tap = (struct jsonrpc_tap *) fn_data;
+  tap->len += (unsigned long) len;
+  if (tap->capture && tap->buf_len + len > tap->buf_size) {
+    int size = tap->buf_size == 0 ? 256 : tap->buf_size;
+    char *p;
+    while (size < tap->buf_len + len) size *= 2;
+    p = (char *) mjson_scratch_realloc(tap->arena, tap->buf,
+                                       (size_t) tap->buf_size, (size_t) size);
+    if (p == NULL) {
+      tap->capture = 0;  // Do not cache what we could not copy
+    } else {
+      tap->buf = p, tap->buf_size = size;
+    }
+  }
+  if (tap->capture) {
+    memcpy(tap->buf + tap->buf_len, buf, (size_t) len);
+    tap->buf_len += len;
+  }
+  return tap->fn(buf, len, tap->fn_data);
+}
+#else
+#define MJSON_RPC_TAP 0
+#endif
+
+#if MJSON_ENABLE_RPC_CACHE
+#if defined(__GNUC__) || defined(__clang__)
+#define MJSON_LOCK(p) \
+  while (__atomic_exchange_n((p), 1L, __ATOMIC_ACQUIRE)) (void) 0
+#define MJSON_UNLOCK(p) __atomic_store_n((p), 0L, __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#define MJSON_LOCK(p) while (_InterlockedExchange((p), 1L)) (void) 0
+#define MJSON_UNLOCK(p) _InterlockedExchange((p), 0L)
+#else
+#define MJSON_LOCK(p) (void) (p)
+#define MJSON_UNLOCK(p) (void) (p)
+#endif
+
+// Cached response, followed by the key and the response tail. The key is
+// the method name, a newline and canonical params. The tail is everything
+// after the request id. Blobs are immutable and reference counted, so they
+// can be printed outside of the cache lock.
+struct jsonrpc_cache_blob {
+  int refs;     // Reference count
+  int key_len;  // Key length
+  int len;      // Response tail length
+};
+
+struct jsonrpc_cache_entry {
+  struct jsonrpc_cache_blob *blob;  // Cached response, or NULL
+  unsigned hash;                    // Key hash
+  unsigned long expires;            // Expiration time, in clock_fn ticks
+  unsigned long used;               // LRU stamp
+};
+
+struct jsonrpc_cache {
+  long lock;            // Spin lock
+  unsigned long stamp;  // Last LRU stamp
+  struct jsonrpc_cache_entry entries[MJSON_RPC_CACHE_SIZE];
+};
+
+// Walk params with whitespace outside of strings skipped. Write the result
+// to `out` and compare it to `cmp` if they are not NULL, update hash `h`.
+// Return canonical length, or -1 on mismatch.
+static int jsonrpc_canon(const char *s, int n, char *out, const char *cmp,
+                         unsigned *h) {
+  int i, k = 0, in_string = 0, escaped = 0;
+  for (i = 0; i < n; i++) {
+    char c = s[i];
+    if (in_string) {
+      if (escaped) {
+        escaped = 0;
+      } else if (c == '\\') {
+        escaped = 1;
+      } else if (c == '"') {
+        in_string = 0;
+      }
+    } else if (is_space(c)) {
+      continue;
+    } else if (c == '"') {
+      in_string = 1;
+    }
+    if (out != NULL) out[k] = c;
+    if (cmp != NULL && cmp[k] != c) return -1;
+    *h = (*h ^ (unsigned char) c) * 16777619U;
+    k++;
+  }
+  return k;
+}
+
+static void jsonrpc_blob_release(struct jsonrpc_cache_blob *b) {
+  if (b != NULL && MJSON_ATOMIC_ADD(&b->refs, -1) == 1) MJSON_FREE(b);
+}
+
+static unsigned jsonrpc_cache_hash(const struct jsonrpc_request *r, int *klen) {
+  unsigned h = mjson_hash(r->method + 1, r->method_len - 2);
+  h = (h ^ '\n') * 16777619U;
+  *klen = r->method_len - 1 + jsonrpc_canon(r->params, r->params_len, NULL,
+                                            NULL, &h);
+  return h;
+}
+
+static struct jsonrpc_cache_blob *jsonrpc_cache_get(
+    struct jsonrpc_cache *c, const struct jsonrpc_request *r, unsigned hash,
+    int klen, unsigned long now) {
+  struct jsonrpc_cache_blob *b = NULL;
+  int i, nlen = r->method_len - 2;
+  unsigned h = 0;
+  MJSON_LOCK(&c->lock);
+  for (i = 0; i < MJSON_RPC_CACHE_SIZE; i++) {
+    struct jsonrpc_cache_entry *e = &c->entries[i];
+    const char *key;
+    if (e->blob == NULL || e->hash != hash || e->blob->key_len != klen ||
+        (long) (now - e->expires) >= 0) {
+      continue;
+    }
+    key = (const char *) (e->blob + 1);
+    if (memcmp(key, r->method + 1, (size_t) nlen) != 0 ||
+        jsonrpc_canon(r->params, r->params_len, NULL, key + nlen + 1, &h) < 0) {
+      continue;
+    }
+    e->used = ++c->stamp;
+    b = e->blob;
+    MJSON_ATOMIC_ADD(&b->refs, 1);
+    break;
+  }
+  MJSON_UNLOCK(&c->lock);
+  return b;
+}
+
+// How willingly an entry is evicted: empty first, then expired, then live
+static int jsonrpc_cache_rank(const struct jsonrpc_cache_entry *e,
+                              unsigned long now) {
+  if (e->blob == NULL) return 2;
+  return (long) (now - e->expires) >= 0 ? 1 : 0;
+}
+
+// Store a response. An entry with the same key, e.g. added by a concurrent
+// miss, is replaced, so a key is never cached twice. Otherwise the most
+// evictable entry is used, the least recently used one on a tie.
+static void jsonrpc_cache_put(struct jsonrpc_cache *c,
+                              const struct jsonrpc_request *r, unsigned hash,
+                              int klen, unsigned long now, unsigned long ttl,
+                              const char *tail, int tail_len) {
+  struct jsonrpc_cache_blob *b, *old;
+  struct jsonrpc_cache_entry *e = NULL;
+  size_t size = sizeof(*b) + (size_t) klen + (size_t) tail_len;
+  char *key;
+  unsigned h = 0;
+  int i;
+  if ((b = (struct jsonrpc_cache_blob *) MJSON_REALLOC(NULL, size)) == NULL) {
+    return;
+  }
+  b->refs = 1, b->key_len = klen, b->len = tail_len;
+  key = (char *) (b + 1);
+  memcpy(key, r->method + 1, (size_t) r->method_len - 2);
+  key[r->method_len - 2] = '\n';
+  jsonrpc_canon(r->params, r->params_len, key + r->method_len - 1, NULL, &h);
+  memcpy(key + klen, tail, (size_t) tail_len);
+  MJSON_LOCK(&c->lock);
+  for (i = 0; i < MJSON_RPC_CACHE_SIZE; i++) {
+    struct jsonrpc_cache_entry *x = &c->entries[i];
+    int rx = jsonrpc_cache_rank(x, now);
+    int re = e == NULL ? -1 : jsonrpc_cache_rank(e, now);
+    if (x->blob != NULL && x->hash == hash && x->blob->key_len == klen &&
+        memcmp(x->blob + 1, key, (size_t) klen) == 0) {
+      e = x;
+      break;
+    }
+    if (rx > re || (rx == re && x->used < e->used)) e = x;
+  }
+  old = e->blob;
+  e->blob = b, e->hash = hash, e->expires = now + ttl, e->used = ++c->stamp;
+  MJSON_UNLOCK(&c->lock);
+  jsonrpc_blob_release(old);
+}
+
+void jsonrpc_ctx_cache_flush(struct jsonrpc_ctx *ctx) {
+  struct jsonrpc_cache *c =
+      (struct jsonrpc_cache *) MJSON_LOAD_PTR(&ctx->cache);
+  struct jsonrpc_cache_blob *old[MJSON_RPC_CACHE_SIZE];
+  int i;
+  if (c == NULL) return;
+  MJSON_LOCK(&c->lock);
+  for (i = 0; i < MJSON_RPC_CACHE_SIZE; i++) {
+    old[i] = c->entries[i].blob;
+    c->entries[i].blob = NULL;
+  }
+  MJSON_UNLOCK(&c->lock);
+  for (i = 0; i < MJSON_RPC_CACHE_SIZE; i++) jsonrpc_blob_release(old[i]);
+}
+
+int jsonrpc_ctx_register_cached(struct jsonrpc_ctx *ctx, const char *name,
+                                jsonrpc_handler_t fn, unsigned long ttl) {
+  struct jsonrpc_cache *c, *none = NULL;
+  struct jsonrpc_method m;
+  if (MJSON_LOAD_PTR(&ctx->cache) == NULL) {
+    c = (struct jsonrpc_cache *) MJSON_REALLOC(NULL, sizeof(*c));
+    if (c == NULL) return -1;
+    memset(c, 0, sizeof(*c));
+    if (!MJSON_CAS_PTR(&ctx->cache, none, c)) {
+      MJSON_FREE(c);  // Another thread was first
+    }
+  }
+  memset(&m, 0, sizeof(m));
+  m.method = name, m.method_sz = (int) strlen(name), m.cb = fn, m.ttl = ttl;
+  return jsonrpc_ctx_update(ctx, m.method, m.method_sz, &m);
+}
+#endif  // MJSON_ENABLE_RPC_CACHE
+
+#if MJSON_ENABLE_RPC_STATS
+// Shards are assigned to threads round-robin, on their first call. Threads
+// that share a shard still add atomically. The shard index is one per
+// thread, shared by all contexts, so a thread adds to the same shard
+// number of every method it runs
+static void jsonrpc_stats_add(struct jsonrpc_stats_shard *sh,
+                              const struct jsonrpc_request *r,
+                              const struct jsonrpc_tap *tap, unsigned long dt) {
+  static MJSON_THREAD_LOCAL unsigned long s_shard;  // Shard + 1, 0: unset
+  static unsigned long s_next;
+  struct jsonrpc_method_stats *st;
+  int i = 0;
+  if (s_shard == 0) {
+    s_shard = MJSON_ATOMIC_ADD(&s_next, 1UL) % MJSON_RPC_STATS_SHARDS + 1;
+  }
+  st = &sh[s_shard - 1].st;
+  MJSON_ATOMIC_ADD(&st->calls, 1UL);
+  MJSON_ATOMIC_ADD(&st->bytes_in, (unsigned long) r->frame_len);
+  MJSON_ATOMIC_ADD(&st->bytes_out, tap->len);
+  if (tap->is_error) MJSON_ATOMIC_ADD(&st->errors, 1UL);
+  if (r->ctx->clock_fn != NULL) {
+    for (; dt > 0 && i < 31; dt >>= 1) i++;
+    MJSON_ATOMIC_ADD(&st->latency[i], 1UL);
+  }
+}
+
+static int jsonrpc_print_stats(mjson_print_fn_t fn, void *fn_data,
+                               va_list *ap) {
+  struct jsonrpc_ctx *ctx = va_arg(*ap, struct jsonrpc_ctx *);
+  const struct jsonrpc_table *t =
+      (const struct jsonrpc_table *) MJSON_LOAD_PTR(&ctx->table);
+  int i, j, k, len = 0;
+  for (i = t == NULL ? -1 : t->num_methods - 1; i >= 0; i--) {
+    const struct jsonrpc_method *m = &t->methods[i];
+    struct jsonrpc_method_stats sum, *st = &sum;
+    memset(&sum, 0, sizeof(sum));
+    for (j = 0; j < MJSON_RPC_STATS_SHARDS; j++) {
+      const struct jsonrpc_method_stats *sh = &m->stats[j].st;
+      sum.calls += MJSON_ATOMIC_READ(&sh->calls);
+      sum.errors += MJSON_ATOMIC_READ(&sh->errors);
+      sum.bytes_in += MJSON_ATOMIC_READ(&sh->bytes_in);
+      sum.bytes_out += MJSON_ATOMIC_READ(&sh->bytes_out);
+      for (k = 0; k < 32; k++) {
+        sum.latency[k] += MJSON_ATOMIC_READ(&sh->latency[k]);
+      }
+    }
+    if (len > 0) len += mjson_print_buf(fn, fn_data, ",", 1);
+    len += mjson_printf(
+        fn, fn_data, "%.*Q:{%Q:%lu,%Q:%lu,%Q:%lu,%Q:%lu,%Q:[", m->method_sz,
+        m->method, "calls", st->calls, "errors", st->errors, "bytes_in",
+        st->bytes_in, "bytes_out", st->bytes_out, "latency");
+    for (k = 31; k >= 0 && st->latency[k] == 0;) k--;
+    for (j = 0; j <= k; j++) {
+      len += mjson_printf(fn, fn_data, j == 0 ? "%lu" : ",%lu", st->latency[j]);
+    }
+    len += mjson_print_buf(fn, fn_data, "]}", 2);
+  }
+  return len;
+}
+
+void jsonrpc_stats(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "{%M}", jsonrpc_print_stats, r->ctx);
+}
+#endif  // MJSON_ENABLE_RPC_STATS
+
+// Call method handler. Serve it from the cache if the method is cacheable,
+// and update method stats
+static void jsonrpc_invoke(struct jsonrpc_ctx *ctx,
+                           const struct jsonrpc_method *m,
+                           struct jsonrpc_request *r) {
+#if MJSON_RPC_TAP
+  struct jsonrpc_tap tap;
+  unsigned long now = ctx->clock_fn ? ctx->clock_fn() : 0;
+#if MJSON_ENABLE_RPC_CACHE
+  struct jsonrpc_cache *c =
+      (struct jsonrpc_cache *) MJSON_LOAD_PTR(&ctx->cache);
+  struct jsonrpc_cache_blob *b = NULL;
+  unsigned hash = 0;
+  int klen = 0, n = 6 + r->id_len, capture = 0;
+  if (m->ttl > 0 && c != NULL && ctx->clock_fn != NULL && r->id_len > 0) {
+    hash = jsonrpc_cache_hash(r, &klen);
+    b = jsonrpc_cache_get(c, r, hash, klen, now);
+    capture = b == NULL;
+  }
+#endif
+  memset(&tap, 0, sizeof(tap));
+  tap.fn = r->fn, tap.fn_data = r->fn_data;
+  tap.arena = mjson_arena_of(r->fn, r->fn_data);
+#if MJSON_ENABLE_RPC_CACHE
+  tap.capture = capture;
+#endif
+  r->fn = jsonrpc_tap_print, r->fn_data = &tap;
+#if MJSON_ENABLE_RPC_CACHE
+  if (b != NULL) {
+    mjson_printf(r->fn, r->fn_data, "{\"id\":%.*s%.*s", r->id_len, r->id,
+                 b->len, (char *) (b + 1) + b->key_len);
+    jsonrpc_blob_release(b);
+  } else {
+    m->cb(r);
+  }
+#else
+  m->cb(r);
+#endif
+  r->fn = tap.fn, r->fn_data = tap.fn_data;
+#if MJSON_ENABLE_RPC_CACHE
+  // Cache success responses only, that start with the request id
+  if (tap.capture && !tap.is_error && tap.buf_len > n + 10 &&
+      memcmp(tap.buf, "{\"id\":", 6) == 0 &&
+      memcmp(tap.buf + 6, r->id, (size_t) r->id_len) == 0 &&
+      memcmp(tap.buf + n, ",\"result\":", 10) == 0) {
+    jsonrpc_cache_put(c, r, hash, klen, now, m->ttl, tap.buf + n,
+                      tap.buf_len - n);
+  }
+  if (tap.buf != NULL) {
+    mjson_scratch_free(tap.arena, tap.buf, (size_t) tap.buf_size);
+  }
+#endif
+#if MJSON_ENABLE_RPC_STATS
+  jsonrpc_stats_add(m->stats, r, &tap,
+                    ctx->clock_fn ? ctx->clock_fn() - now : 0);
+#endif
+#else
+  (void) ctx;
+  m->cb(r);
+#endif
+}
+
+void jsonrpc_return_errorv(struct jsonrpc_request *r, int code,
+                           const char *message, const char *data_fmt,
+                           va_list *ap) {
+#if MJSON_RPC_TAP
+  if (r->fn == jsonrpc_tap_print) {
+    ((struct jsonrpc_tap *) r->fn_data)->is_error = 1;
+  }
+#endif
+  if (r->id_len == 0) return;
+  mjson_printf(r->fn, r->fn_data,
+               "{\"id\":%.*s,\"error\":{\"code\":%d,\"message\":%Q", r->id_len,
+               r->id, code, message == NULL ? "" : message);
+  if (data_fmt != NULL) {
+    mjson_printf(r->fn, r->fn_data, ",\"data\":");
+    mjson_vprintf(r->fn, r->fn_data, data_fmt, ap);
+  }
+  mjson_printf(r->fn, r->fn_data, "}}\n");
+}
+
+void jsonrpc_return_error(struct jsonrpc_request *r, int code,
                           const char *message, const char *data_fmt, ...) {
   va_list ap;
   va_start(ap, data_fmt);
@@ -995,54 +2694,1006 @@ void jsonrpc_return_success(struct jsonrpc_request *r, const char *result_fmt,
   va_end(ap);
 }
 
-void jsonrpc_ctx_process(struct jsonrpc_ctx *ctx, const char *buf, int len,
-                         mjson_print_fn_t fn, void *fn_data, void *ud) {
-  const char *result = NULL, *error = NULL;
-  int result_sz = 0, error_sz = 0;
-  struct jsonrpc_method *m = NULL;
-  struct jsonrpc_request r = {ctx, buf, len, 0, 0, 0, 0, 0, 0, fn, fn_data, ud};
+void jsonrpc_ctx_set_pending(struct jsonrpc_ctx *ctx,
+                             struct jsonrpc_pending *slots, int num_slots) {
+  int i;
+  if (num_slots > 0x10000) num_slots = 0x10000;  // Index takes 16 bits
+  if (slots == NULL || num_slots < 0) num_slots = 0;
+  for (i = 0; i < num_slots; i++) {
+    memset(&slots[i], 0, sizeof(slots[i]));
+    slots[i].next_free = i + 1 < num_slots ? i + 1 : -1;
+  }
+  ctx->pending = slots;
+  ctx->num_pending = num_slots;
+  ctx->pending_free = num_slots > 0 ? 0 : -1;
+}
+
+// Printer for batch elements. Their buffers are gone after the batch reply
+// is sent, so requests printed by it cannot be deferred
+static int jsonrpc_batch_print(const char *buf, int len, void *fn_data) {
+  return mjson_print_dynamic_buf(buf, len, fn_data);
+}
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+// Response of a request processed with an executor. It is collected in
+// a buffer owned by the calling thread, and passed to the request printer
+// by one call after the lock is released. A printer may then block, or
+// process requests itself, without stalling other threads
+struct jsonrpc_reply {
+  mjson_print_fn_t fn;  // Request printer
+  void *fn_data;        // Request printer data
+  char *buf;            // Response, allocated by mjson_print_dynamic_buf()
+  int queued;           // Set if the request has been queued already
+};
+
+static int jsonrpc_reply_print(const char *buf, int len, void *fn_data) {
+  return mjson_print_dynamic_buf(buf, len,
+                                 &((struct jsonrpc_reply *) fn_data)->buf);
+}
+
+static void jsonrpc_reply_flush(struct jsonrpc_reply *rp) {
+  if (rp->buf == NULL) return;
+  rp->fn(rp->buf, (int) strlen(rp->buf), rp->fn_data);
+  MJSON_FREE(rp->buf);
+  rp->buf = NULL;
+}
+
+// Copy a frame into the queue of the given priority.
+// Return 0 on success, or -1 on allocation failure
+static int jsonrpc_enqueue(struct jsonrpc_executor *ex, int priority,
+                           const char *buf, int len,
+                           const struct jsonrpc_reply *rp, void *ud) {
+  struct jsonrpc_job *j =
+      (struct jsonrpc_job *) MJSON_REALLOC(NULL, sizeof(*j) + (size_t) len);
+  if (j == NULL) return -1;
+  j->next = NULL, j->fn = rp->fn, j->fn_data = rp->fn_data, j->userdata = ud;
+  j->len = len;
+  memcpy(j + 1, buf, (size_t) len);
+  if (ex->lock_fn != NULL) ex->lock_fn(ex->data);
+  if (ex->tail[priority] == NULL) {
+    ex->head[priority] = j;
+  } else {
+    ex->tail[priority]->next = j;
+  }
+  ex->tail[priority] = j;
+  ex->num_jobs++;
+  if (ex->unlock_fn != NULL) ex->unlock_fn(ex->data);
+  if (ex->wake_fn != NULL) ex->wake_fn(ex->data);
+  return 0;
+}
+#endif
+
+// Pending slots are shared by the worker threads of an executor
+static void jsonrpc_lock(struct jsonrpc_ctx *ctx) {
+#if MJSON_ENABLE_RPC_EXECUTOR
+  struct jsonrpc_executor *ex = ctx->executor;
+  if (ex != NULL && ex->lock_fn != NULL) ex->lock_fn(ex->data);
+#else
+  (void) ctx;
+#endif
+}
+
+static void jsonrpc_unlock(struct jsonrpc_ctx *ctx) {
+#if MJSON_ENABLE_RPC_EXECUTOR
+  struct jsonrpc_executor *ex = ctx->executor;
+  if (ex != NULL && ex->unlock_fn != NULL) ex->unlock_fn(ex->data);
+#else
+  (void) ctx;
+#endif
+}
+
+// Handle is a slot index in the low 16 bits, and a slot generation above,
+// so that a stale handle does not hit a reused slot
+int jsonrpc_defer(struct jsonrpc_request *r, unsigned long deadline) {
+  struct jsonrpc_ctx *ctx = r->ctx;
+  struct jsonrpc_pending *p;
+  mjson_print_fn_t fn = r->fn;
+  void *fn_data = r->fn_data;
+  int i, handle;
+#if MJSON_RPC_TAP
+  if (fn == jsonrpc_tap_print) {  // Tap printer lives on the stack
+    fn = ((struct jsonrpc_tap *) r->fn_data)->fn;
+    fn_data = ((struct jsonrpc_tap *) r->fn_data)->fn_data;
+  }
+#endif
+#if MJSON_ENABLE_RPC_EXECUTOR
+  if (fn == jsonrpc_reply_print) {  // So is the reply buffer
+    struct jsonrpc_reply *rp = (struct jsonrpc_reply *) fn_data;
+    fn = rp->fn, fn_data = rp->fn_data;
+  }
+#endif
+  if (ctx->pending == NULL || r->id_len > MJSON_RPC_ID_SIZE) return -1;
+  if (fn == jsonrpc_batch_print) return -1;
+  jsonrpc_lock(ctx);
+  if ((i = ctx->pending_free) < 0) {
+    jsonrpc_unlock(ctx);
+    return -1;
+  }
+  p = &ctx->pending[i];
+  ctx->pending_free = p->next_free;
+  if (r->id_len > 0) memcpy(p->id, r->id, (size_t) r->id_len);
+  p->id_len = r->id_len;
+  p->used = 1;
+  p->generation = (p->generation + 1) & 0x7fff;
+  p->deadline = deadline;
+  p->fn = fn;
+  p->fn_data = fn_data;
+  handle = (p->generation << 16) | i;
+  jsonrpc_unlock(ctx);
+  return handle;
+}
+
+// Release pending slot for the given handle. Fill in a request with the
+// saved printer and a copy of the id, as the slot can be reused at once.
+// Return 0 on success, or -1 if handle is stale.
+static int jsonrpc_undefer(struct jsonrpc_ctx *ctx, int handle,
+                           struct jsonrpc_request *r, char *id) {
+  int i = handle & 0xffff, ok;
+  struct jsonrpc_pending *p;
+  if (handle < 0 || i >= ctx->num_pending) return -1;
+  p = &ctx->pending[i];
+  jsonrpc_lock(ctx);
+  if ((ok = p->used && p->generation == handle >> 16) != 0) {
+    memset(r, 0, sizeof(*r));
+    if (p->id_len > 0) memcpy(id, p->id, (size_t) p->id_len);
+    r->ctx = ctx, r->id = id, r->id_len = p->id_len;
+    r->fn = p->fn, r->fn_data = p->fn_data;
+    p->used = 0;
+    p->next_free = ctx->pending_free;
+    ctx->pending_free = i;
+  }
+  jsonrpc_unlock(ctx);
+  return ok ? 0 : -1;
+}
+
+// With an executor, the response is printed by a single call under the
+// lock, so it does not interleave with responses of the worker threads
+static int jsonrpc_reply_deferred(struct jsonrpc_ctx *ctx, int handle,
+                                  int is_error, int code, const char *message,
+                                  const char *fmt, va_list *ap) {
+  struct jsonrpc_request r;
+  char id[MJSON_RPC_ID_SIZE];
+#if MJSON_ENABLE_RPC_EXECUTOR
+  struct jsonrpc_reply rp;
+#endif
+  if (jsonrpc_undefer(ctx, handle, &r, id) != 0) return -1;
+#if MJSON_ENABLE_RPC_EXECUTOR
+  rp.fn = r.fn, rp.fn_data = r.fn_data, rp.buf = NULL, rp.queued = 1;
+  if (ctx->executor != NULL) r.fn = jsonrpc_reply_print, r.fn_data = &rp;
+#endif
+  if (is_error) {
+    jsonrpc_return_errorv(&r, code, message, fmt, ap);
+  } else {
+    jsonrpc_return_successv(&r, fmt, ap);
+  }
+#if MJSON_ENABLE_RPC_EXECUTOR
+  if (ctx->executor != NULL) jsonrpc_reply_flush(&rp);
+#endif
+  return 0;
+}
+
+int jsonrpc_return_success_deferred(struct jsonrpc_ctx *ctx, int handle,
+                                    const char *result_fmt, ...) {
+  va_list ap;
+  int rc;
+  va_start(ap, result_fmt);
+  rc = jsonrpc_reply_deferred(ctx, handle, 0, 0, NULL, result_fmt, &ap);
+  va_end(ap);
+  return rc;
+}
+
+int jsonrpc_return_error_deferred(struct jsonrpc_ctx *ctx, int handle,
+                                  int code, const char *message,
+                                  const char *data_fmt, ...) {
+  va_list ap;
+  int rc;
+  va_start(ap, data_fmt);
+  rc = jsonrpc_reply_deferred(ctx, handle, 1, code, message, data_fmt, &ap);
+  va_end(ap);
+  return rc;
+}
+
+void jsonrpc_ctx_set_calls(struct jsonrpc_ctx *ctx,
+                           struct jsonrpc_call_slot *slots, int num_slots) {
+  int i;
+  if (slots == NULL || num_slots < 0) num_slots = 0;
+  for (i = 0; i < num_slots; i++) {
+    memset(&slots[i], 0, sizeof(slots[i]));
+    slots[i].next_free = i + 1 < num_slots ? i + 1 : -1;
+  }
+  ctx->calls = slots;
+  ctx->num_calls = num_slots;
+  ctx->calls_free = num_slots > 0 ? 0 : -1;
+  ctx->calls_timed = 0;
+}
+
+// Request id is a sequence number times the number of slots, plus the slot
+// index. Ids grow monotonically, and a response finds its slot in O(1)
+int jsonrpc_call(struct jsonrpc_ctx *ctx, const char *method,
+                 jsonrpc_response_cb_t cb, void *cb_data,
+                 unsigned long timeout, const char *params_fmt, ...) {
+  struct jsonrpc_call_slot *p = NULL;
+  va_list ap;
+  if (ctx->request_fn == NULL) return -1;
+  if (cb == NULL) {  // Notification
+    mjson_printf(ctx->request_fn, ctx->request_fn_data, "{\"method\":%Q",
+                 method);
+  } else {
+    int i = ctx->calls_free;
+    if (i < 0) return -1;
+    p = &ctx->calls[i];
+    ctx->calls_free = p->next_free;
+    ctx->calls_seq++;
+    p->id = ctx->calls_seq * (unsigned long) ctx->num_calls + (unsigned long) i;
+    p->cb = cb, p->cb_data = cb_data;
+    p->timed = timeout > 0 && ctx->clock_fn != NULL;
+    if (p->timed) {
+      p->deadline = ctx->clock_fn() + timeout;
+      if (ctx->calls_timed++ == 0 ||
+          (long) (p->deadline - ctx->calls_deadline) < 0) {
+        ctx->calls_deadline = p->deadline;
+      }
+    }
+    mjson_printf(ctx->request_fn, ctx->request_fn_data,
+                 "{\"id\":%lu,\"method\":%Q", p->id, method);
+  }
+  if (params_fmt != NULL) {
+    mjson_printf(ctx->request_fn, ctx->request_fn_data, ",\"params\":");
+    va_start(ap, params_fmt);
+    mjson_vprintf(ctx->request_fn, ctx->request_fn_data, params_fmt, &ap);
+    va_end(ap);
+  }
+  mjson_printf(ctx->request_fn, ctx->request_fn_data, "}\n");
+  return 0;
+}
+
+// Release call slot, and pass the response to its callback
+static void jsonrpc_call_done(struct jsonrpc_ctx *ctx, int i,
+                              struct jsonrpc_response *res) {
+  struct jsonrpc_call_slot *p = &ctx->calls[i];
+  jsonrpc_response_cb_t cb = p->cb;
+  res->ctx = ctx, res->userdata = p->cb_data;
+  if (p->timed) ctx->calls_timed--;
+  p->id = 0, p->timed = 0, p->cb = NULL;
+  p->next_free = ctx->calls_free;
+  ctx->calls_free = i;
+  cb(res);
+}
+
+// Expire deferred requests and calls. Calls are scanned only when the
+// earliest of their deadlines has passed
+int jsonrpc_ctx_sweep(struct jsonrpc_ctx *ctx, unsigned long now) {
+  static const char *err = "{\"code\":-32000,\"message\":\"timeout\"}";
+  int i, n = 0;
+  for (i = 0; i < ctx->num_pending; i++) {
+    struct jsonrpc_pending *p = &ctx->pending[i];
+    int handle = -1;
+    jsonrpc_lock(ctx);
+    if (p->used && p->deadline != JSONRPC_NO_DEADLINE &&
+        (long) (now - p->deadline) >= 0) {
+      handle = (p->generation << 16) | i;
+    }
+    jsonrpc_unlock(ctx);
+    if (handle >= 0 &&
+        jsonrpc_return_error_deferred(ctx, handle, JSONRPC_ERROR_TIMEOUT,
+                                      "timeout", NULL) == 0) {
+      n++;
+    }
+  }
+  if (ctx->calls_timed > 0 && (long) (now - ctx->calls_deadline) >= 0) {
+    int first = 1;
+    for (i = 0; i < ctx->num_calls; i++) {
+      struct jsonrpc_call_slot *p = &ctx->calls[i];
+      if (p->timed && (long) (now - p->deadline) >= 0) {
+        struct jsonrpc_response res;
+        memset(&res, 0, sizeof(res));
+        res.error = err, res.error_len = (int) strlen(err);
+        jsonrpc_call_done(ctx, i, &res);
+        n++;
+      }
+    }
+    // Callbacks may have made new calls, so find the earliest deadline after
+    for (i = 0; i < ctx->num_calls; i++) {
+      struct jsonrpc_call_slot *p = &ctx->calls[i];
+      if (p->timed &&
+          (first || (long) (p->deadline - ctx->calls_deadline) < 0)) {
+        ctx->calls_deadline = p->deadline;
+        first = 0;
+      }
+    }
+  }
+  return n;
+}
+
+// Skip JSON value at the beginning of s, validating it in the same pass.
+// Return value length, or a non-positive number if the value is invalid.
+static int jsonrpc_skip_value(const char *s, int n) {
+  return mjson(s, n, NULL, NULL);
+}
+
+enum {
+  JSONRPC_RESULT,
+  JSONRPC_ERROR,
+  JSONRPC_METHOD,
+  JSONRPC_ID,
+  JSONRPC_PARAMS
+};
+
+// Extract the envelope members of a frame in one pass over the top level
+// object. If a member is repeated, the first one is used.
+// Return 0 on success, or -1 if the frame is not an object.
+static int jsonrpc_parse_frame(const char *s, int n, const char **vals,
+                               int *lens) {
+  static const char *names[] = {"\"result\"", "\"error\"", "\"method\"",
+                                "\"id\"", "\"params\""};
+  int i = 0, j, k, klen;
+  while (i < n && is_space(s[i])) i++;
+  if (i >= n || s[i++] != '{') return -1;
+  while (i < n && is_space(s[i])) i++;
+  if (i < n && s[i] == '}') return 0;
+  for (;;) {
+    const char *key = s + i;
+    if (i >= n || s[i] != '"') return -1;
+    if ((k = mjson_pass_string(s + i + 1, n - i - 1)) < 0) return -1;
+    klen = k + 2, i += klen;
+    while (i < n && is_space(s[i])) i++;
+    if (i >= n || s[i++] != ':') return -1;
+    while (i < n && is_space(s[i])) i++;
+    if ((k = jsonrpc_skip_value(s + i, n - i)) <= 0) return -1;
+    for (j = 0; j <= JSONRPC_PARAMS; j++) {
+      if (vals[j] == NULL && (int) strlen(names[j]) == klen &&
+          memcmp(names[j], key, (size_t) klen) == 0) {
+        vals[j] = s + i, lens[j] = k;
+      }
+    }
+    i += k;
+    while (i < n && is_space(s[i])) i++;
+    if (i >= n) return -1;
+    if (s[i] == '}') return 0;
+    if (s[i++] != ',') return -1;
+    while (i < n && is_space(s[i])) i++;
+  }
+}
+
+#if MJSON_ENABLE_RPC_SCHEMA
+static int jsonrpc_arg_type(char c) {
+  switch (c) {
+    case '"': return MJSON_TOK_STRING;
+    case '{': return MJSON_TOK_OBJECT;
+    case '[': return MJSON_TOK_ARRAY;
+    case 't': return MJSON_TOK_TRUE;
+    case 'f': return MJSON_TOK_FALSE;
+    case 'n': return MJSON_TOK_NULL;
+    default: return MJSON_TOK_NUMBER;
+  }
+}
+
+static void jsonrpc_param_error(struct jsonrpc_request *r,
+                                const struct jsonrpc_param *p, int i,
+                                const char *message) {
+  if (p == NULL) {
+    jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, message, NULL);
+  } else if (p->name != NULL) {
+    jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, message, "{%Q:%Q}",
+                         "param", p->name);
+  } else {
+    jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, message, "{%Q:%d}",
+                         "param", i);
+  }
+}
+
+// Validate a value against its parameter description
+static const char *jsonrpc_check_arg(const struct jsonrpc_param *p,
+                                     struct jsonrpc_arg *a) {
+  int is_bool = a->type == MJSON_TOK_TRUE || a->type == MJSON_TOK_FALSE;
+  if (a->ptr == NULL) return p->required ? "missing param" : NULL;
+  if (p->type != 0 && p->type != a->type &&
+      !(is_bool && (p->type == MJSON_TOK_TRUE || p->type == MJSON_TOK_FALSE))) {
+    return "wrong param type";
+  }
+  if (a->type == MJSON_TOK_NUMBER) {
+    a->num = mystrtod(a->ptr, NULL);
+  } else if (a->type == MJSON_TOK_STRING) {
+    a->num = a->len - 2;
+  } else {
+    a->num = a->type == MJSON_TOK_TRUE ? 1 : 0;
+  }
+  if (p->max > p->min &&
+      (a->type == MJSON_TOK_NUMBER || a->type == MJSON_TOK_STRING) &&
+      (a->num < p->min || a->num > p->max)) {
+    return "param out of range";
+  }
+  return NULL;
+}
+
+// Extract params listed in the method schema into args, in one pass over
+// the top level of params. Object members are matched by name, array
+// elements by position. On mismatch, reply with an error and return -1
+static int jsonrpc_check_params(const struct jsonrpc_method *m,
+                                struct jsonrpc_request *r,
+                                struct jsonrpc_arg *args) {
+  const char *s = r->params, *key = NULL, *msg;
+  int i = 1, j, k, klen = 0, idx = 0, n = r->params_len;
+  memset(args, 0, sizeof(*args) * (size_t) m->num_params);
+  if (n > 0 && s[0] != '{' && s[0] != '[') goto invalid;
+  while (i < n && is_space(s[i])) i++;
+  while (i < n && s[i] != s[0] + 2) {  // '{' + 2 == '}', '[' + 2 == ']'
+    if (s[0] == '{') {
+      if (s[i] != '"' || (k = mjson_pass_string(s + i + 1, n - i - 1)) < 0) {
+        goto invalid;
+      }
+      key = s + i + 1, klen = k, i += k + 2;
+      while (i < n && is_space(s[i])) i++;
+      if (i >= n || s[i++] != ':') goto invalid;
+      while (i < n && is_space(s[i])) i++;
+    }
+    if ((k = jsonrpc_skip_value(s + i, n - i)) <= 0) goto invalid;
+    for (j = 0; j < m->num_params; j++) {
+      const char *name = m->params[j].name;
+      if (args[j].ptr != NULL) continue;
+      if (s[0] == '{' ? name != NULL && (int) strlen(name) == klen &&
+                            memcmp(name, key, (size_t) klen) == 0
+                      : j == idx) {
+        args[j].ptr = s + i, args[j].len = k;
+        args[j].type = jsonrpc_arg_type(s[i]);
+        break;
+      }
+    }
+    idx++, i += k;
+    while (i < n && is_space(s[i])) i++;
+    if (i < n && s[i] == ',') {
+      i++;
+      while (i < n && is_space(s[i])) i++;
+      if (i < n && s[i] == s[0] + 2) goto invalid;
+    } else if (i < n && s[i] != s[0] + 2) {
+      goto invalid;
+    }
+  }
+  if (n > 0 && i >= n) goto invalid;
+  for (j = 0; j < m->num_params; j++) {
+    if ((msg = jsonrpc_check_arg(&m->params[j], &args[j])) != NULL) {
+      jsonrpc_param_error(r, &m->params[j], j, msg);
+      return -1;
+    }
+  }
+  r->args = args, r->num_args = m->num_params, r->schema = m->params;
+  return 0;
+invalid:
+  jsonrpc_param_error(r, NULL, 0, "invalid params");
+  return -1;
+}
+#endif
+
+// Route a response frame to the callback of its request.
+// Return 0 on success, or -1 if the id does not match any call
+static int jsonrpc_call_response(struct jsonrpc_ctx *ctx, const char *buf,
+                                 int len, const char **vals, int *lens) {
+  struct jsonrpc_response res;
+  const char *s = vals[JSONRPC_ID];
+  unsigned long id = 0;
+  int i, n = lens[JSONRPC_ID];
+  if (s == NULL || n <= 0 || ctx->num_calls <= 0) return -1;
+  for (i = 0; i < n; i++) {
+    if (s[i] < '0' || s[i] > '9') return -1;
+    id = id * 10 + (unsigned long) (s[i] - '0');
+  }
+  i = (int) (id % (unsigned long) ctx->num_calls);
+  if (id == 0 || ctx->calls[i].id != id) return -1;
+  memset(&res, 0, sizeof(res));
+  res.frame = buf, res.frame_len = len;
+  res.result = vals[JSONRPC_RESULT], res.result_len = lens[JSONRPC_RESULT];
+  res.error = vals[JSONRPC_ERROR], res.error_len = lens[JSONRPC_ERROR];
+  jsonrpc_call_done(ctx, i, &res);
+  return 0;
+}
+
+static void jsonrpc_process_frame(struct jsonrpc_ctx *ctx, const char *buf,
+                                  int len, mjson_print_fn_t fn, void *fn_data,
+                                  void *ud) {
+  const char *vals[JSONRPC_PARAMS + 1] = {NULL, NULL, NULL, NULL, NULL};
+  int lens[JSONRPC_PARAMS + 1] = {0, 0, 0, 0, 0};
+  const struct jsonrpc_method *m = NULL;
+  struct jsonrpc_request r;
+  int ok = jsonrpc_parse_frame(buf, len, vals, lens) == 0;
+#if MJSON_ENABLE_RPC_SCHEMA
+  struct jsonrpc_arg args[MJSON_RPC_MAX_PARAMS];
+#endif
 
   // Is is a response frame?
-  mjson_find(buf, len, "$.result", &result, &result_sz);
-  if (result == NULL) mjson_find(buf, len, "$.error", &error, &error_sz);
-  if (result_sz > 0 || error_sz > 0) {
+  if (ok && (vals[JSONRPC_RESULT] != NULL || vals[JSONRPC_ERROR] != NULL)) {
+    if (jsonrpc_call_response(ctx, buf, len, vals, lens) == 0) return;
     if (ctx->response_cb) ctx->response_cb(buf, len, ctx->response_cb_data);
     return;
   }
 
   // Method must exist and must be a string
-  if (mjson_find(buf, len, "$.method", &r.method, &r.method_len) !=
-      MJSON_TOK_STRING) {
+  if (!ok || vals[JSONRPC_METHOD] == NULL || vals[JSONRPC_METHOD][0] != '"') {
     mjson_printf(fn, fn_data,
                  "{\"error\":{\"code\":-32700,\"message\":%.*Q}}\n", len, buf);
     return;
   }
+  memset(&r, 0, sizeof(r));
+  r.ctx = ctx, r.frame = buf, r.frame_len = len;
+  r.fn = fn, r.fn_data = fn_data, r.userdata = ud;
+  r.method = vals[JSONRPC_METHOD], r.method_len = lens[JSONRPC_METHOD];
 
   // id and params are optional
-  mjson_find(buf, len, "$.id", &r.id, &r.id_len);
-  mjson_find(buf, len, "$.params", &r.params, &r.params_len);
-
-  for (m = ctx->methods; m != NULL; m = m->next) {
-    if (mjson_globmatch(m->method, m->method_sz, r.method + 1,
-                        r.method_len - 2) > 0) {
-      if (r.params == NULL) r.params = "";
-      m->cb(&r);
-      break;
+  r.id = vals[JSONRPC_ID], r.id_len = lens[JSONRPC_ID];
+  r.params = vals[JSONRPC_PARAMS], r.params_len = lens[JSONRPC_PARAMS];
+
+  m = jsonrpc_ctx_find(ctx, r.method + 1, r.method_len - 2);
+  if (m != NULL) {
+    if (r.params == NULL) r.params = "";
+#if MJSON_ENABLE_RPC_EXECUTOR
+    if (m->priority > 0 && fn == jsonrpc_reply_print &&
+        !((struct jsonrpc_reply *) fn_data)->queued &&
+        jsonrpc_enqueue(ctx->executor, m->priority, buf, len,
+                        (struct jsonrpc_reply *) fn_data, ud) == 0) {
+      return;
     }
-  }
-  if (m == NULL) {
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+    if (m->num_params > 0 && jsonrpc_check_params(m, &r, args) != 0) return;
+#endif
+    jsonrpc_invoke(ctx, m, &r);
+  } else {
     jsonrpc_return_error(&r, JSONRPC_ERROR_NOT_FOUND, "method not found", NULL);
   }
 }
 
+struct jsonrpc_batch_item {
+  const char *frame;  // Batch element
+  int frame_len;      // Batch element length
+  char *out;          // Response, allocated by mjson_print_dynamic_buf()
+};
+
+struct jsonrpc_batch {
+  struct jsonrpc_ctx *ctx;
+  struct jsonrpc_batch_item *items;
+  void *userdata;
+  int max;                    // Allocated number of items
+  struct mjson_arena *arena;  // Arena of the batch printer, or NULL
+};
+
+static void jsonrpc_batch_item_cb(int i, void *arg) {
+  struct jsonrpc_batch *b = (struct jsonrpc_batch *) arg;
+  struct jsonrpc_batch_item *it = &b->items[i];
+  if (it->frame[0] != '{') {  // Valid JSON, but not a request object
+    mjson_printf(jsonrpc_batch_print, &it->out,
+                 "{\"error\":{\"code\":%d,\"message\":%Q}}\n",
+                 JSONRPC_ERROR_BAD_REQUEST, "invalid request");
+    return;
+  }
+  jsonrpc_process_frame(b->ctx, it->frame, it->frame_len, jsonrpc_batch_print,
+                        &it->out, b->userdata);
+}
+
+// Split the batch array into elements. Return the number of elements,
+// 0 if the array is empty, -1 if it is malformed, or -2 on allocation
+// failure.
+static int jsonrpc_batch_split(const char *s, int n, struct jsonrpc_batch *b) {
+  int i = 1, k, num = 0;
+  struct jsonrpc_batch_item *tmp;
+  while (i < n && is_space(s[i])) i++;
+  if (i < n && s[i] == ']') return 0;
+  for (;;) {
+    if ((k = jsonrpc_skip_value(s + i, n - i)) <= 0) return -1;
+    if (num >= b->max) {
+      int max = b->max == 0 ? 8 : b->max * 2;
+      tmp = (struct jsonrpc_batch_item *) mjson_scratch_realloc(
+          b->arena, b->items, (size_t) b->max * sizeof(*tmp),
+          (size_t) max * sizeof(*tmp));
+      if (tmp == NULL) return -2;
+      b->items = tmp, b->max = max;
+    }
+    b->items[num].frame = s + i, b->items[num].frame_len = k;
+    b->items[num].out = NULL;
+    num++, i += k;
+    while (i < n && is_space(s[i])) i++;
+    if (i >= n) return -1;
+    if (s[i] == ']') return num;
+    if (s[i++] != ',') return -1;
+    while (i < n && is_space(s[i])) i++;
+  }
+}
+
+// Length of the element response without the trailing newline
+static int jsonrpc_batch_item_len(const struct jsonrpc_batch_item *it) {
+  int len = it->out == NULL ? 0 : (int) strlen(it->out);
+  if (len > 0 && it->out[len - 1] == '\n') len--;
+  return len;
+}
+
+static void jsonrpc_batch_free(struct jsonrpc_batch *b) {
+  if (b->items != NULL) {
+    mjson_scratch_free(b->arena, b->items, (size_t) b->max * sizeof(*b->items));
+  }
+}
+
+// Dispatch batch elements via the batch executor, then join responses into
+// one array that is passed to the printer by a single call. Responses of
+// elements are heap-allocated even when printing into an arena, because
+// the batch executor may produce them in parallel
+static void jsonrpc_process_batch(struct jsonrpc_ctx *ctx, const char *buf,
+                                  int len, mjson_print_fn_t fn, void *fn_data,
+                                  void *ud) {
+  struct jsonrpc_batch b;
+  int i, n, olen, size = 3;
+  char *out;
+
+  memset(&b, 0, sizeof(b));
+  b.ctx = ctx, b.userdata = ud, b.arena = mjson_arena_of(fn, fn_data);
+  if ((n = jsonrpc_batch_split(buf, len, &b)) <= 0) {
+    if (n == 0) {  // Valid JSON, but an empty batch is not a request
+      mjson_printf(fn, fn_data, "{\"error\":{\"code\":%d,\"message\":%Q}}\n",
+                   JSONRPC_ERROR_BAD_REQUEST, "invalid request");
+    } else if (n == -1) {
+      mjson_printf(fn, fn_data,
+                   "{\"error\":{\"code\":-32700,\"message\":%.*Q}}\n", len,
+                   buf);
+    } else {
+      mjson_printf(fn, fn_data, "{\"error\":{\"code\":%d,\"message\":%Q}}\n",
+                   JSONRPC_ERROR_INTERNAL, "out of memory");
+    }
+    jsonrpc_batch_free(&b);
+    return;
+  }
+
+  if (ctx->batch_fn != NULL) {
+    ctx->batch_fn(jsonrpc_batch_item_cb, &b, n, ctx->batch_fn_data);
+  } else {
+    for (i = 0; i < n; i++) jsonrpc_batch_item_cb(i, &b);
+  }
+
+  // Responses are joined without their trailing newlines, by commas.
+  // Size is brackets, a newline, and a separator per response but the first
+  for (i = 0; i < n; i++) {
+    int plen = jsonrpc_batch_item_len(&b.items[i]);
+    if (plen > 0) size += plen + (size > 3 ? 1 : 0);
+  }
+  if (size > 3 && (out = (char *) mjson_scratch_realloc(
+                       b.arena, NULL, 0, (size_t) size)) != NULL) {
+    out[0] = '[', olen = 1;
+    for (i = 0; i < n; i++) {
+      int plen = jsonrpc_batch_item_len(&b.items[i]);
+      if (plen == 0) continue;
+      if (olen > 1) out[olen++] = ',';
+      memcpy(out + olen, b.items[i].out, (size_t) plen);
+      olen += plen;
+    }
+    out[olen++] = ']', out[olen++] = '\n';
+    fn(out, olen, fn_data);
+    mjson_scratch_free(b.arena, out, (size_t) size);
+  } else if (size > 3) {
+    mjson_printf(fn, fn_data, "{\"error\":{\"code\":%d,\"message\":%Q}}\n",
+                 JSONRPC_ERROR_INTERNAL, "out of memory");
+  }
+  for (i = 0; i < n; i++) MJSON_FREE(b.items[i].out);
+  jsonrpc_batch_free(&b);
+}
+
+static void jsonrpc_dispatch(struct jsonrpc_ctx *ctx, const char *buf,
+                             int len, mjson_print_fn_t fn, void *fn_data,
+                             void *ud) {
+  int i = 0;
+  while (i < len && is_space(buf[i])) i++;
+  if (i < len && buf[i] == '[') {
+    jsonrpc_process_batch(ctx, buf + i, len - i, fn, fn_data, ud);
+  } else {
+    jsonrpc_process_frame(ctx, buf, len, fn, fn_data, ud);
+  }
+}
+
+void jsonrpc_ctx_process(struct jsonrpc_ctx *ctx, const char *buf, int len,
+                         mjson_print_fn_t fn, void *fn_data, void *ud) {
+#if MJSON_ENABLE_RPC_EXECUTOR
+  if (ctx->executor != NULL) {
+    struct jsonrpc_reply rp;
+    rp.fn = fn, rp.fn_data = fn_data, rp.buf = NULL, rp.queued = 0;
+    jsonrpc_dispatch(ctx, buf, len, jsonrpc_reply_print, &rp, ud);
+    jsonrpc_reply_flush(&rp);
+    return;
+  }
+#endif
+  jsonrpc_dispatch(ctx, buf, len, fn, fn_data, ud);
+}
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+void jsonrpc_executor_init(struct jsonrpc_executor *ex,
+                           void (*lock_fn)(void *), void (*unlock_fn)(void *),
+                           void (*wake_fn)(void *), void *data) {
+  memset(ex, 0, sizeof(*ex));
+  ex->lock_fn = lock_fn, ex->unlock_fn = unlock_fn, ex->wake_fn = wake_fn;
+  ex->data = data;
+}
+
+// Run one queued request, the one with the lowest priority number.
+// Return 1 if a request has been run, or 0 if the queue is empty
+int jsonrpc_ctx_work(struct jsonrpc_ctx *ctx) {
+  struct jsonrpc_executor *ex = ctx->executor;
+  struct jsonrpc_job *j = NULL;
+  struct jsonrpc_reply rp;
+  int i;
+  if (ex == NULL) return 0;
+  if (ex->lock_fn != NULL) ex->lock_fn(ex->data);
+  for (i = 1; i < MJSON_RPC_PRIORITIES && j == NULL; i++) {
+    if ((j = ex->head[i]) == NULL) continue;
+    ex->head[i] = j->next;
+    if (j->next == NULL) ex->tail[i] = NULL;
+    ex->num_jobs--;
+  }
+  if (ex->unlock_fn != NULL) ex->unlock_fn(ex->data);
+  if (j == NULL) return 0;
+  rp.fn = j->fn, rp.fn_data = j->fn_data, rp.buf = NULL, rp.queued = 1;
+  jsonrpc_process_frame(ctx, (char *) (j + 1), j->len, jsonrpc_reply_print,
+                        &rp, j->userdata);
+  jsonrpc_reply_flush(&rp);
+  MJSON_FREE(j);
+  return 1;
+}
+#endif
+
+void jsonrpc_stream_init(struct jsonrpc_stream *st, struct jsonrpc_ctx *ctx,
+                         char *buf, int size, mjson_print_fn_t fn,
+                         void *fn_data, void *userdata) {
+  memset(st, 0, sizeof(*st));
+  st->ctx = ctx, st->buf = buf, st->size = size;
+  st->fn = fn, st->fn_data = fn_data, st->userdata = userdata;
+}
+
+// Append a piece of a frame to the stream buffer. If it does not fit,
+// the whole frame is dropped
+static void jsonrpc_stream_append(struct jsonrpc_stream *st, const char *p,
+                                  int n) {
+  if (st->overflow || n <= 0) return;
+  if (st->len + n > st->size) {
+    st->overflow = 1, st->len = 0;
+  } else {
+    memcpy(st->buf + st->len, p, (size_t) n);
+    st->len += n;
+  }
+}
+
+// Frame boundaries are found by bracket depth, or by a newline outside of
+// brackets. Every byte is scanned once, the state is kept across calls.
+// A frame that arrives in one chunk is dispatched directly from it, if it
+// is not longer than the buffer.
+int jsonrpc_stream_feed(struct jsonrpc_stream *st, const char *data, int len) {
+  int i, start = 0, frames = 0;
+  for (i = 0; i < len; i++) {
+    char c = data[i];
+    int end = 0;
+    if (!st->started) {
+      if (is_space(c)) {
+        start = i + 1;
+        continue;
+      }
+      st->started = 1;
+    }
+    if (st->escaped) {
+      st->escaped = 0;
+    } else if (st->in_string) {
+      if (c == '\\') st->escaped = 1;
+      if (c == '"') st->in_string = 0;
+      if (c == '\n') end = 1;  // Invalid, but lets us resync
+    } else if (c == '"') {
+      st->in_string = 1;
+    } else if (c == '{' || c == '[') {
+      st->depth++;
+    } else if (c == '}' || c == ']') {
+      end = --st->depth <= 0;
+    } else if (c == '\n') {
+      end = st->depth <= 0;
+    }
+    if (!end) continue;
+    if (st->len == 0 && !st->overflow && i + 1 - start <= st->size) {
+      jsonrpc_ctx_process(st->ctx, data + start, i + 1 - start, st->fn,
+                          st->fn_data, st->userdata);
+    } else {
+      jsonrpc_stream_append(st, data + start, i + 1 - start);
+      if (st->overflow) {
+        mjson_printf(st->fn, st->fn_data,
+                     "{\"error\":{\"code\":%d,\"message\":%Q}}\n",
+                     JSONRPC_ERROR_INVALID, "frame too long");
+      } else {
+        jsonrpc_ctx_process(st->ctx, st->buf, st->len, st->fn, st->fn_data,
+                            st->userdata);
+      }
+    }
+    st->len = st->depth = st->started = st->in_string = st->overflow = 0;
+    start = i + 1;
+    frames++;
+  }
+  if (st->started) jsonrpc_stream_append(st, data + start, len - start);
+  return frames;
+}
+
+// Printer that appends to a frame. fn_data is a struct jsonrpc_frame **,
+// the frame is allocated on first call. Frame data follows the structure,
+// so a frame is a single allocation
+int jsonrpc_frame_print(const char *buf, int len, void *fn_data) {
+  struct jsonrpc_frame *f = *(struct jsonrpc_frame **) fn_data;
+  int n = f == NULL ? 0 : f->len;
+  if (n < 0) return 0;
+  if (f == NULL || n + len > f->size) {
+    int size = f == NULL ? MJSON_DYNBUF_CHUNK : f->size;
+    struct jsonrpc_frame *tmp;
+    while (size < n + len) size *= 2;
+    tmp = (struct jsonrpc_frame *) MJSON_REALLOC(f, sizeof(*f) + (size_t) size);
+    if (tmp == NULL) {
+      if (f != NULL) f->len = -1;
+      return 0;
+    }
+    if (f == NULL) tmp->refs = 1;
+    f = tmp, f->len = n, f->size = size;
+    f->buf = (const char *) (f + 1);
+    *(struct jsonrpc_frame **) fn_data = f;
+  }
+  if (len > 0) memcpy((char *) (f + 1) + n, buf, (size_t) len);
+  f->len += len;
+  return len;
+}
+
+struct jsonrpc_frame *jsonrpc_frame_notify(const char *method,
+                                           const char *params_fmt, ...) {
+  struct jsonrpc_frame *f = NULL;
+  va_list ap;
+  jsonrpc_frame_print("", 0, &f);  // Allocate first, so nothing is lost
+  if (f == NULL) return NULL;
+  mjson_printf(jsonrpc_frame_print, &f, "{\"method\":%Q", method);
+  if (params_fmt != NULL) {
+    mjson_printf(jsonrpc_frame_print, &f, ",\"params\":");
+    va_start(ap, params_fmt);
+    mjson_vprintf(jsonrpc_frame_print, &f, params_fmt, &ap);
+    va_end(ap);
+  }
+  mjson_printf(jsonrpc_frame_print, &f, "}\n");
+  if (f->len < 0) {
+    MJSON_FREE(f);
+    f = NULL;
+  }
+  return f;
+}
+
+struct jsonrpc_frame *jsonrpc_frame_ref(struct jsonrpc_frame *f) {
+  if (f != NULL) MJSON_ATOMIC_ADD(&f->refs, 1);
+  return f;
+}
+
+void jsonrpc_frame_unref(struct jsonrpc_frame *f) {
+  if (f != NULL && MJSON_ATOMIC_ADD(&f->refs, -1) == 1) MJSON_FREE(f);
+}
+
+// Pass the same bytes to every sink. Return the number of sinks that
+// accepted the whole frame
+int jsonrpc_frame_send(const struct jsonrpc_frame *f,
+                       const struct jsonrpc_sink *sinks, int num_sinks) {
+  int i, n = 0;
+  if (f == NULL || f->len < 0) return 0;
+  for (i = 0; i < num_sinks; i++) {
+    if (sinks[i].fn(f->buf, f->len, sinks[i].fn_data) == f->len) n++;
+  }
+  return n;
+}
+
+// Ring records are a 4 byte length followed by the frame, padded to 4 bytes.
+// A record never wraps around the ring end, so that the consumer sees a
+// contiguous frame. If it does not fit before the end, the rest of the ring
+// is skipped with a padding record
+#define JSONRPC_RING_PAD 0xffffffffU
+#define JSONRPC_RING_ALIGN(n) (((n) + 3U) & ~3U)
+
+struct jsonrpc_ring *jsonrpc_ring_init(void *mem, size_t mem_size) {
+  struct jsonrpc_ring *ring = (struct jsonrpc_ring *) mem;
+  unsigned size = 8;
+  if (mem_size < sizeof(*ring) + size) return NULL;
+  while (size <= 0x40000000U && sizeof(*ring) + size * 2 <= mem_size) {
+    size *= 2;
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->size = size;
+  return ring;
+}
+
+static char *jsonrpc_ring_data(struct jsonrpc_ring *ring, unsigned pos) {
+  return (char *) (ring + 1) + (pos & (ring->size - 1));
+}
+
+// Printer that appends to the open frame of a ring. fn_data is the ring
+int jsonrpc_ring_print(const char *buf, int len, void *fn_data) {
+  struct jsonrpc_ring *ring = (struct jsonrpc_ring *) fn_data;
+  unsigned off = ring->wstart & (ring->size - 1), need, tail;
+  if (ring->wfail || len < 0) return 0;
+  need = JSONRPC_RING_ALIGN(4 + ring->wlen + (unsigned) len);
+  tail = MJSON_LOAD(&ring->tail);
+  if (off + need > ring->size) {  // Move the open frame to the ring start
+    unsigned pad = ring->size - off, mark = JSONRPC_RING_PAD;
+    if (ring->wstart + pad + need - tail > ring->size) goto fail;
+    memmove(jsonrpc_ring_data(ring, 4), jsonrpc_ring_data(ring, off + 4),
+            ring->wlen);
+    memcpy(jsonrpc_ring_data(ring, off), &mark, 4);
+    ring->wstart += pad;
+  } else if (ring->wstart + need - tail > ring->size) {
+    goto fail;
+  }
+  memcpy(jsonrpc_ring_data(ring, ring->wstart + 4 + ring->wlen), buf,
+         (size_t) len);
+  ring->wlen += (unsigned) len;
+  return len;
+fail:
+  ring->wfail = 1;
+  return 0;
+}
+
+// Publish the open frame. Return 0 on success, or -1 if the frame did not
+// fit and has been dropped
+int jsonrpc_ring_commit(struct jsonrpc_ring *ring) {
+  unsigned len = ring->wlen, failed = ring->wfail;
+  ring->wlen = ring->wfail = 0;
+  if (failed) {
+    ring->wstart = ring->head;
+    ring->dropped++;
+    return -1;
+  }
+  if (len == 0) return 0;
+  memcpy(jsonrpc_ring_data(ring, ring->wstart), &len, 4);
+  ring->wstart += JSONRPC_RING_ALIGN(4 + len);
+  MJSON_STORE(&ring->head, ring->wstart);
+  return 0;
+}
+
+// Dispatch all frames of the in ring straight from ring memory, and
+// write the responses into the out ring. Stop after a response that did not
+// fit, so the rest of the frames wait until the out consumer makes room.
+// Return the number of dispatched frames
+int jsonrpc_ring_process(struct jsonrpc_ctx *ctx, struct jsonrpc_ring *in,
+                         struct jsonrpc_ring *out, void *userdata) {
+  unsigned head, tail = in->tail, len;
+  int n = 0, full = 0;
+  MJSON_STORE(&in->sleeping, 0);
+  while (!full && (head = MJSON_LOAD(&in->head)) != tail) {
+    while (!full && tail != head) {
+      memcpy(&len, jsonrpc_ring_data(in, tail), 4);
+      if (len == JSONRPC_RING_PAD) {
+        tail += in->size - (tail & (in->size - 1));
+      } else {
+        jsonrpc_ctx_process(ctx, jsonrpc_ring_data(in, tail + 4), (int) len,
+                            out == NULL ? mjson_print_null : jsonrpc_ring_print,
+                            out, userdata);
+        full = out != NULL && jsonrpc_ring_commit(out) != 0;
+        tail += JSONRPC_RING_ALIGN(4 + len);
+        n++;
+      }
+      MJSON_STORE(&in->tail, tail);
+    }
+  }
+  return n;
+}
+
+// Announce that the consumer is going to wait. Return 1 if the ring is
+// empty and the consumer can wait, or 0 if it has frames to process
+int jsonrpc_ring_idle(struct jsonrpc_ring *ring) {
+  MJSON_STORE(&ring->sleeping, 1);
+  if (MJSON_LOAD(&ring->head) == ring->tail) return 1;
+  MJSON_STORE(&ring->sleeping, 0);
+  return 0;
+}
+
+// Return 1 if the consumer waits for a wakeup, to be called after commit
+int jsonrpc_ring_waiting(struct jsonrpc_ring *ring) {
+  return MJSON_LOAD(&ring->sleeping) != 0;
+}
+
 static int jsonrpc_print_methods(mjson_print_fn_t fn, void *fn_data,
                                  va_list *ap) {
   struct jsonrpc_ctx *ctx = va_arg(*ap, struct jsonrpc_ctx *);
-  struct jsonrpc_method *m;
-  int len = 0;
-  for (m = ctx->methods; m != NULL; m = m->next) {
-    if (m != ctx->methods) len += mjson_print_buf(fn, fn_data, ",", 1);
-    len += mjson_print_str(fn, fn_data, m->method, (int) strlen(m->method));
+  const struct jsonrpc_table *t =
+      (const struct jsonrpc_table *) MJSON_LOAD_PTR(&ctx->table);
+  int i, len = 0;
+  for (i = t == NULL ? -1 : t->num_methods - 1; i >= 0; i--) {
+    const struct jsonrpc_method *m = &t->methods[i];
+    if (len > 0) len += mjson_print_buf(fn, fn_data, ",", 1);
+    len += mjson_print_str(fn, fn_data, m->method, m->method_sz);
   }
   return len;
 }
@@ -1053,14 +3704,20 @@ void jsonrpc_list(struct jsonrpc_request *r) {
 
 void jsonrpc_ctx_init(struct jsonrpc_ctx *ctx, mjson_print_fn_t response_cb,
                       void *response_cb_data) {
-  ctx->methods = NULL;
+  memset(ctx, 0, sizeof(*ctx));
   ctx->response_cb = response_cb;
   ctx->response_cb_data = response_cb_data;
+  ctx->pending_free = -1;
+  ctx->calls_free = -1;
 }
 
 void jsonrpc_init(mjson_print_fn_t response_cb, void *userdata) {
   struct jsonrpc_ctx *ctx = &jsonrpc_default_context;
+  jsonrpc_ctx_free(ctx);  // Static storage starts zeroed, so this is safe
   jsonrpc_ctx_init(ctx, response_cb, userdata);
   jsonrpc_ctx_export(ctx, MJSON_RPC_LIST_NAME, jsonrpc_list);
+#if MJSON_ENABLE_RPC_STATS
+  jsonrpc_ctx_export(ctx, MJSON_RPC_STATS_NAME, jsonrpc_stats);
+#endif
 }
 #endif  // MJSON_ENABLE_RPC
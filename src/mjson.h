@@ -23,6 +23,7 @@
 #define MJSON_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -50,18 +51,90 @@
 #define MJSON_ENABLE_NEXT 1
 #endif
 
+#ifndef MJSON_ENABLE_MARSHAL
+#define MJSON_ENABLE_MARSHAL 1
+#endif
+
+#ifndef MJSON_ENABLE_ARENA
+#define MJSON_ENABLE_ARENA 1
+#endif
+
+#ifndef MJSON_ENABLE_STATS
+#define MJSON_ENABLE_STATS 0
+#endif
+
+#ifndef MJSON_ENABLE_RPC_STATS
+#define MJSON_ENABLE_RPC_STATS 0
+#endif
+
+#ifndef MJSON_ENABLE_RPC_CACHE
+#define MJSON_ENABLE_RPC_CACHE 1
+#endif
+
+#ifndef MJSON_ENABLE_RPC_SCHEMA
+#define MJSON_ENABLE_RPC_SCHEMA 1
+#endif
+
+#ifndef MJSON_RPC_MAX_PARAMS
+#define MJSON_RPC_MAX_PARAMS 8  // Max number of params in a method schema
+#endif
+
+#ifndef MJSON_ENABLE_GLOBSET
+#define MJSON_ENABLE_GLOBSET 1
+#endif
+
+#ifndef MJSON_ENABLE_RPC_EXECUTOR
+#define MJSON_ENABLE_RPC_EXECUTOR 0
+#endif
+
+#ifndef MJSON_RPC_PRIORITIES
+#define MJSON_RPC_PRIORITIES 4  // Number of method priority classes
+#endif
+
+#ifndef MJSON_RPC_STATS_SHARDS  // Per-method counter sets, one per thread
+#if MJSON_ENABLE_RPC_EXECUTOR
+#define MJSON_RPC_STATS_SHARDS 8
+#else
+#define MJSON_RPC_STATS_SHARDS 1
+#endif
+#endif
+
+#ifndef MJSON_CACHE_LINE
+#define MJSON_CACHE_LINE 64  // Cache line size, used to pad shared counters
+#endif
+
+#ifndef MJSON_RPC_CACHE_SIZE
+#define MJSON_RPC_CACHE_SIZE 16  // Number of cached RPC responses
+#endif
+
+#ifndef MJSON_RPC_STATS_NAME
+#define MJSON_RPC_STATS_NAME "rpc.stats"
+#endif
+
 #ifndef MJSON_RPC_LIST_NAME
 #define MJSON_RPC_LIST_NAME "rpc.list"
 #endif
 
+#ifndef MJSON_RPC_ID_SIZE
+#define MJSON_RPC_ID_SIZE 24  // Max length of a deferred request id
+#endif
+
 #ifndef MJSON_DYNBUF_CHUNK
 #define MJSON_DYNBUF_CHUNK 256  // Allocation granularity for print_dynamic_buf
 #endif
 
+#ifndef MJSON_WBUF_SIZE
+#define MJSON_WBUF_SIZE 128  // Stack buffer used to coalesce printer calls
+#endif
+
 #ifndef MJSON_REALLOC
 #define MJSON_REALLOC realloc
 #endif
 
+#ifndef MJSON_FREE
+#define MJSON_FREE free
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -95,6 +168,47 @@ int mjson_get_string(const char *buf, int len, const char *path, char *to,
                      int n);
 int mjson_get_hex(const char *buf, int len, const char *path, char *to, int n);
 
+#if MJSON_ENABLE_ARENA
+// Bump allocator over caller-provided memory. If the memory runs out, the
+// arena allocates chunks of at least `chunk` bytes, unless chunk is 0
+struct mjson_arena {
+  char *mem;                         // Caller-provided memory, or NULL
+  size_t mem_size;                   // Size of mem
+  size_t chunk;                      // Min size of an allocated chunk
+  char *buf;                         // Current region
+  size_t size;                       // Size of the current region
+  size_t len;                        // Used bytes of the current region
+  size_t used;                       // Used bytes of previous regions
+  struct mjson_arena_chunk *chunks;  // Allocated chunks, newest first
+};
+
+void mjson_arena_init(struct mjson_arena *a, void *mem, size_t mem_size,
+                      size_t chunk);
+void *mjson_arena_alloc(struct mjson_arena *a, size_t size);
+void *mjson_arena_realloc(struct mjson_arena *a, void *p, size_t old_size,
+                          size_t size);
+void mjson_arena_reset(struct mjson_arena *a);
+void mjson_arena_free(struct mjson_arena *a);
+#endif
+
+#if MJSON_ENABLE_STATS
+// Hot path counters of the calling thread
+struct mjson_stats {
+  unsigned long bytes;             // Bytes of tokens scanned by mjson()
+  unsigned long tokens;            // Tokens scanned by mjson()
+  unsigned long callbacks;         // mjson() callback calls
+  unsigned long find_hits;         // mjson_find() calls that found the path
+  unsigned long find_misses;       // mjson_find() calls that did not
+  unsigned long find_early_exits;  // mjson_find() calls that stopped early
+  unsigned long print_calls;       // Printer calls made by mjson_printf()
+  unsigned long print_bytes;       // Bytes passed to these printer calls
+  unsigned long dynbuf_reallocs;   // mjson_print_dynamic_buf() reallocs
+};
+
+void mjson_stats_get(struct mjson_stats *st);
+void mjson_stats_reset(void);
+#endif
+
 #if MJSON_ENABLE_NEXT
 int mjson_next(const char *buf, int len, int offset, int *key_offset,
                int *key_len, int *val_offset, int *val_len, int *vale_type);
@@ -135,14 +249,92 @@ int mjson_print_dynamic_buf(const char *ptr, int len, void *fn_data);
 int mjson_snprintf(char *buf, size_t len, const char *fmt, ...);
 char *mjson_aprintf(const char *fmt, ...);
 
+#if MJSON_ENABLE_ARENA
+// Output of mjson_print_arena(), NUL-terminated
+struct mjson_arenabuf {
+  struct mjson_arena *arena;
+  char *ptr;
+  int size, len;
+};
+
+int mjson_print_arena(const char *ptr, int len, void *fn_data);
+char *mjson_arena_printf(struct mjson_arena *a, const char *fmt, ...);
+#endif
+
 #if MJSON_ENABLE_PRETTY
 int mjson_pretty(const char *s, int n, const char *pad, mjson_print_fn_t fn,
                  void *fn_data);
+
+// Streaming pretty-printer state, for documents that do not fit in memory
+struct mjson_pretty_stream {
+  const char *pad;                   // Indentation
+  int padlen;                        // Indentation length
+  int level;                         // Current nesting level
+  int prev;                          // Previous significant character
+  int in_string;                     // Set if inside a string
+  int escaped;                       // Set if the previous char was a backslash
+  int len;                           // Total number of bytes printed
+  mjson_print_fn_t fn;               // Printer function
+  void *fn_data;                     // Printer function data
+  char nl[1 + MJSON_MAX_DEPTH * 4];  // Newline and indentation
+  int nl_levels;                     // Indentation levels in nl
+};
+
+void mjson_pretty_init(struct mjson_pretty_stream *ps, const char *pad,
+                       mjson_print_fn_t fn, void *fn_data);
+int mjson_pretty_feed(struct mjson_pretty_stream *ps, const char *buf,
+                      int len);
+int mjson_minify(const char *s, int n, mjson_print_fn_t fn, void *fn_data);
+int mjson_minify_inplace(char *s, int n);
 #endif
 
 #if MJSON_ENABLE_MERGE
 int mjson_merge(const char *s, int n, const char *s2, int n2,
                 mjson_print_fn_t fn, void *fn_data);
+int mjson_merge_many(const char *s, int n, const char **patches,
+                     const int *lens, int num_patches, mjson_print_fn_t fn,
+                     void *fn_data);
+int mjson_diff(const char *s, int n, const char *s2, int n2,
+               mjson_print_fn_t fn, void *fn_data);
+#endif
+
+#if MJSON_ENABLE_MARSHAL
+#define MJSON_TYPE_BOOL 1     // int, printed as true or false
+#define MJSON_TYPE_INT 2      // int
+#define MJSON_TYPE_LONG 3     // long
+#define MJSON_TYPE_DOUBLE 4   // double
+#define MJSON_TYPE_STRING 5   // char[], NUL-terminated
+#define MJSON_TYPE_STRPTR 6   // const char *, NULL is printed as null
+#define MJSON_TYPE_OBJECT 7   // Nested struct, described by the sub table
+
+struct mjson_field {
+  const char *key;                // Quoted, escaped key with colon: "\"a\":"
+  int key_len;                    // Length of the key
+  int type;                       // One of MJSON_TYPE_*
+  size_t offset;                  // Field offset within the struct
+  int size;                       // Field size
+  const struct mjson_field *sub;  // MJSON_TYPE_OBJECT: nested descriptor
+  int nsub;                       // MJSON_TYPE_OBJECT: nested entries
+};
+
+// Describe struct field `member` of struct `st`, emitted under the key `name`.
+// The `name` must be a string literal that does not need JSON escaping.
+#define MJSON_FIELD(name, type, st, member)                                \
+  {                                                                        \
+    "\"" name "\":", (int) sizeof(name) + 2, (type), offsetof(st, member), \
+        (int) sizeof(((st *) 0)->member), NULL, 0                          \
+  }
+
+// Describe a nested struct field, using descriptor array `desc`
+#define MJSON_FIELD_OBJ(name, st, member, desc)                         \
+  {                                                                     \
+    "\"" name "\":", (int) sizeof(name) + 2, MJSON_TYPE_OBJECT,         \
+        offsetof(st, member), (int) sizeof(((st *) 0)->member), (desc), \
+        (int) (sizeof(desc) / sizeof((desc)[0]))                        \
+  }
+
+int mjson_marshal(mjson_print_fn_t fn, void *fn_data,
+                  const struct mjson_field *desc, int n, const void *in);
 #endif
 
 #endif  // MJSON_ENABLE_PRINT
@@ -152,6 +344,46 @@ int mjson_merge(const char *s, int n, const char *s2, int n2,
 void jsonrpc_init(mjson_print_fn_t response_cb, void *fn_data);
 int mjson_globmatch(const char *s1, int n1, const char *s2, int n2);
 
+#if MJSON_ENABLE_GLOBSET
+// Set of glob patterns compiled into a trie of '/'-separated segments
+struct mjson_globset {
+  struct mjson_globnode *nodes;  // Trie nodes, node 0 is the root
+  struct mjson_globedge *edges;  // Literal segments, hashed by node and name
+  struct mjson_globitem *items;  // Pattern ids, wildcard segments and tails
+  char *names;                   // Segment names and pattern tails
+  int num_nodes, nodes_size;
+  int num_edges, edges_size;
+  int num_items, items_size;
+  int names_len, names_size;
+};
+
+void mjson_globset_init(struct mjson_globset *gs);
+int mjson_globset_add(struct mjson_globset *gs, const char *pattern, int len,
+                      int id);
+int mjson_globset_match(const struct mjson_globset *gs, const char *s, int len,
+                        void (*fn)(int id, void *fn_data), void *fn_data);
+void mjson_globset_free(struct mjson_globset *gs);
+#endif
+
+#if MJSON_ENABLE_RPC_SCHEMA
+// Method parameter description, see jsonrpc_ctx_register_schema()
+struct jsonrpc_param {
+  const char *name;  // Key in the params object, or NULL
+  int type;          // MJSON_TOK_* type, 0 means any type
+  int required;      // Set if the parameter must be present
+  double min;        // Min number value, or min string length
+  double max;        // Max number value, or max string length
+};
+
+// Extracted parameter value
+struct jsonrpc_arg {
+  const char *ptr;  // Value in the request frame, or NULL if absent
+  int len;          // Value length
+  int type;         // MJSON_TOK_* type, or MJSON_TOK_INVALID if absent
+  double num;       // Number value, or 1/0 for true/false
+};
+#endif
+
 struct jsonrpc_request {
   struct jsonrpc_ctx *ctx;
   const char *frame;    // Points to the whole frame
@@ -165,33 +397,181 @@ struct jsonrpc_request {
   mjson_print_fn_t fn;  // Printer function
   void *fn_data;        // Printer function data
   void *userdata;       // Callback's user data as specified at export time
+#if MJSON_ENABLE_RPC_SCHEMA
+  const struct jsonrpc_arg *args;  // Params extracted by the method schema
+  int num_args;                    // Number of args, 0 if there is no schema
+  const struct jsonrpc_param *schema;  // Method schema, matches args
+#endif
 };
 
+typedef void (*jsonrpc_handler_t)(struct jsonrpc_request *);
+
+#if MJSON_ENABLE_RPC_STATS
+// Per-method counters. Every method has MJSON_RPC_STATS_SHARDS sets of them,
+// each in its own cache lines, that rpc.stats sums up
+struct jsonrpc_stats_shard;
+struct jsonrpc_method_stats {
+  unsigned long calls;        // Number of calls
+  unsigned long errors;       // Number of calls that returned an error
+  unsigned long bytes_in;     // Total size of request frames
+  unsigned long bytes_out;    // Total size of responses
+  unsigned long latency[32];  // Bucket i counts calls that took < 2^i ticks
+};
+#endif
+
 struct jsonrpc_method {
   const char *method;
   int method_sz;
-  void (*cb)(struct jsonrpc_request *);
-  struct jsonrpc_method *next;
+  jsonrpc_handler_t cb;
+#if MJSON_ENABLE_RPC_STATS
+  struct jsonrpc_stats_shard *stats;  // MJSON_RPC_STATS_SHARDS counter sets
+#endif
+#if MJSON_ENABLE_RPC_CACHE
+  unsigned long ttl;  // Cache responses for that many clock ticks, 0: off
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+  const struct jsonrpc_param *params;  // Params schema, or NULL
+  int num_params;                      // Number of params in the schema
+#endif
+#if MJSON_ENABLE_RPC_EXECUTOR
+  int priority;  // 0: run inline, 1 and up: queue, lower runs first
+#endif
+};
+
+// Pending slot of a deferred request. Slots are provided by the caller
+struct jsonrpc_pending {
+  char id[MJSON_RPC_ID_SIZE];  // Copy of the request id
+  int id_len;                  // Length of the request id
+  int used;                    // Set if the slot holds a pending request
+  int generation;              // Incremented on every slot reuse
+  int next_free;               // Next free slot index, or -1
+  unsigned long deadline;      // Time after which the request times out
+  mjson_print_fn_t fn;         // Printer function of the request
+  void *fn_data;               // Printer function data
 };
 
-// Main RPC context, stores current request information and a list of
-// exported RPC methods.
+// Response to an outgoing request, passed to the jsonrpc_call() callback
+struct jsonrpc_response {
+  struct jsonrpc_ctx *ctx;  // RPC context
+  const char *frame;        // Response frame, or NULL on timeout
+  int frame_len;            // Response frame length
+  const char *result;       // Result, or NULL on error
+  int result_len;           // Result length
+  const char *error;        // Error object, or NULL on success
+  int error_len;            // Error object length
+  void *userdata;           // Callback data passed to jsonrpc_call()
+};
+
+typedef void (*jsonrpc_response_cb_t)(struct jsonrpc_response *);
+
+// Slot for an outgoing request that awaits a response
+struct jsonrpc_call_slot {
+  unsigned long id;          // Request id, or 0 if the slot is free
+  unsigned long deadline;    // Time after which the request times out
+  int timed;                 // Set if the request has a deadline
+  int next_free;             // Next free slot index, or -1
+  jsonrpc_response_cb_t cb;  // Response callback
+  void *cb_data;             // Response callback data
+};
+
+// Batch executor. Must call fn(i, arg) once for every i in [0, n), and
+// return when all calls are complete. Calls can be run in parallel.
+typedef void (*jsonrpc_batch_fn_t)(void (*fn)(int, void *), void *arg, int n,
+                                   void *batch_fn_data);
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+// Queues requests of methods with a non-zero priority, to be run by
+// worker threads. Hooks are called with data as the argument.
+struct jsonrpc_executor {
+  void (*lock_fn)(void *);    // Lock, or NULL if there is a single thread
+  void (*unlock_fn)(void *);  // Unlock, or NULL
+  void (*wake_fn)(void *);    // Called when a request is queued, or NULL
+  void *data;                 // Hooks data
+  int num_jobs;               // Number of queued requests
+  struct jsonrpc_job *head[MJSON_RPC_PRIORITIES];  // Queue per priority
+  struct jsonrpc_job *tail[MJSON_RPC_PRIORITIES];  // Queue tails
+};
+#endif
+
+// Main RPC context, stores current request information and a table of
+// exported RPC methods. The table is immutable: registration publishes
+// a new copy, and the old one is kept until jsonrpc_ctx_reclaim().
 struct jsonrpc_ctx {
-  struct jsonrpc_method *methods;
+  struct jsonrpc_table *table;    // Current method table
+  struct jsonrpc_table *retired;  // Tables replaced by newer ones
   mjson_print_fn_t response_cb;
   void *response_cb_data;
+  jsonrpc_batch_fn_t batch_fn;      // Batch executor, NULL means sequential
+  void *batch_fn_data;              // Batch executor data
+  struct jsonrpc_pending *pending;  // Pending slots for deferred requests
+  int num_pending;                  // Number of pending slots
+  int pending_free;                 // First free pending slot, or -1
+  unsigned long (*clock_fn)(void);  // Clock for stats and cache, or NULL
+  mjson_print_fn_t request_fn;      // Printer for outgoing requests
+  void *request_fn_data;            // Printer for outgoing requests data
+  struct jsonrpc_call_slot *calls;  // Slots for outgoing requests
+  int num_calls;                    // Number of call slots
+  int calls_free;                   // First free call slot, or -1
+  int calls_timed;                  // Number of calls with a deadline
+  unsigned long calls_seq;          // Sequence number of the last call
+  unsigned long calls_deadline;     // Earliest call deadline
+#if MJSON_ENABLE_RPC_CACHE
+  struct jsonrpc_cache *cache;  // Cached responses
+#endif
+#if MJSON_ENABLE_RPC_EXECUTOR
+  struct jsonrpc_executor *executor;  // Request queue, NULL means inline
+#endif
 };
 
-// Registers function fn under the given name within the given RPC context
-#define jsonrpc_ctx_export(ctx, name, fn)                                 \
-  do {                                                                    \
-    static struct jsonrpc_method m = {(name), sizeof(name) - 1, (fn), 0}; \
-    m.next = (ctx)->methods;                                              \
-    (ctx)->methods = &m;                                                  \
-  } while (0)
+// Registers function fn under the given name within the given RPC context.
+// Allocates a new method table, returns 0, or -1 if out of memory
+#define jsonrpc_ctx_export(ctx, name, fn) \
+  jsonrpc_ctx_register((ctx), (name), (fn))
 
+// Zeroes ctx. A context that was used must be released with
+// jsonrpc_ctx_free() before it is initialised again
 void jsonrpc_ctx_init(struct jsonrpc_ctx *ctx, mjson_print_fn_t response_cb,
                       void *response_cb_data);
+int jsonrpc_ctx_register(struct jsonrpc_ctx *ctx, const char *name,
+                         jsonrpc_handler_t fn);
+int jsonrpc_ctx_unregister(struct jsonrpc_ctx *ctx, const char *name);
+// Frees retired method tables at once, without tracking readers. The caller
+// must guarantee a quiescent state: no thread may be dispatching a request
+// of ctx, or running one of its handlers, that started before the tables
+// were retired. Otherwise that thread uses freed memory
+void jsonrpc_ctx_reclaim(struct jsonrpc_ctx *ctx);
+#if MJSON_ENABLE_RPC_CACHE
+// Like jsonrpc_ctx_export(), but successful responses are cached for ttl
+// ticks of ctx->clock_fn. If ctx->clock_fn is NULL, nothing is cached and the
+// handler runs on every call, without any error
+#define jsonrpc_ctx_export_cached(ctx, name, fn, ttl) \
+  jsonrpc_ctx_register_cached((ctx), (name), (fn), (ttl))
+int jsonrpc_ctx_register_cached(struct jsonrpc_ctx *ctx, const char *name,
+                                jsonrpc_handler_t fn, unsigned long ttl);
+void jsonrpc_ctx_cache_flush(struct jsonrpc_ctx *ctx);
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+// Like jsonrpc_ctx_export(), but params are checked against the schema
+// before fn is called, and passed to fn as r->args
+#define jsonrpc_ctx_export_schema(ctx, name, fn, params, n) \
+  jsonrpc_ctx_register_schema((ctx), (name), (fn), (params), (n))
+int jsonrpc_ctx_register_schema(struct jsonrpc_ctx *ctx, const char *name,
+                                jsonrpc_handler_t fn,
+                                const struct jsonrpc_param *params, int n);
+#endif
+#if MJSON_ENABLE_RPC_EXECUTOR
+// Like jsonrpc_ctx_export(), but requests are queued to ctx->executor
+// if priority is non-zero
+#define jsonrpc_ctx_export_priority(ctx, name, fn, priority) \
+  jsonrpc_ctx_register_priority((ctx), (name), (fn), (priority))
+int jsonrpc_ctx_register_priority(struct jsonrpc_ctx *ctx, const char *name,
+                                  jsonrpc_handler_t fn, int priority);
+void jsonrpc_executor_init(struct jsonrpc_executor *ex,
+                           void (*lock_fn)(void *), void (*unlock_fn)(void *),
+                           void (*wake_fn)(void *), void *data);
+int jsonrpc_ctx_work(struct jsonrpc_ctx *ctx);
+#endif
+void jsonrpc_ctx_free(struct jsonrpc_ctx *ctx);
 void jsonrpc_return_error(struct jsonrpc_request *r, int code,
                           const char *message, const char *data_fmt, ...);
 void jsonrpc_return_success(struct jsonrpc_request *r, const char *result_fmt,
@@ -199,19 +579,116 @@ void jsonrpc_return_success(struct jsonrpc_request *r, const char *result_fmt,
 void jsonrpc_ctx_process(struct jsonrpc_ctx *ctx, const char *req, int req_sz,
                          mjson_print_fn_t fn, void *fn_data, void *userdata);
 
+// Deadline of a deferred request that never times out
+#define JSONRPC_NO_DEADLINE ((unsigned long) -1)
+
+void jsonrpc_ctx_set_pending(struct jsonrpc_ctx *ctx,
+                             struct jsonrpc_pending *slots, int num_slots);
+int jsonrpc_defer(struct jsonrpc_request *r, unsigned long deadline);
+int jsonrpc_return_success_deferred(struct jsonrpc_ctx *ctx, int handle,
+                                    const char *result_fmt, ...);
+int jsonrpc_return_error_deferred(struct jsonrpc_ctx *ctx, int handle,
+                                  int code, const char *message,
+                                  const char *data_fmt, ...);
+int jsonrpc_ctx_sweep(struct jsonrpc_ctx *ctx, unsigned long now);
+void jsonrpc_ctx_set_calls(struct jsonrpc_ctx *ctx,
+                           struct jsonrpc_call_slot *slots, int num_slots);
+int jsonrpc_call(struct jsonrpc_ctx *ctx, const char *method,
+                 jsonrpc_response_cb_t cb, void *cb_data,
+                 unsigned long timeout, const char *params_fmt, ...);
+
+// Splits a byte stream into frames, and passes them to jsonrpc_ctx_process()
+struct jsonrpc_stream {
+  struct jsonrpc_ctx *ctx;  // RPC context
+  char *buf;                // Buffer for frames split between chunks
+  int size;                 // Buffer size, max frame length
+  int len;                  // Number of buffered bytes
+  int started;              // Set if inside a frame
+  int depth;                // Bracket depth
+  int in_string;            // Set if inside a string
+  int escaped;              // Set if the previous character was a backslash
+  int overflow;             // Set if the current frame does not fit buf
+  mjson_print_fn_t fn;      // Printer function
+  void *fn_data;            // Printer function data
+  void *userdata;           // Passed to handlers as r->userdata
+};
+
+void jsonrpc_stream_init(struct jsonrpc_stream *st, struct jsonrpc_ctx *ctx,
+                         char *buf, int size, mjson_print_fn_t fn,
+                         void *fn_data, void *userdata);
+int jsonrpc_stream_feed(struct jsonrpc_stream *st, const char *data, int len);
+
+// Immutable, reference counted frame, rendered once and sent to many sinks
+struct jsonrpc_frame {
+  int refs;         // Reference count
+  int len;          // Frame length, or -1 if rendering ran out of memory
+  int size;         // Allocated size of buf
+  const char *buf;  // Frame data, follows this structure
+};
+
+// Destination of a frame, e.g. a connection printer
+struct jsonrpc_sink {
+  mjson_print_fn_t fn;  // Printer function
+  void *fn_data;        // Printer function data
+};
+
+int jsonrpc_frame_print(const char *buf, int len, void *fn_data);
+struct jsonrpc_frame *jsonrpc_frame_notify(const char *method,
+                                           const char *params_fmt, ...);
+struct jsonrpc_frame *jsonrpc_frame_ref(struct jsonrpc_frame *f);
+void jsonrpc_frame_unref(struct jsonrpc_frame *f);
+int jsonrpc_frame_send(const struct jsonrpc_frame *f,
+                       const struct jsonrpc_sink *sinks, int num_sinks);
+
+// Single producer, single consumer ring of frames, placed in memory shared
+// by both sides, e.g. a shm_open() mapping. Frame data follows the header
+struct jsonrpc_ring {
+  unsigned size;      // Data size, a power of 2
+  unsigned head;      // Write counter, advanced by the producer on commit
+  unsigned wstart;    // Producer: start of the open frame
+  unsigned wlen;      // Producer: length of the open frame
+  unsigned wfail;     // Producer: set if the open frame does not fit
+  unsigned dropped;   // Producer: number of frames that did not fit
+  char pad1[40];      // Keep consumer fields in another cache line
+  unsigned tail;      // Read counter, advanced by the consumer
+  unsigned sleeping;  // Set by the consumer while it waits for a wakeup
+  char pad2[56];
+};
+
+struct jsonrpc_ring *jsonrpc_ring_init(void *mem, size_t mem_size);
+int jsonrpc_ring_print(const char *buf, int len, void *fn_data);
+int jsonrpc_ring_commit(struct jsonrpc_ring *ring);
+int jsonrpc_ring_process(struct jsonrpc_ctx *ctx, struct jsonrpc_ring *in,
+                         struct jsonrpc_ring *out, void *userdata);
+int jsonrpc_ring_idle(struct jsonrpc_ring *ring);
+int jsonrpc_ring_waiting(struct jsonrpc_ring *ring);
+
 extern struct jsonrpc_ctx jsonrpc_default_context;
 extern void jsonrpc_list(struct jsonrpc_request *r);
+#if MJSON_ENABLE_RPC_STATS
+extern void jsonrpc_stats(struct jsonrpc_request *r);
+#endif
 
 #define jsonrpc_export(name, fn) \
   jsonrpc_ctx_export(&jsonrpc_default_context, (name), (fn))
+#define jsonrpc_export_cached(name, fn, ttl) \
+  jsonrpc_ctx_export_cached(&jsonrpc_default_context, (name), (fn), (ttl))
+#define jsonrpc_export_schema(name, fn, params, n)                        \
+  jsonrpc_ctx_export_schema(&jsonrpc_default_context, (name), (fn), \
+                            (params), (n))
+#define jsonrpc_export_priority(name, fn, priority)                         \
+  jsonrpc_ctx_export_priority(&jsonrpc_default_context, (name), (fn), \
+                              (priority))
 
 #define jsonrpc_process(buf, len, fn, fnd, ud) \
   jsonrpc_ctx_process(&jsonrpc_default_context, (buf), (len), (fn), (fnd), (ud))
 
 #define JSONRPC_ERROR_INVALID -32700    /* Invalid JSON was received */
+#define JSONRPC_ERROR_BAD_REQUEST -32600 /* Not a valid request object */
 #define JSONRPC_ERROR_NOT_FOUND -32601  /* The method does not exist */
 #define JSONRPC_ERROR_BAD_PARAMS -32602 /* Invalid params passed */
 #define JSONRPC_ERROR_INTERNAL -32603   /* Internal JSON-RPC error */
+#define JSONRPC_ERROR_TIMEOUT -32000    /* Request timed out */
 
 #endif  // MJSON_ENABLE_RPC
 #ifdef __cplusplus
@@ -0,0 +1,335 @@
+// Copyright (c) 2018-2020 Cesanta Software Limited
+// All rights reserved
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// C++11 binding of typed functions to JSON-RPC methods. Params are decoded
+// by the method schema of mjson.h, results are printed straight into the
+// response. Calls allocate nothing, and the C++ standard library is not used.
+
+#ifndef MJSON_HPP
+#define MJSON_HPP
+
+#include <float.h>
+#include <limits.h>
+
+#include "mjson.h"
+
+#if !MJSON_ENABLE_RPC || !MJSON_ENABLE_RPC_SCHEMA
+#error "mjson.hpp requires MJSON_ENABLE_RPC and MJSON_ENABLE_RPC_SCHEMA"
+#endif
+
+// Expands to template arguments of jsonrpc::bind() for a function
+#define MJSON_RPC_FN(fn) decltype(&fn), &fn
+
+namespace jsonrpc {
+
+// JSON string, without quotes. Escape sequences are not decoded
+struct str {
+  const char *ptr;
+  int len;
+};
+
+// Handler result. Code 0 means success with a true result, anything else
+// is returned as a JSON-RPC error
+struct status {
+  int code;
+  const char *message;
+};
+
+// Value decoders. Params of other types are decoded by a user-provided
+// bool mjson_decode(const struct jsonrpc_arg &, T &), found by ADL
+template <typename T>
+struct arg_traits {
+  static const int type = 0;
+  static bool decode(const struct jsonrpc_arg &a, T &v) {
+    return mjson_decode(a, v);
+  }
+};
+
+// Integers accept whole numbers in [lo, hi). Both bounds are powers of 2,
+// exact as doubles, and are checked before the cast, which is undefined
+// for values out of range
+template <typename T, T MAX, bool SIGNED>
+struct int_traits {
+  static const int type = MJSON_TOK_NUMBER;
+  static bool decode(const struct jsonrpc_arg &a, T &v) {
+    double hi = 2.0 * static_cast<double>(MAX / 2 + 1), lo = SIGNED ? -hi : 0;
+    if (!(a.num >= lo && a.num < hi)) return false;  // Also rejects NaN
+    v = static_cast<T>(a.num);
+    return static_cast<double>(v) == a.num;  // Reject fractions
+  }
+};
+
+template <>
+struct arg_traits<short> : int_traits<short, SHRT_MAX, true> {};
+template <>
+struct arg_traits<unsigned short>
+    : int_traits<unsigned short, USHRT_MAX, false> {};
+template <>
+struct arg_traits<int> : int_traits<int, INT_MAX, true> {};
+template <>
+struct arg_traits<unsigned> : int_traits<unsigned, UINT_MAX, false> {};
+template <>
+struct arg_traits<long> : int_traits<long, LONG_MAX, true> {};
+template <>
+struct arg_traits<unsigned long>
+    : int_traits<unsigned long, ULONG_MAX, false> {};
+
+template <>
+struct arg_traits<double> {
+  static const int type = MJSON_TOK_NUMBER;
+  static bool decode(const struct jsonrpc_arg &a, double &v) {
+    v = a.num;
+    return true;
+  }
+};
+
+template <>
+struct arg_traits<float> {
+  static const int type = MJSON_TOK_NUMBER;
+  static bool decode(const struct jsonrpc_arg &a, float &v) {
+    double max = static_cast<double>(FLT_MAX);
+    if (a.num < -max || a.num > max) return false;
+    v = static_cast<float>(a.num);
+    return true;
+  }
+};
+
+template <>
+struct arg_traits<bool> {
+  static const int type = MJSON_TOK_TRUE;
+  static bool decode(const struct jsonrpc_arg &a, bool &v) {
+    v = a.num > 0;
+    return true;
+  }
+};
+
+template <>
+struct arg_traits<str> {
+  static const int type = MJSON_TOK_STRING;
+  static bool decode(const struct jsonrpc_arg &a, str &v) {
+    v.ptr = a.ptr + 1, v.len = a.len - 2;
+    return true;
+  }
+};
+
+// Value encoders. Results of other types are printed by a user-provided
+// int mjson_encode(mjson_print_fn_t, void *, const T &), found by ADL
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, int v) {
+  return mjson_printf(fn, fd, "%d", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, unsigned v) {
+  return mjson_printf(fn, fd, "%u", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, long v) {
+  return mjson_printf(fn, fd, "%ld", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, unsigned long v) {
+  return mjson_printf(fn, fd, "%lu", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, double v) {
+  return mjson_printf(fn, fd, "%g", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, bool v) {
+  return mjson_printf(fn, fd, "%B", v ? 1 : 0);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, const char *v) {
+  return mjson_printf(fn, fd, "%Q", v);
+}
+inline int mjson_encode(mjson_print_fn_t fn, void *fd, const str &v) {
+  return mjson_printf(fn, fd, "\"%.*s\"", v.len, v.ptr);
+}
+
+namespace detail {
+
+template <typename T>
+struct bare {
+  typedef T type;
+};
+template <typename T>
+struct bare<const T> : bare<T> {};
+template <typename T>
+struct bare<T &> : bare<T> {};
+
+template <int... I>
+struct indices {};
+template <int N, int... I>
+struct make_indices : make_indices<N - 1, N - 1, I...> {};
+template <int... I>
+struct make_indices<0, I...> {
+  typedef indices<I...> type;
+};
+
+// Decoded params, one base class per param
+template <int I, typename... T>
+struct store {
+  int decode(const struct jsonrpc_arg *) {
+    return -1;
+  }
+};
+
+template <int I, typename T, typename... Ts>
+struct store<I, T, Ts...> : store<I + 1, Ts...> {
+  T value;
+  store() : value() {}
+  // Return -1 on success, or the index of the param that failed
+  int decode(const struct jsonrpc_arg *a) {
+    if (a[I].ptr != NULL && !arg_traits<T>::decode(a[I], value)) return I;
+    return store<I + 1, Ts...>::decode(a);
+  }
+};
+
+template <int I, typename T, typename... Ts>
+T &get(store<I, T, Ts...> &s) {
+  return s.value;
+}
+
+template <typename... T>
+struct type_list {
+  static void fill(struct jsonrpc_param *) {}
+};
+
+template <typename T, typename... Ts>
+struct type_list<T, Ts...> {
+  static void fill(struct jsonrpc_param *p) {
+    p->type = arg_traits<T>::type, p->required = 1;
+    type_list<Ts...>::fill(p + 1);
+  }
+};
+
+template <typename... T>
+struct first_type {
+  static const int type = -1;
+};
+
+template <typename T, typename... Ts>
+struct first_type<T, Ts...> {
+  static const int type = arg_traits<T>::type;
+};
+
+template <typename T>
+int print_value(mjson_print_fn_t fn, void *fd, va_list *ap) {
+  const T *v = va_arg(*ap, const T *);
+  return mjson_encode(fn, fd, *v);
+}
+
+template <typename T>
+void respond(struct jsonrpc_request *r, const T &v) {
+  mjson_vprint_fn_t fn = print_value<T>;
+  jsonrpc_return_success(r, "%M", fn, &v);
+}
+
+inline void respond(struct jsonrpc_request *r, const status &s) {
+  if (s.code == 0) {
+    jsonrpc_return_success(r, "true");
+  } else {
+    jsonrpc_return_error(r, s.code, s.message, NULL);
+  }
+}
+
+template <typename F, F f>
+struct binder;
+
+template <typename R, typename... A, R (*f)(A...)>
+struct binder<R (*)(A...), f> {
+  enum { N = sizeof...(A) };
+  typedef store<0, typename bare<A>::type...> args_t;
+  typedef type_list<typename bare<A>::type...> types_t;
+
+  // A single param of a user type gets the whole params object
+  enum { WHOLE = N == 1 && first_type<typename bare<A>::type...>::type == 0 };
+
+  template <int... I>
+  static void invoke(struct jsonrpc_request *r, args_t &args, indices<I...>,
+                     void *) {
+    f(get<I>(args)...);
+    jsonrpc_return_success(r, "null");
+  }
+
+  template <int... I, typename T>
+  static void invoke(struct jsonrpc_request *r, args_t &args, indices<I...>,
+                     T *) {
+    respond(r, f(get<I>(args)...));
+  }
+
+  static void handler(struct jsonrpc_request *r) {
+    args_t args;
+    struct jsonrpc_arg whole_params;
+    const struct jsonrpc_param *p = r->schema;
+    const struct jsonrpc_arg *a = r->args;
+    int i;
+    if (WHOLE) {
+      whole_params.ptr = r->params, whole_params.len = r->params_len;
+      whole_params.type = MJSON_TOK_OBJECT, whole_params.num = 0;
+      a = &whole_params;
+      if (r->params_len == 0 || r->params[0] != '{') {
+        jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, "invalid params",
+                             NULL);
+        return;
+      }
+    }
+    if ((i = args.decode(a)) >= 0) {
+      if (WHOLE) {
+        jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, "invalid params",
+                             NULL);
+      } else if (p[i].name != NULL) {
+        jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, "wrong param type",
+                             "{%Q:%Q}", "param", p[i].name);
+      } else {
+        jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, "wrong param type",
+                             "{%Q:%d}", "param", i);
+      }
+      return;
+    }
+    invoke(r, args, typename make_indices<N>::type(), (R *) NULL);
+  }
+
+  template <typename... Names>
+  static int attach(struct jsonrpc_ctx *ctx, const char *name,
+                    Names... names) {
+    const char *list[] = {names..., NULL};
+    struct jsonrpc_param p[N + 1];  // Copied by jsonrpc_ctx_register_schema()
+    int i;
+    static_assert(sizeof...(Names) == 0 || sizeof...(Names) == N,
+                  "param names must be given for all params, or for none");
+    static_assert(N <= MJSON_RPC_MAX_PARAMS, "too many params");
+    memset(p, 0, sizeof(*p) * (size_t) (N + 1));
+    types_t::fill(p);
+    if (WHOLE) return jsonrpc_ctx_register(ctx, name, handler);
+    for (i = 0; i < N && sizeof...(Names) > 0; i++) p[i].name = list[i];
+    return jsonrpc_ctx_register_schema(ctx, name, handler, p, N);
+  }
+};
+
+}  // namespace detail
+
+// Export function f as a JSON-RPC method. Params are taken from the params
+// array by position, or from the params object by the given names. A
+// function with a single param of a user type gets the whole params object.
+// Void functions return null, functions returning jsonrpc::status return
+// true or an error.
+template <typename F, F f, typename... Names>
+int bind(struct jsonrpc_ctx *ctx, const char *name, Names... names) {
+  return detail::binder<F, f>::attach(ctx, name, names...);
+}
+
+}  // namespace jsonrpc
+
+#endif  // MJSON_HPP
@@ -6,6 +6,9 @@
 #include <stdio.h>  // For printf
 
 #include "mjson.h"
+#if defined(__cplusplus) && MJSON_ENABLE_RPC_SCHEMA
+#include "mjson.hpp"
+#endif
 
 static int s_num_tests = 0;
 static int s_num_errors = 0;
@@ -297,7 +300,7 @@ static void test_get_string(void) {
     struct {
       char buf1[3], buf2[3];
     } foo;
-    const char *s = "{\"a\":\"0123456789\"}";
+    const char *s = "{\"a\":\"01234567890123456789\"}";
     memset(&foo, 0, sizeof(foo));
     ASSERT(mjson_get_string(s, (int) strlen(s), "$.a", foo.buf1,
                             sizeof(foo.buf1)) == -1);
@@ -419,6 +422,12 @@ static int f1(mjson_print_fn_t fn, void *fndata, va_list *ap) {
   return mjson_printf(fn, fndata, "[%d]", value);
 }
 
+static int count_cb(const char *buf, int len, void *fn_data) {
+  (*(int *) fn_data)++;
+  (void) buf;
+  return len;
+}
+
 static void test_printf(void) {
   const char *str;
   char tmp[100];
@@ -580,6 +589,67 @@ static void test_printf(void) {
   }
 }
 
+struct mpos {
+  double lat, lon;
+};
+
+struct mdev {
+  int on;
+  int brightness;
+  long uptime;
+  char name[8];
+  const char *fw;
+  struct mpos pos;
+};
+
+static void test_marshal(void) {
+  static const struct mjson_field pos_desc[] = {
+      MJSON_FIELD("lat", MJSON_TYPE_DOUBLE, struct mpos, lat),
+      MJSON_FIELD("lon", MJSON_TYPE_DOUBLE, struct mpos, lon),
+  };
+  static const struct mjson_field dev_desc[] = {
+      MJSON_FIELD("on", MJSON_TYPE_BOOL, struct mdev, on),
+      MJSON_FIELD("brightness", MJSON_TYPE_INT, struct mdev, brightness),
+      MJSON_FIELD("uptime", MJSON_TYPE_LONG, struct mdev, uptime),
+      MJSON_FIELD("name", MJSON_TYPE_STRING, struct mdev, name),
+      MJSON_FIELD("fw", MJSON_TYPE_STRPTR, struct mdev, fw),
+      MJSON_FIELD_OBJ("pos", struct mdev, pos, pos_desc),
+  };
+  int n = (int) (sizeof(dev_desc) / sizeof(dev_desc[0]));
+  struct mdev dev = {1, -7, 123456789L, "lamp\"1", NULL, {1.5, -0.25}};
+  char tmp[200];
+
+  {
+    struct mjson_fixedbuf fb = {tmp, sizeof(tmp), 0};
+    const char *s =
+        "{\"on\":true,\"brightness\":-7,\"uptime\":123456789,"
+        "\"name\":\"lamp\\\"1\",\"fw\":null,"
+        "\"pos\":{\"lat\":1.5,\"lon\":-0.25}}";
+    ASSERT(mjson_marshal(mjson_print_fixed_buf, &fb, dev_desc, n, &dev) ==
+           (int) strlen(s));
+    ASSERT(strcmp(tmp, s) == 0);
+  }
+
+  {
+    // Name fills the whole array, no NUL terminator
+    struct mjson_fixedbuf fb = {tmp, sizeof(tmp), 0};
+    memcpy(dev.name, "12345678", sizeof(dev.name));
+    dev.on = 0, dev.fw = "1.2";
+    ASSERT(mjson_marshal(mjson_print_fixed_buf, &fb, dev_desc, 5, &dev) > 0);
+    ASSERT(strcmp(tmp,
+                  "{\"on\":false,\"brightness\":-7,\"uptime\":123456789,"
+                  "\"name\":\"12345678\",\"fw\":\"1.2\"}") == 0);
+  }
+
+  {
+    // Small objects are printed with a single printer call
+    int count = 0;
+    ASSERT(mjson_marshal(count_cb, &count, pos_desc, 2, &dev.pos) == 23);
+    ASSERT(count == 1);
+    ASSERT(mjson_marshal(count_cb, &count, pos_desc, 0, &dev.pos) == 2);
+  }
+}
+
 static void foo(struct jsonrpc_request *r) {
   double v = 0;
   mjson_get_number(r->params, r->params_len, "$[1]", &v);
@@ -608,12 +678,18 @@ static void test_rpc(void) {
   char buf[200];
   struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
 
-  // Init context
+  // Init context. Re-initialising drops methods of the previous init
+  jsonrpc_init(response_cb, &fb);
+  jsonrpc_export("foo", foo);
   jsonrpc_init(response_cb, &fb);
 
   // Call RPC.List
   req = "{\"id\": 1, \"method\": \"rpc.list\"}";
+#if MJSON_ENABLE_RPC_STATS
+  res = "{\"id\":1,\"result\":[\"rpc.stats\",\"rpc.list\"]}\n";
+#else
   res = "{\"id\":1,\"result\":[\"rpc.list\"]}\n";
+#endif
   fb.len = 0;
   jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
   ASSERT(strcmp(buf, res) == 0);
@@ -688,6 +764,55 @@ static void test_rpc(void) {
   fb.len = 0;
   jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
   ASSERT(strcmp(buf, res) == 0);
+
+  // Envelope members in any order, nested members are not envelope members
+  req =
+      " { \"params\" : {\"method\":\"x\",\"a\":[\"]}\\\"\",{}]} ,\"id\":\"q\" ,"
+      "\"method\":\"Bar.Q\", \"method\":\"foo1\"}";
+  res = "{\"id\":\"q\",\"result\":{\"method\":\"x\",\"a\":[\"]}\\\"\",{}]}}\n";
+  fb.len = 0;
+  jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
+  ASSERT(strcmp(buf, res) == 0);
+
+  // Method must be a string, frame must be a complete object
+  req = "{\"id\":1,\"method\":[\"Bar.Baz\"]}";
+  fb.len = 0;
+  jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
+  ASSERT(strncmp(buf, "{\"error\":{\"code\":-32700,", 24) == 0);
+  req = "{\"id\":1,\"method\":\"Bar.Baz\",\"params\":[1,{]";
+  fb.len = 0;
+  jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
+  ASSERT(strncmp(buf, "{\"error\":{\"code\":-32700,", 24) == 0);
+  req = "{\"id\":1,\"method\":\"Bar.Baz\" \"params\":1}";
+  fb.len = 0;
+  jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
+  ASSERT(strncmp(buf, "{\"error\":{\"code\":-32700,", 24) == 0);
+  req = "{\"id\":1,\"method\":\"Bar.Baz\",\"params\":}";
+  fb.len = 0;
+  jsonrpc_process(req, (int) strlen(req), mjson_print_fixed_buf, &fb, NULL);
+  ASSERT(strncmp(buf, "{\"error\":{\"code\":-32700,", 24) == 0);
+  {
+    // Malformed values anywhere in the frame
+    static const char *bad[] = {
+        "{\"id\":1,\"method\":\"foo\",\"params\":[1}}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":{\"a\"]}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":[1 2]}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":{1}}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":tru}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":[nul]}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":1x}",
+        "{\"id\":1,\"method\":\"foo\",\"params\":-}",
+        "{\"id\":xyz,\"method\":\"foo\"}",
+        "{\"id\":1,\"method\":\"foo\",\"x\":[}",
+    };
+    size_t i;
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+      fb.len = 0;
+      jsonrpc_process(bad[i], (int) strlen(bad[i]), mjson_print_fixed_buf, &fb,
+                      NULL);
+      ASSERT(strncmp(buf, "{\"error\":{\"code\":-32700,", 24) == 0);
+    }
+  }
 }
 
 static void test_merge(void) {
@@ -724,6 +849,21 @@ static void test_merge(void) {
       "{\"a\":1}",  // Delete non-existing key
       "{\"b\":null}",
       "{\"a\":1}",
+      "{\"a\":1}",  // Object patches a scalar: nulls are removed
+      "{\"a\":{\"b\":null,\"c\":2}}",
+      "{\"a\":{\"c\":2}}",
+      "{\"a\":1}",  // Added object: nulls are removed
+      "{\"b\":{\"c\":{\"d\":null}}}",
+      "{\"a\":1,\"b\":{\"c\":{}}}",
+      "{\"a\":1}",  // Patch is not an object: replaces original
+      "[1,2]",
+      "[1,2]",
+      "{\"a\":1}",  // Duplicate keys in the patch: first one wins
+      "{\"a\":2,\"a\":3}",
+      "{\"a\":2}",
+      "{ \"a\" : [1, 2] , \"b\" : true }",  // Whitespace
+      "{ \"b\" : false }",
+      "{\"a\":[1, 2],\"b\":false}",
   };
   for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i += 3) {
     struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
@@ -733,6 +873,201 @@ static void test_merge(void) {
     ASSERT(n == (int) strlen(tests[i + 2]));
     ASSERT(strncmp(fb.ptr, tests[i + 2], (size_t) fb.len) == 0);
   }
+
+  {
+    // Objects with many keys use heap allocated key index
+    char *a = NULL, *b = NULL, *c = NULL, *res = NULL;
+    int j, n;
+    mjson_printf(mjson_print_dynamic_buf, &a, "{");
+    mjson_printf(mjson_print_dynamic_buf, &b, "{");
+    mjson_printf(mjson_print_dynamic_buf, &c, "{");
+    for (j = 0; j < 100; j++) {
+      const char *comma = j == 0 ? "" : ",";
+      mjson_printf(mjson_print_dynamic_buf, &a, "%s\"k%d\":%d", comma, j, j);
+      if (j % 3 == 0) {
+        mjson_printf(mjson_print_dynamic_buf, &b, "%s\"k%d\":null", comma, j);
+      } else {
+        mjson_printf(mjson_print_dynamic_buf, &b, "%s\"k%d\":%d", comma,
+                     j + 100, j);
+      }
+      if (j % 3 != 0) {
+        mjson_printf(mjson_print_dynamic_buf, &c, "%s\"k%d\":%d",
+                     j == 1 ? "" : ",", j, j);
+      }
+    }
+    for (j = 0; j < 100; j++) {
+      if (j % 3 != 0) {
+        mjson_printf(mjson_print_dynamic_buf, &c, ",\"k%d\":%d", j + 100, j);
+      }
+    }
+    mjson_printf(mjson_print_dynamic_buf, &a, "}");
+    mjson_printf(mjson_print_dynamic_buf, &b, "}");
+    mjson_printf(mjson_print_dynamic_buf, &c, "}");
+    n = mjson_merge(a, (int) strlen(a), b, (int) strlen(b),
+                    mjson_print_dynamic_buf, &res);
+    ASSERT(n == (int) strlen(c));
+    ASSERT(strcmp(res, c) == 0);
+    free(a), free(b), free(c), free(res);
+  }
+}
+
+static void test_merge_many(void) {
+  char buf[512];
+  const char *base = "{\"a\":1,\"b\":{\"c\":2,\"d\":3},\"e\":null}";
+  {
+    // Later patches win, nested objects are merged recursively
+    const char *p[] = {"{\"a\":2,\"b\":{\"c\":null}}", "{\"b\":{\"x\":1}}",
+                       "{\"a\":3,\"f\":{\"g\":null,\"h\":1}}",
+                       "{\"b\":{\"d\":4},\"e\":5}"};
+    int pn[] = {0, 0, 0, 0}, i;
+    const char *res =
+        "{\"a\":3,\"b\":{\"d\":4,\"x\":1},\"e\":5,\"f\":{\"h\":1}}";
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    for (i = 0; i < 4; i++) pn[i] = (int) strlen(p[i]);
+    ASSERT(mjson_merge_many(base, (int) strlen(base), p, pn, 4,
+                            mjson_print_fixed_buf, &fb) == (int) strlen(res));
+    ASSERT(strcmp(buf, res) == 0);
+
+    // Same result as applying patches one by one
+    strcpy(buf, base);
+    for (i = 0; i < 4; i++) {
+      char *tmp = NULL;
+      mjson_merge(buf, (int) strlen(buf), p[i], pn[i], mjson_print_dynamic_buf,
+                  &tmp);
+      ASSERT(tmp != NULL);
+      strcpy(buf, tmp);
+      free(tmp);
+    }
+    ASSERT(strcmp(buf, res) == 0);
+  }
+
+  {
+    // Object replaced with a scalar and then patched again, key deleted
+    // and added again, and a non-object patch that replaces everything
+    const char *p[] = {"{\"b\":7,\"a\":null}",
+                       "{\"b\":{\"y\":null,\"z\":1}}", "{\"a\":[1]}"};
+    const char *p2[] = {"{\"a\":1}", "[1,2]", "{\"b\":2}", ""};
+    int pn[] = {0, 0, 0}, pn2[] = {0, 0, 0, 0}, i;
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    for (i = 0; i < 3; i++) pn[i] = (int) strlen(p[i]);
+    for (i = 0; i < 4; i++) pn2[i] = (int) strlen(p2[i]);
+    mjson_merge_many(base, (int) strlen(base), p, pn, 3, mjson_print_fixed_buf,
+                     &fb);
+    ASSERT(strcmp(buf, "{\"a\":[1],\"b\":{\"z\":1},\"e\":null}") == 0);
+    fb.len = 0;
+    mjson_merge_many(base, (int) strlen(base), p2, pn2, 4,
+                     mjson_print_fixed_buf, &fb);
+    ASSERT(strcmp(buf, "{\"b\":2}") == 0);
+    fb.len = 0;
+    mjson_merge_many(base, (int) strlen(base), p2, pn2, 2,
+                     mjson_print_fixed_buf, &fb);
+    ASSERT(strcmp(buf, "[1,2]") == 0);
+    fb.len = 0;
+    ASSERT(mjson_merge_many(base, (int) strlen(base), p2, pn2, 0,
+                            mjson_print_fixed_buf, &fb) == (int) strlen(base));
+    ASSERT(strcmp(buf, base) == 0);
+  }
+
+  {
+    // Many patches: scratch tables are allocated
+    const char *p[20];
+    int pn[20], i;
+    char keys[20][16];
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    for (i = 0; i < 20; i++) {
+      mjson_snprintf(keys[i], sizeof(keys[i]), "{\"b\":{\"k%d\":%d}}", i % 5,
+                     i);
+      p[i] = keys[i], pn[i] = (int) strlen(keys[i]);
+    }
+    mjson_merge_many(base, (int) strlen(base), p, pn, 20, mjson_print_fixed_buf,
+                     &fb);
+    ASSERT(strcmp(buf,
+                  "{\"a\":1,\"b\":{\"c\":2,\"d\":3,\"k0\":15,\"k1\":16,"
+                  "\"k2\":17,\"k3\":18,\"k4\":19},\"e\":null}") == 0);
+  }
+}
+
+static void test_diff(void) {
+  size_t i;
+  const char *tests[] = {
+      "{\"a\":1,\"b\":2}",  // No changes
+      "{\"a\":1,\"b\":2}",
+      "{}",
+      "{\"a\":1,\"b\":2}",  // Changed, added, deleted
+      "{\"a\":3,\"c\":[1]}",
+      "{\"a\":3,\"c\":[1],\"b\":null}",
+      "{\"a\":{\"b\":1,\"c\":{\"d\":2}},\"e\":1}",  // Nested change
+      "{\"a\":{\"b\":1,\"c\":{\"d\":3}},\"e\":1}",
+      "{\"a\":{\"c\":{\"d\":3}}}",
+      "{\"a\":{\"b\":1},\"e\":1}",  // Same values, different formatting
+      "{\"e\":1,  \"a\": { \"b\" : 1 }}",
+      "{}",
+      "{\"a\":{\"b\":1},\"c\":[1,2]}",  // Type change, array change
+      "{\"a\":[1],\"c\":[1,3]}",
+      "{\"a\":[1],\"c\":[1,3]}",
+      "{\"a\":1}",  // Not an object
+      "[1,2]",
+      "[1,2]",
+      "[1,2]",  // Target is not an object
+      "{\"a\":1}",
+      "{\"a\":1}",
+  };
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i += 3) {
+    char buf[512], *merged = NULL;
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    const char *a = tests[i], *b = tests[i + 1];
+    int n = mjson_diff(a, (int) strlen(a), b, (int) strlen(b),
+                       mjson_print_fixed_buf, &fb);
+    // printf("%s - %s = %.*s\n", a, b, fb.len, fb.ptr);
+    ASSERT(n == (int) strlen(tests[i + 2]));
+    ASSERT(strcmp(buf, tests[i + 2]) == 0);
+
+    // Applying the diff must produce a document equal to the new one
+    mjson_merge(a, (int) strlen(a), buf, n, mjson_print_dynamic_buf, &merged);
+    fb.len = 0;
+    ASSERT(merged != NULL);
+    ASSERT(mjson_diff(merged, (int) strlen(merged), b, (int) strlen(b),
+                      mjson_print_fixed_buf, &fb) > 0);
+    ASSERT(strcmp(buf, "{}") == 0 || strcmp(buf, b) == 0);
+    free(merged);
+  }
+  {
+    // Large objects, only one key is changed
+    char *a = NULL, *b = NULL, buf[100];
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    int j;
+    for (j = 0; j < 50; j++) {
+      mjson_printf(mjson_print_dynamic_buf, &a, "%s\"k%d\":%d", j ? "," : "{",
+                   j, j);
+      mjson_printf(mjson_print_dynamic_buf, &b, "%s\"k%d\":%d", j ? "," : "{",
+                   j, j == 42 ? 0 : j);
+    }
+    mjson_printf(mjson_print_dynamic_buf, &a, "}");
+    mjson_printf(mjson_print_dynamic_buf, &b, "}");
+    ASSERT(mjson_diff(a, (int) strlen(a), b, (int) strlen(b),
+                      mjson_print_fixed_buf, &fb) == 9);
+    ASSERT(strcmp(buf, "{\"k42\":0}") == 0);
+    free(a), free(b);
+  }
+  ASSERT(mjson_diff("{}", 2, "[", 1, mjson_print_null, NULL) == -1);
+  ASSERT(mjson_diff("{", 1, "{}", 2, mjson_print_null, NULL) == -1);
+  {
+    // Truncated or invalid documents print nothing
+    const char *a = "{\"x\":1,\"y\":2";
+    const char *b =
+        "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,\"h\":8}";
+    char buf[100];
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    ASSERT(mjson_diff(a, (int) strlen(a), b, (int) strlen(b),
+                      mjson_print_fixed_buf, &fb) == -1);
+    ASSERT(mjson_diff(b, (int) strlen(b), a, (int) strlen(a),
+                      mjson_print_fixed_buf, &fb) == -1);
+    ASSERT(mjson_diff("[1}", 3, b, (int) strlen(b), mjson_print_fixed_buf,
+                      &fb) == -1);
+    ASSERT(mjson_diff(b, (int) strlen(b), "[1}", 3, mjson_print_fixed_buf,
+                      &fb) == -1);
+    ASSERT(fb.len == 0);
+  }
 }
 
 static void test_pretty(void) {
@@ -778,7 +1113,110 @@ static void test_pretty(void) {
     ASSERT(fb.len == (int) strlen(tests[i + 2]));
     ASSERT(strncmp(fb.ptr, tests[i + 2], (size_t) fb.len) == 0);
     // printf("--> %s\n", buf);
+
+    // Streaming mode, feed one byte at a time
+    {
+      struct mjson_pretty_stream ps;
+      size_t j;
+      fb.len = 0;
+      mjson_pretty_init(&ps, "  ", mjson_print_fixed_buf, &fb);
+      for (j = 0; j < strlen(s); j++) {
+        ASSERT(mjson_pretty_feed(&ps, s + j, 1) >= 0);
+      }
+      ASSERT(ps.len == (int) strlen(tests[i + 1]));
+      ASSERT(strcmp(buf, tests[i + 1]) == 0);
+    }
+  }
+
+  {
+    // Strings with escapes and whitespace, streamed in chunks
+    const char *s = "[ \"a, b\" , {\"c\\\"}\" : \"\\\\\"}, -1.5e3 ,[ ]]";
+    const char *res =
+        "[\n\t\"a, b\",\n\t{\n\t\t\"c\\\"}\": \"\\\\\"\n\t},"
+        "\n\t-1.5e3,\n\t[]\n]";
+    char buf[100], buf2[100];
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    struct mjson_fixedbuf fb2 = {buf2, sizeof(buf2), 0};
+    struct mjson_pretty_stream ps;
+    int n = (int) strlen(s), count = 0;
+    ASSERT(mjson_pretty(s, n, "\t", mjson_print_fixed_buf, &fb) ==
+           (int) strlen(res));
+    ASSERT(strcmp(buf, res) == 0);
+    mjson_pretty_init(&ps, "\t", mjson_print_fixed_buf, &fb2);
+    ASSERT(mjson_pretty_feed(&ps, s, 7) > 0);
+    ASSERT(mjson_pretty_feed(&ps, s + 7, 9) > 0);
+    ASSERT(mjson_pretty_feed(&ps, s + 16, n - 16) > 0);
+    ASSERT(ps.level == 0 && ps.len == (int) strlen(res));
+    ASSERT(strcmp(buf2, res) == 0);
+
+    // Output is coalesced into a single printer call
+    ASSERT(mjson_pretty(s, n, "\t", count_cb, &count) == (int) strlen(res));
+    ASSERT(count == 1);
+
+    mjson_pretty_init(&ps, "\t", mjson_print_null, NULL);
+    ASSERT(mjson_pretty_feed(&ps, "[]]", 3) == -1);
+  }
+
+  {
+    // Long pad, nested deeper than the precomputed indentation
+    const char *pad = "0123456789";
+    char *s = NULL, *res = NULL, *out = NULL, *out2 = NULL;
+    struct mjson_pretty_stream ps;
+    int k, j, depth = 12;
+    for (k = 0; k < depth; k++) {
+      mjson_printf(mjson_print_dynamic_buf, &s, "[");
+      mjson_printf(mjson_print_dynamic_buf, &res, "[");
+    }
+    mjson_printf(mjson_print_dynamic_buf, &s, "1");
+    for (k = depth; k >= 0; k--) {
+      if (k < depth) mjson_printf(mjson_print_dynamic_buf, &s, "]");
+      mjson_printf(mjson_print_dynamic_buf, &res, "\n");
+      for (j = 0; j < k; j++) {
+        mjson_printf(mjson_print_dynamic_buf, &res, "%s", pad);
+      }
+      mjson_printf(mjson_print_dynamic_buf, &res, k == depth ? "1" : "]");
+    }
+    ASSERT(mjson_pretty(s, (int) strlen(s), pad, mjson_print_dynamic_buf,
+                        &out) == (int) strlen(res));
+    ASSERT(out != NULL && strcmp(out, res) == 0);
+    mjson_pretty_init(&ps, pad, mjson_print_dynamic_buf, &out2);
+    ASSERT(mjson_pretty_feed(&ps, s, (int) strlen(s)) > 0);
+    ASSERT(out2 != NULL && strcmp(out2, res) == 0);
+    free(s), free(res), free(out), free(out2);
+  }
+}
+
+static void test_minify(void) {
+  size_t i;
+  const char *tests[] = {
+      "",
+      "",
+      " {  } ",
+      "{}",
+      "{\n  \"a\": 1,\n  \"b\": [ 1, 2 ]\n}\n",
+      "{\"a\":1,\"b\":[1,2]}",
+      "[ \"a b\" , \"c\\\" d\",\t\"\\\\\" ,\r\nnull ]",
+      "[\"a b\",\"c\\\" d\",\"\\\\\",null]",
+      "{\"a\":{\"b\":[true,false]}}",
+      "{\"a\":{\"b\":[true,false]}}",
+  };
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i += 2) {
+    char buf[100], copy[100];
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    int n = (int) strlen(tests[i]), count = 0;
+    buf[0] = '\0';
+    ASSERT(mjson_minify(tests[i], n, mjson_print_fixed_buf, &fb) ==
+           (int) strlen(tests[i + 1]));
+    ASSERT(strcmp(buf, tests[i + 1]) == 0);
+    strcpy(copy, tests[i]);
+    ASSERT(mjson_minify_inplace(copy, n) == (int) strlen(tests[i + 1]));
+    ASSERT(strcmp(copy, tests[i + 1]) == 0);
+    // Already terse input is printed with a single call
+    mjson_minify(tests[i + 1], (int) strlen(tests[i + 1]), count_cb, &count);
+    ASSERT(count == (i == 0 ? 0 : 1));
   }
+  ASSERT(mjson_minify("[\"a", 3, mjson_print_null, NULL) == -1);
+  ASSERT(mjson_minify("[\"a\\\"]", 5, mjson_print_null, NULL) == -1);
 }
 
 static void test_next(void) {
@@ -830,6 +1268,166 @@ static void test_next(void) {
   }
 }
 
+#if MJSON_ENABLE_STATS
+static int stats_cb(int ev, const char *s, int off, int len, void *ud) {
+  (void) ev, (void) s, (void) off, (void) len, (void) ud;
+  return 0;
+}
+
+static void test_stats(void) {
+  const char *s = "{\"a\":[1, 2]}";
+  int n = (int) strlen(s);
+  struct mjson_stats st;
+  char buf[20], *p = NULL;
+  struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+
+  mjson_stats_reset();
+  mjson_stats_get(&st);
+  ASSERT(st.tokens == 0 && st.bytes == 0 && st.print_calls == 0);
+
+  // Tokens are { "a" : [ 1 , 2 ] }, whitespace is not counted
+  ASSERT(mjson(s, n, NULL, NULL) == n);
+  mjson_stats_get(&st);
+  ASSERT(st.tokens == 9 && st.bytes == 11 && st.callbacks == 0);
+  ASSERT(mjson(s, n, stats_cb, NULL) == n);
+  mjson_stats_get(&st);
+  ASSERT(st.tokens == 18 && st.bytes == 22 && st.callbacks == 9);
+
+  mjson_stats_reset();
+  ASSERT(mjson_find(s, n, "$.a[0]", NULL, NULL) == MJSON_TOK_NUMBER);
+  ASSERT(mjson_find(s, n, "$.a", NULL, NULL) == MJSON_TOK_ARRAY);
+  ASSERT(mjson_find(s, n, "$", NULL, NULL) == MJSON_TOK_OBJECT);
+  ASSERT(mjson_find(s, n, "$.b", NULL, NULL) == MJSON_TOK_INVALID);
+  ASSERT(mjson_find(s, n, "a", NULL, NULL) == MJSON_TOK_INVALID);
+  ASSERT(mjson_find("{", 1, "$", NULL, NULL) == MJSON_TOK_INVALID);
+  mjson_stats_get(&st);
+  ASSERT(st.find_hits == 3 && st.find_misses == 3);
+  ASSERT(st.find_early_exits == 2);
+  ASSERT(st.tokens == 5 + 8 + 9 + 9 + 1);
+
+  // Nested printing through %M is counted once
+  mjson_stats_reset();
+  ASSERT(mjson_printf(mjson_print_fixed_buf, &fb, "{%Q:%M}", "a", f1, 1) == 9);
+  mjson_stats_get(&st);
+  ASSERT(st.print_bytes == 9 && st.print_calls > 0);
+  ASSERT(st.dynbuf_reallocs == 0);
+  ASSERT(mjson_printf(mjson_print_dynamic_buf, &p, "%s%s", "x", "y") == 2);
+  mjson_stats_get(&st);
+  ASSERT(st.print_bytes == 11 && st.dynbuf_reallocs == 2);
+  free(p);
+}
+#endif
+
+#if MJSON_ENABLE_ARENA
+struct printer_check {
+  mjson_print_fn_t fn;
+  void *fn_data;
+};
+
+// %M callback that checks it got the printer of the caller
+static int check_printer(mjson_print_fn_t fn, void *fnd, va_list *ap) {
+  const struct printer_check *pc = va_arg(*ap, const struct printer_check *);
+  ASSERT(fn == pc->fn && fnd == pc->fn_data);
+  return mjson_printf(fn, fnd, "%d", fn == pc->fn);
+}
+
+static void printer_of(struct jsonrpc_request *r) {
+  struct printer_check pc = {r->fn, r->fn_data};
+  jsonrpc_return_success(r, "%M", check_printer, &pc);
+}
+
+static void test_arena(void) {
+  char mem[64], *p, *q;
+  const char *s = "{\"a\":1,\"b\":2,\"c\":3,\"d\":4,\"e\":5}";
+  const char *s2 = "{\"f\":6,\"g\":7,\"h\":8,\"i\":9,\"a\":null}";
+  const char *batch = "[{\"id\":1,\"method\":\"echo\",\"params\":[1]},"
+                      "{\"id\":2,\"method\":\"echo\",\"params\":[2]}]";
+  struct mjson_arena a;
+  struct mjson_arenabuf ab;
+  struct jsonrpc_ctx ctx;
+  struct printer_check pc;
+  const char *req;
+  size_t size;
+  int i;
+
+  // Fixed memory only: allocations are aligned, and fail when it is full
+  mjson_arena_init(&a, mem, sizeof(mem), 0);
+  ASSERT((p = (char *) mjson_arena_alloc(&a, 3)) != NULL);
+  ASSERT((q = (char *) mjson_arena_alloc(&a, 8)) == p + 8);
+  ASSERT(mjson_arena_alloc(&a, 64) == NULL);
+  ASSERT(mjson_arena_realloc(&a, q, 8, 40) == q && a.len == 48);
+  ASSERT(mjson_arena_realloc(&a, p, 3, 17) == NULL);
+  ASSERT(mjson_arena_alloc(&a, 16) == q + 40 && a.len == 64);
+  mjson_arena_reset(&a);
+  ASSERT(a.len == 0 && a.buf == mem && a.chunks == NULL);
+
+  // Growing over the fixed memory allocates chunks. Reset coalesces them
+  // into one, and the next cycle of the same size does not allocate
+  mjson_arena_init(&a, mem, sizeof(mem), 32);
+  for (i = 0; i < 20; i++) ASSERT(mjson_arena_alloc(&a, 24) != NULL);
+  ASSERT(a.chunks != NULL && a.used > 0);
+  mjson_arena_reset(&a);
+  ASSERT(a.chunks != NULL && a.buf != mem && a.size >= 20 * 24);
+  ASSERT(a.len == 0 && a.used == 0);
+  p = a.buf, size = a.size;
+  for (i = 0; i < 20; i++) ASSERT(mjson_arena_alloc(&a, 24) != NULL);
+  ASSERT(a.used == 0 && a.buf == p);
+  mjson_arena_reset(&a);
+  ASSERT(a.buf == p && a.size == size && a.len == 0);
+  mjson_arena_free(&a);
+  ASSERT(a.chunks == NULL && a.buf == mem && a.len == 0);
+
+  // Printing
+  mjson_arena_init(&a, NULL, 0, 16);
+  p = mjson_arena_printf(&a, "{%Q:%d,%Q:[%B]}", "a", 123, "list", 1);
+  ASSERT(p != NULL && strcmp(p, "{\"a\":123,\"list\":[true]}") == 0);
+  q = mjson_arena_printf(&a, "%.*Q", 3, "xyzzy");
+  ASSERT(q != NULL && strcmp(q, "\"xyz\"") == 0);
+  ASSERT(strcmp(p, "{\"a\":123,\"list\":[true]}") == 0);
+  mjson_arena_reset(&a);
+
+  // Merge scratch tables come from the arena too
+  memset(&ab, 0, sizeof(ab));
+  ab.arena = &a;
+  ASSERT(mjson_merge(s, (int) strlen(s), s2, (int) strlen(s2),
+                     mjson_print_arena, &ab) > 0);
+  ASSERT(strcmp(ab.ptr,
+                "{\"b\":2,\"c\":3,\"d\":4,\"e\":5,\"f\":6,\"g\":7,"
+                "\"h\":8,\"i\":9}") == 0);
+  ASSERT(a.used + a.len > (size_t) ab.size + 10 * sizeof(int));
+  mjson_arena_reset(&a);
+
+  // RPC responses, batched or not
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+  memset(&ab, 0, sizeof(ab));
+  ab.arena = &a;
+  jsonrpc_ctx_process(&ctx, batch, (int) strlen(batch), mjson_print_arena, &ab,
+                      NULL);
+  ASSERT(ab.ptr != NULL &&
+         strcmp(ab.ptr, "[{\"id\":1,\"result\":[1]},"
+                        "{\"id\":2,\"result\":[2]}]\n") == 0);
+  ab.len = 0;
+  jsonrpc_ctx_process(&ctx, batch + 1, 37, mjson_print_arena, &ab, NULL);
+  ASSERT(strcmp(ab.ptr, "{\"id\":1,\"result\":[1]}\n") == 0);
+
+  // %M callbacks see the real printer, also with MJSON_ENABLE_STATS
+  pc.fn = mjson_print_arena, pc.fn_data = &ab;
+  ab.len = 0;
+  i = mjson_printf(mjson_print_arena, &ab, "[%M]", check_printer, &pc);
+  ASSERT(i == 3 && strcmp(ab.ptr, "[1]") == 0);
+  jsonrpc_ctx_export(&ctx, "printer", printer_of);
+  ab.len = 0;
+  req = "[{\"id\":1,\"method\":\"printer\"},{\"id\":2,\"method\":\"printer\"}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_arena, &ab,
+                      NULL);
+  ASSERT(strcmp(ab.ptr,
+                "[{\"id\":1,\"result\":1},{\"id\":2,\"result\":1}]\n") == 0);
+  jsonrpc_ctx_free(&ctx);
+  mjson_arena_free(&a);
+}
+#endif
+
 static void test_globmatch(void) {
   ASSERT(mjson_globmatch("", 0, "", 0) == 1);
   ASSERT(mjson_globmatch("*", 1, "a", 1) == 1);
@@ -847,8 +1445,77 @@ static void test_globmatch(void) {
   ASSERT(mjson_globmatch("/x/*", 4, "/x/2/foo", 8) == 0);
   ASSERT(mjson_globmatch("/x/*/*", 6, "/x/2/foo", 8) == 1);
   ASSERT(mjson_globmatch("#", 1, "///", 3) == 1);
+  ASSERT(mjson_globmatch("*/", 2, "a/", 2) == 1);
+  ASSERT(mjson_globmatch("*/", 2, "/a/", 3) == 0);
+  ASSERT(mjson_globmatch("/*/", 3, "//a/", 4) == 0);
+}
+
+#if MJSON_ENABLE_GLOBSET
+static void globset_cb(int id, void *fn_data) {
+  *(unsigned *) fn_data |= 1U << id;
 }
 
+static void test_globset(void) {
+  static const char *patterns[] = {
+      "a/b", "a/+", "a/*", "a/*/c", "*", "#", "a/#", "a/b#", "a?", "a/b", "",
+      "/x/*/*", "a/", "/", "*/*/*", "a/*x", "foo*/b", "?/?", "a#c", "a/b/c",
+      "*/b/", "f*o/*", "#/c", "a*b*c",
+  };
+  static const char *topics[] = {
+      "", "a", "a/", "a/b", "a/b/c", "a/bc", "ab", "a/x", "a/cx", "/x/2/foo",
+      "/", "foo/b", "fooo/b", "x/b/", "a/b/c/d", "fo/o", "a//c", "aXbYc",
+      "a/xb/c", "b/c", "a/+",
+  };
+  int np = (int) (sizeof(patterns) / sizeof(patterns[0]));
+  int nt = (int) (sizeof(topics) / sizeof(topics[0]));
+  struct mjson_globset gs;
+  int i, j;
+
+  mjson_globset_init(&gs);
+  ASSERT(mjson_globset_match(&gs, "a", 1, NULL, NULL) == 0);
+  for (i = 0; i < np; i++) {
+    ASSERT(mjson_globset_add(&gs, patterns[i], (int) strlen(patterns[i]), i) ==
+           0);
+  }
+
+  // Every topic matches exactly the patterns that mjson_globmatch() matches
+  for (i = 0; i < nt; i++) {
+    unsigned expected = 0, got = 0;
+    int n = 0, tlen = (int) strlen(topics[i]);
+    for (j = 0; j < np; j++) {
+      if (mjson_globmatch(patterns[j], (int) strlen(patterns[j]), topics[i],
+                          tlen)) {
+        expected |= 1U << j, n++;
+      }
+    }
+    ASSERT(mjson_globset_match(&gs, topics[i], tlen, globset_cb, &got) == n);
+    ASSERT(got == expected);
+  }
+
+  // Duplicate patterns are reported once per id
+  ASSERT(mjson_globset_match(&gs, "a/b", 3, NULL, NULL) == 7);
+  mjson_globset_free(&gs);
+  ASSERT(gs.nodes == NULL && gs.num_nodes == 0);
+
+  // Many literal patterns share the edge table
+  for (i = 0; i < 1000; i++) {
+    char buf[40];
+    int n = snprintf(buf, sizeof(buf), "dev/%d/temp", i);
+    ASSERT(mjson_globset_add(&gs, buf, n, i) == 0);
+  }
+  ASSERT(mjson_globset_add(&gs, "dev/+/temp", 10, 1000) == 0);
+  ASSERT(mjson_globset_add(&gs, "dev/*/temp", 10, 1001) == 0);
+  {
+    unsigned got = 0;
+    ASSERT(mjson_globset_match(&gs, "dev/517/temp", 12, NULL, NULL) == 2);
+    ASSERT(mjson_globset_match(&gs, "dev/+/temp", 10, NULL, NULL) == 2);
+    ASSERT(mjson_globset_match(&gs, "dev/517/hum", 11, globset_cb, &got) == 0);
+    ASSERT(got == 0);
+  }
+  mjson_globset_free(&gs);
+}
+#endif
+
 static void test_multiple_contexts(void) {
   struct jsonrpc_ctx c1, c2;
   const char *req = "{\"id\": 1, \"method\": \"rpc.list\"}";
@@ -870,12 +1537,1214 @@ static void test_multiple_contexts(void) {
   ASSERT(strcmp(r2, exp2) == 0);
   free(r1);
   free(r2);
+  jsonrpc_ctx_free(&c1);
+  jsonrpc_ctx_free(&c2);
+}
+
+static void test_rpc_dispatch(void) {
+  static char names[100][16];
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req;
+  int i;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "m.*", foo1);
+  for (i = 0; i < 100; i++) {
+    snprintf(names[i], sizeof(names[i]), "m.%d", i);
+    ASSERT(jsonrpc_ctx_register(&ctx, names[i], i == 42 ? foo3 : foo2) == 0);
+  }
+  jsonrpc_ctx_export(&ctx, "m.4?", foo);
+  jsonrpc_ctx_export(&ctx, MJSON_RPC_LIST_NAME, jsonrpc_list);
+
+  // Exact name wins over patterns registered before and after it
+  req = "{\"id\":1,\"method\":\"m.42\",\"params\":[1]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":1,\"result\":[1]}\n") == 0);
+  free(res), res = NULL;
+
+  // Unknown names fall back to the patterns, newest first
+  req = "{\"id\":2,\"method\":\"m.4x\",\"params\":[0,5]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, (void *) "u");
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"id\":2,\"result\":{\"x\":5,\"ud\":\"u\"}}\n") == 0);
+  free(res), res = NULL;
+
+  req = "{\"id\":3,\"method\":\"m.100\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "\"code\":123") != NULL);
+  free(res), res = NULL;
+
+  req = "{\"id\":4,\"method\":\"m\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "\"code\":-32601") != NULL);
+  free(res), res = NULL;
+
+  // List keeps the reverse registration order
+  req = "{\"id\":5,\"method\":\"rpc.list\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strncmp(res, "{\"id\":5,\"result\":[\"rpc.list\",\"m.4?\",\"m.99\",",
+                 40) == 0);
+  ASSERT(strstr(res, "\"m.0\",\"m.*\"]}\n") != NULL);
+  free(res), res = NULL;
+
+  // Unregister, and register again under the same name
+  ASSERT(jsonrpc_ctx_unregister(&ctx, "m.42") == 0);
+  ASSERT(jsonrpc_ctx_unregister(&ctx, "m.42") == -1);
+  ASSERT(jsonrpc_ctx_unregister(&ctx, "m.420") == -1);
+  req = "{\"id\":6,\"method\":\"m.42\",\"params\":[0,7]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, (void *) "v");
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"id\":6,\"result\":{\"x\":7,\"ud\":\"v\"}}\n") == 0);
+  free(res), res = NULL;
+  ASSERT(jsonrpc_ctx_register(&ctx, "m.4?", foo1) == 0);
+  ASSERT(jsonrpc_ctx_register(&ctx, "m.4?", foo3) == 0);
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":6,\"result\":[0,7]}\n") == 0);
+  free(res), res = NULL;
+  req = "{\"id\":7,\"method\":\"rpc.list\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strncmp(res, "{\"id\":7,\"result\":[\"m.4?\",\"rpc.list\",\"m.99\",",
+                 40) == 0);
+  ASSERT(strstr(res, "\"m.42\"") == NULL);
+  free(res), res = NULL;
+
+  // Retired tables are released by reclaim, current one is kept
+  ASSERT(ctx.retired != NULL);
+  jsonrpc_ctx_reclaim(&ctx);
+  ASSERT(ctx.retired == NULL && ctx.table != NULL);
+  for (i = 0; i < 100; i++) jsonrpc_ctx_unregister(&ctx, names[i]);
+  ASSERT(jsonrpc_ctx_unregister(&ctx, "m.*") == 0);
+  ASSERT(jsonrpc_ctx_unregister(&ctx, "m.4?") == 0);
+  ASSERT(jsonrpc_ctx_unregister(&ctx, MJSON_RPC_LIST_NAME) == 0);
+  ASSERT(ctx.table == NULL);
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "\"code\":-32601") != NULL);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+  ASSERT(ctx.retired == NULL);
+}
+
+static int s_handle;
+
+static void forever(struct jsonrpc_request *r) {
+  s_handle = jsonrpc_defer(r, JSONRPC_NO_DEADLINE);
+}
+
+static void slow(struct jsonrpc_request *r) {
+  double deadline = 0;
+  mjson_get_number(r->params, r->params_len, "$", &deadline);
+  s_handle = jsonrpc_defer(r, (unsigned long) deadline);
+  if (s_handle < 0) jsonrpc_return_error(r, 1, "busy", NULL);
+}
+
+static void test_rpc_defer(void) {
+  struct jsonrpc_pending slots[2];
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req;
+  int h1, h2;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "slow", slow);
+
+  // Without pending slots, requests cannot be deferred
+  req = "{\"id\":1,\"method\":\"slow\",\"params\":10}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "busy") != NULL);
+  free(res), res = NULL;
+
+  jsonrpc_ctx_set_pending(&ctx, slots, 2);
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res == NULL);
+  h1 = s_handle;
+  ASSERT(h1 >= 0);
+
+  req = "{\"id\":\"abc\",\"method\":\"slow\",\"params\":20}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  h2 = s_handle;
+  ASSERT(res == NULL && h2 >= 0 && h2 != h1);
+
+  // All slots are taken
+  req = "{\"id\":3,\"method\":\"slow\",\"params\":30}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "busy") != NULL);
+  free(res), res = NULL;
+
+  // Reply later, the id is a copy, not a pointer into the request frame
+  ASSERT(jsonrpc_return_success_deferred(&ctx, h2, "%d", 42) == 0);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":\"abc\",\"result\":42}\n") == 0);
+  free(res), res = NULL;
+  ASSERT(jsonrpc_return_success_deferred(&ctx, h2, "%d", 42) == -1);
+  ASSERT(jsonrpc_return_error_deferred(&ctx, -1, 1, "", NULL) == -1);
+  ASSERT(res == NULL);
+
+  // Freed slot gets reused with a new handle
+  req = "{\"id\":4,\"method\":\"slow\",\"params\":5}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res == NULL && s_handle >= 0 && s_handle != h2);
+  ASSERT(jsonrpc_return_success_deferred(&ctx, h2, NULL) == -1);
+
+  // Sweep times out expired requests
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 4) == 0);
+  ASSERT(res == NULL);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 5) == 1);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"id\":4,\"error\":{\"code\":-32000,\"message\":"
+                "\"timeout\"}}\n") == 0);
+  free(res), res = NULL;
+  ASSERT(jsonrpc_return_error_deferred(&ctx, h1, 2, "x", "%d", 1) == 0);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"id\":1,\"error\":{\"code\":2,\"message\":\"x\","
+                "\"data\":1}}\n") == 0);
+  free(res), res = NULL;
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 100) == 0);
+
+  // Deadline is compared correctly across the clock wraparound
+  req = "{\"id\":5,\"method\":\"slow\",\"params\":0}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, (unsigned long) -1) == 0);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 0) == 1);
+  free(res), res = NULL;
+
+  // Requests without a deadline are never swept
+  jsonrpc_ctx_export(&ctx, "forever", forever);
+  req = "{\"id\":6,\"method\":\"forever\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res == NULL && s_handle >= 0);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 0) == 0);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, JSONRPC_NO_DEADLINE) == 0);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 12345) == 0);
+  ASSERT(jsonrpc_return_success_deferred(&ctx, s_handle, "%d", 6) == 0);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":6,\"result\":6}\n") == 0);
+  free(res), res = NULL;
+
+  // Ids that do not fit the slot, and batch elements cannot be deferred
+  req = "{\"id\":\"0123456789012345678901234\",\"method\":\"slow\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "busy") != NULL);
+  free(res), res = NULL;
+  req = "[{\"id\":6,\"method\":\"slow\"}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "busy") != NULL);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+}
+
+#if MJSON_ENABLE_RPC_STATS
+static unsigned long s_ticks;
+
+static unsigned long fake_clock(void) {
+  return s_ticks += 5;
+}
+
+static void test_rpc_stats(void) {
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req1 = "{\"id\":1,\"method\":\"echo\",\"params\":[1]}";
+  const char *req2 = "{\"id\":2,\"method\":\"fail\"}";
+  const char *req3 = "{\"id\":3,\"method\":\"rpc.stats\"}";
+  int i;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+  jsonrpc_ctx_export(&ctx, "fail", foo1);
+  jsonrpc_ctx_export(&ctx, MJSON_RPC_STATS_NAME, jsonrpc_stats);
+
+  for (i = 0; i < 2; i++) {
+    jsonrpc_ctx_process(&ctx, req1, (int) strlen(req1),
+                        mjson_print_dynamic_buf, &res, NULL);
+    free(res), res = NULL;
+  }
+  ctx.clock_fn = fake_clock;
+  jsonrpc_ctx_process(&ctx, req2, (int) strlen(req2), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strlen(res) == 43);
+  free(res), res = NULL;
+
+  // Replacing a handler keeps the counters
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+  jsonrpc_ctx_process(&ctx, req3, (int) strlen(req3), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"id\":3,\"result\":{\"echo\":{\"calls\":2,\"errors\":0,"
+                "\"bytes_in\":74,\"bytes_out\":44,\"latency\":[]},"
+                "\"rpc.stats\":{\"calls\":0,\"errors\":0,\"bytes_in\":0,"
+                "\"bytes_out\":0,\"latency\":[]},"
+                "\"fail\":{\"calls\":1,\"errors\":1,\"bytes_in\":24,"
+                "\"bytes_out\":43,\"latency\":[0,0,0,1]}}}\n") == 0);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+}
+#endif
+
+static unsigned long s_now;
+
+static unsigned long now_clock(void) {
+  return s_now;
+}
+
+#if MJSON_ENABLE_RPC_CACHE
+static int s_calls;
+
+static void counted(struct jsonrpc_request *r) {
+  s_calls++;
+  if (r->params_len > 0 && r->params[0] == '-') {
+    jsonrpc_return_error(r, 1, "negative", NULL);
+  } else {
+    jsonrpc_return_success(r, "{%Q:%d,%Q:%.*s}", "n", s_calls, "p",
+                           r->params_len, r->params);
+  }
+}
+
+static void cache_call(struct jsonrpc_ctx *ctx, const char *method, int n) {
+  char buf[100], *res = NULL;
+  mjson_snprintf(buf, sizeof(buf), "{%Q:1,%Q:%Q,%Q:%d}", "id", "method",
+                 method, "params", n);
+  jsonrpc_ctx_process(ctx, buf, (int) strlen(buf), mjson_print_dynamic_buf,
+                      &res, NULL);
+  free(res);
+}
+
+// Misses its own key again before returning, like two concurrent requests
+static void nested(struct jsonrpc_request *r) {
+  static int depth;
+  char *res = NULL;
+  if (depth++ == 0) {
+    jsonrpc_ctx_process(r->ctx, r->frame, r->frame_len,
+                        mjson_print_dynamic_buf, &res, NULL);
+    free(res);
+  }
+  depth--;
+  counted(r);
+}
+
+static void test_rpc_cache(void) {
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req;
+  int i, calls;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export_cached(&ctx, "get", counted, 10);
+  jsonrpc_ctx_export(&ctx, "nocache", counted);
+
+  // Without a clock, nothing is cached
+  req = "{\"id\":1,\"method\":\"get\",\"params\":[1, \"a b\"]}";
+  for (i = 0; i < 2; i++) {
+    jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                        &res, NULL);
+    free(res), res = NULL;
+  }
+  ASSERT(s_calls == 2);
+
+  // Second call with the same canonical params is served from the cache,
+  // with the id substituted
+  ctx.clock_fn = now_clock;
+  s_now = 0;
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"id\":1,\"result\":{\"n\":3,\"p\":[1, \"a b\"]}}\n") ==
+             0);
+  free(res), res = NULL;
+  req = "{\"method\":\"get\",\"id\":\"x\",\"params\":[ 1,\"a b\" ]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 3);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"id\":\"x\",\"result\":{\"n\":3,\"p\":[1, \"a b\"]}}\n") ==
+             0);
+  free(res), res = NULL;
+
+  // Whitespace inside strings is significant
+  req = "{\"id\":2,\"method\":\"get\",\"params\":[1,\"ab\"]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 4);
+  free(res), res = NULL;
+
+  // Entries expire after TTL
+  s_now = 10;
+  req = "{\"id\":3,\"method\":\"get\",\"params\":[1,\"a b\"]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 5);
+  ASSERT(res != NULL && strstr(res, "\"n\":5") != NULL);
+  free(res), res = NULL;
+
+  // Errors and notifications are not cached, uncached methods always called
+  req = "{\"id\":4,\"method\":\"get\",\"params\":-1}";
+  for (i = 0; i < 2; i++) {
+    jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                        &res, NULL);
+    ASSERT(res != NULL && strstr(res, "negative") != NULL);
+    free(res), res = NULL;
+  }
+  ASSERT(s_calls == 7);
+  req = "{\"method\":\"get\",\"params\":[1,\"a b\"]}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 8 && res == NULL);
+  req = "{\"id\":5,\"method\":\"nocache\"}";
+  for (i = 0; i < 2; i++) {
+    jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                        &res, NULL);
+    free(res), res = NULL;
+  }
+  ASSERT(s_calls == 10);
+
+  // Least recently used entries are evicted
+  jsonrpc_ctx_cache_flush(&ctx);
+  for (i = 0; i <= MJSON_RPC_CACHE_SIZE + 3; i++) {
+    static const int order[] = {0, MJSON_RPC_CACHE_SIZE, 0, 1};
+    char buf[100];
+    int n = i < MJSON_RPC_CACHE_SIZE ? i : order[i - MJSON_RPC_CACHE_SIZE];
+    mjson_snprintf(buf, sizeof(buf), "{%Q:1,%Q:%Q,%Q:%d}", "id", "method",
+                   "get", "params", n);
+    jsonrpc_ctx_process(&ctx, buf, (int) strlen(buf), mjson_print_dynamic_buf,
+                        &res, NULL);
+    free(res), res = NULL;
+  }
+  ASSERT(s_calls == 12 + MJSON_RPC_CACHE_SIZE);
+
+  // Re-registration flushes the cache
+  req = "{\"id\":1,\"method\":\"get\",\"params\":0}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 12 + MJSON_RPC_CACHE_SIZE);
+  free(res), res = NULL;
+  jsonrpc_ctx_export_cached(&ctx, "get", counted, 10);
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(s_calls == 13 + MJSON_RPC_CACHE_SIZE);
+  free(res);
+
+  // Two misses for the same key leave one entry: after it, one more key
+  // fits without evicting anything
+  jsonrpc_ctx_export_cached(&ctx, "nested", nested, 10);
+  for (i = 1; i < MJSON_RPC_CACHE_SIZE - 1; i++) cache_call(&ctx, "get", i);
+  calls = s_calls;
+  cache_call(&ctx, "nested", 0);
+  ASSERT(s_calls == calls + 2);
+  cache_call(&ctx, "get", 100);
+  cache_call(&ctx, "nested", 0);
+  cache_call(&ctx, "get", 1);
+  ASSERT(s_calls == calls + 3);
+
+  // Expired entries are evicted before the least recently used one
+  jsonrpc_ctx_cache_flush(&ctx);
+  s_now = 20;
+  cache_call(&ctx, "get", 0);
+  s_now = 25;
+  for (i = 1; i < MJSON_RPC_CACHE_SIZE; i++) cache_call(&ctx, "get", i);
+  s_now = 28;
+  cache_call(&ctx, "get", 0);  // Entry 0 is now the most recently used
+  s_now = 31;                  // Entry 0 has expired, entry 1 is the LRU
+  cache_call(&ctx, "get", 100);
+  calls = s_calls;
+  cache_call(&ctx, "get", 1);
+  ASSERT(s_calls == calls);
+  cache_call(&ctx, "get", 0);
+  ASSERT(s_calls == calls + 1);
+  jsonrpc_ctx_free(&ctx);
+}
+#endif
+
+static void reverse_batch_fn(void (*fn)(int, void *), void *arg, int n,
+                             void *fn_data) {
+  while (n-- > 0) fn(n, arg);
+  (*(int *) fn_data)++;
+}
+
+// Prints a response without the trailing newline
+static void no_newline(struct jsonrpc_request *r) {
+  mjson_printf(r->fn, r->fn_data, "{%Q:%.*s,%Q:1}", "id", r->id_len, r->id,
+               "result");
+}
+
+static void test_rpc_batch(void) {
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req;
+  int count = 0, calls = 0;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+  jsonrpc_ctx_export(&ctx, "fail", foo1);
+
+  req =
+      " [ {\"id\":1,\"method\":\"echo\",\"params\":[1]}, "
+      "{\"method\":\"echo\",\"params\":[2]},{\"id\":3,\"result\":3},"
+      "{\"id\":4,\"method\":\"fail\"},42 ,{\"id\":6,\"method\":\"nope\"} ]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "[{\"id\":1,\"result\":[1]},"
+                "{\"id\":4,\"error\":{\"code\":123,\"message\":\"\"}},"
+                "{\"error\":{\"code\":-32600,\"message\":\"invalid request\"}},"
+                "{\"id\":6,\"error\":{\"code\":-32601,\"message\":"
+                "\"method not found\"}}]\n") == 0);
+  free(res), res = NULL;
+
+  // Elements that are not objects are invalid requests
+  req = "[42,{\"id\":1,\"method\":\"echo\",\"params\":1},\"x\"]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "[{\"error\":{\"code\":-32600,\"message\":"
+                "\"invalid request\"}},{\"id\":1,\"result\":1},"
+                "{\"error\":{\"code\":-32600,\"message\":"
+                "\"invalid request\"}}]\n") == 0);
+  free(res), res = NULL;
+
+  // Responses without a trailing newline
+  jsonrpc_ctx_export(&ctx, "nonl", no_newline);
+  req =
+      "[{\"id\":1,\"method\":\"nonl\"},{\"id\":2,\"method\":\"nonl\"},"
+      "{\"id\":3,\"method\":\"nonl\"}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "[{\"id\":1,\"result\":1},{\"id\":2,\"result\":1},"
+                "{\"id\":3,\"result\":1}]\n") == 0);
+  free(res), res = NULL;
+
+  // Responses are joined in request order, whatever the execution order is
+  ctx.batch_fn = reverse_batch_fn, ctx.batch_fn_data = &calls;
+  req =
+      "[{\"id\":1,\"method\":\"echo\",\"params\":1},"
+      "{\"id\":2,\"method\":\"echo\",\"params\":2}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(calls == 1);
+  ASSERT(res != NULL &&
+         strcmp(res, "[{\"id\":1,\"result\":1},{\"id\":2,\"result\":2}]\n") ==
+             0);
+  free(res), res = NULL;
+
+  // The whole reply is passed to the printer at once
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), count_cb, &count, NULL);
+  ASSERT(count == 1);
+
+  // Notifications only, no reply
+  count = 0;
+  req = "[{\"method\":\"echo\"},{\"method\":\"fail\"}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), count_cb, &count, NULL);
+  ASSERT(count == 0);
+
+  // Empty and malformed batches
+  req = "[]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"error\":{\"code\":-32600,\"message\":"
+                     "\"invalid request\"}}\n") == 0);
+  free(res), res = NULL;
+  req = "[{\"id\":1,\"method\":\"echo\"} {\"id\":2,\"method\":\"echo\"}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strncmp(res, "{\"error\":{\"code\":-32700,", 24) == 0);
+  free(res), res = NULL;
+  req = "[{\"id\":1,\"method\":\"echo\"},";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strncmp(res, "{\"error\":{\"code\":-32700,", 24) == 0);
+  free(res);
+  ASSERT(calls == 3);
+  jsonrpc_ctx_free(&ctx);
+}
+
+static void test_rpc_stream(void) {
+  struct jsonrpc_ctx ctx;
+  struct jsonrpc_stream st;
+  char buf[48], *res = NULL;
+  const char *req;
+  int i, n = 0;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+  jsonrpc_stream_init(&st, &ctx, buf, sizeof(buf), mjson_print_dynamic_buf,
+                      &res, NULL);
+
+  // Two frames in one chunk, dispatched without copying
+  req = "{\"id\":1,\"method\":\"echo\",\"params\":1}\n"
+        " {\"id\":2,\"method\":\"echo\",\"params\":2}";
+  ASSERT(jsonrpc_stream_feed(&st, req, (int) strlen(req)) == 2);
+  ASSERT(st.len == 0);
+  ASSERT(res != NULL && strcmp(res,
+                               "{\"id\":1,\"result\":1}\n"
+                               "{\"id\":2,\"result\":2}\n") == 0);
+  free(res), res = NULL;
+
+  // Byte by byte, with brackets and escapes inside strings
+  req = "\r\n{\"id\":3,\"method\":\"echo\",\"params\":[\"}\\\"]\\n\"]}\n";
+  for (i = 0; req[i] != '\0'; i++) n += jsonrpc_stream_feed(&st, req + i, 1);
+  ASSERT(n == 1);
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"id\":3,\"result\":[\"}\\\"]\\n\"]}\n") == 0);
+  free(res), res = NULL;
+
+  // A frame split across chunks, followed by a partial one
+  req = "{\"id\":4,\"method\":\"echo\",\"params\":4}[{\"id\":5,";
+  ASSERT(jsonrpc_stream_feed(&st, req, 10) == 0);
+  ASSERT(st.len == 10);
+  ASSERT(jsonrpc_stream_feed(&st, req + 10, (int) strlen(req) - 10) == 1);
+  ASSERT(st.len == 9);
+  req = "\"method\":\"echo\",\"params\":5}]";
+  ASSERT(jsonrpc_stream_feed(&st, req, (int) strlen(req)) == 1);
+  ASSERT(res != NULL && strcmp(res,
+                               "{\"id\":4,\"result\":4}\n"
+                               "[{\"id\":5,\"result\":5}]\n") == 0);
+  free(res), res = NULL;
+
+  // Newline terminates junk outside of brackets
+  req = "boo\n";
+  ASSERT(jsonrpc_stream_feed(&st, req, (int) strlen(req)) == 1);
+  ASSERT(res != NULL && strncmp(res, "{\"error\":{\"code\":-32700,", 24) == 0);
+  free(res), res = NULL;
+
+  // Frames longer than the buffer are dropped, the stream recovers
+  req = "{\"id\":6,\"method\":\"echo\",\"params\":"
+        "\"01234567890123456789\"}";
+  ASSERT(jsonrpc_stream_feed(&st, req, 5) == 0);
+  ASSERT(jsonrpc_stream_feed(&st, req + 5, (int) strlen(req) - 5) == 1);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"error\":{\"code\":-32700,\"message\":"
+                "\"frame too long\"}}\n") == 0);
+  free(res), res = NULL;
+  ASSERT(jsonrpc_stream_feed(&st, req, (int) strlen(req)) == 1);
+  ASSERT(res != NULL &&
+         strcmp(res,
+                "{\"error\":{\"code\":-32700,\"message\":"
+                "\"frame too long\"}}\n") == 0);
+  free(res), res = NULL;
+  req = "{\"id\":7,\"method\":\"echo\",\"params\":\"012345678901\"}";
+  ASSERT((int) strlen(req) == (int) sizeof(buf));  // Fits exactly
+  ASSERT(jsonrpc_stream_feed(&st, req, (int) strlen(req)) == 1);
+  ASSERT(res != NULL &&
+         strcmp(res, "{\"id\":7,\"result\":\"012345678901\"}\n") == 0);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+}
+
+static char s_reply[100];
+
+static void reply_cb(struct jsonrpc_response *res) {
+  struct mjson_fixedbuf fb = {s_reply, sizeof(s_reply), 0};
+  int *count = (int *) res->userdata;
+  (*count)++;
+  if (res->result != NULL) {
+    mjson_printf(mjson_print_fixed_buf, &fb, "%.*s", res->result_len,
+                 res->result);
+  } else {
+    mjson_printf(mjson_print_fixed_buf, &fb, "E%.*s", res->error_len,
+                 res->error);
+  }
+}
+
+static void test_rpc_call(void) {
+  struct jsonrpc_ctx ctx;
+  struct jsonrpc_call_slot slots[2];
+  char *out = NULL, *res = NULL;
+  const char *resp;
+  int count = 0;
+
+  jsonrpc_ctx_init(&ctx, mjson_print_dynamic_buf, &res);
+  ASSERT(jsonrpc_call(&ctx, "foo", reply_cb, &count, 0, NULL) == -1);
+  ctx.request_fn = mjson_print_dynamic_buf, ctx.request_fn_data = &out;
+  ctx.clock_fn = now_clock;
+  s_now = 100;
+  ASSERT(jsonrpc_call(&ctx, "foo", reply_cb, &count, 0, NULL) == -1);
+  jsonrpc_ctx_set_calls(&ctx, slots, 2);
+
+  // Ids grow monotonically, the slot is the id modulo the number of slots
+  ASSERT(jsonrpc_call(&ctx, "foo", reply_cb, &count, 0, "[%d]", 1) == 0);
+  ASSERT(jsonrpc_call(&ctx, "bar", reply_cb, &count, 10, NULL) == 0);
+  ASSERT(jsonrpc_call(&ctx, "baz", reply_cb, &count, 0, NULL) == -1);
+  ASSERT(jsonrpc_call(&ctx, "note", NULL, NULL, 0, "%Q", "x") == 0);
+  ASSERT(out != NULL &&
+         strcmp(out,
+                "{\"id\":2,\"method\":\"foo\",\"params\":[1]}\n"
+                "{\"id\":5,\"method\":\"bar\"}\n"
+                "{\"method\":\"note\",\"params\":\"x\"}\n") == 0);
+  free(out), out = NULL;
+
+  // Responses are routed by id, unknown ids go to response_cb
+  resp = "{\"id\":3,\"result\":1}";
+  jsonrpc_ctx_process(&ctx, resp, (int) strlen(resp), NULL, NULL, NULL);
+  ASSERT(count == 0);
+  ASSERT(res != NULL && strcmp(res, resp) == 0);
+  free(res), res = NULL;
+  resp = "{\"id\":2,\"result\":{\"a\":1}}";
+  jsonrpc_ctx_process(&ctx, resp, (int) strlen(resp), NULL, NULL, NULL);
+  ASSERT(count == 1);
+  ASSERT(strcmp(s_reply, "{\"a\":1}") == 0);
+  ASSERT(res == NULL);
+
+  // A response is delivered once
+  jsonrpc_ctx_process(&ctx, resp, (int) strlen(resp), NULL, NULL, NULL);
+  ASSERT(count == 1);
+  ASSERT(res != NULL);
+  free(res), res = NULL;
+
+  // Freed slot is reused with a new id
+  ASSERT(jsonrpc_call(&ctx, "foo", reply_cb, &count, 0, NULL) == 0);
+  ASSERT(out != NULL && strcmp(out, "{\"id\":6,\"method\":\"foo\"}\n") == 0);
+  free(out), out = NULL;
+  resp = "{\"id\":6,\"error\":{\"code\":1}}";
+  jsonrpc_ctx_process(&ctx, resp, (int) strlen(resp), NULL, NULL, NULL);
+  ASSERT(count == 2);
+  ASSERT(strcmp(s_reply, "E{\"code\":1}") == 0);
+
+  // Expired calls get a timeout error
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 109) == 0);
+  ASSERT(count == 2);
+  ASSERT(jsonrpc_ctx_sweep(&ctx, 110) == 1);
+  ASSERT(count == 3);
+  ASSERT(strcmp(s_reply, "E{\"code\":-32000,\"message\":\"timeout\"}") ==
+         0);
+  ASSERT(ctx.calls_timed == 0);
+  resp = "{\"id\":5,\"result\":1}";
+  jsonrpc_ctx_process(&ctx, resp, (int) strlen(resp), NULL, NULL, NULL);
+  ASSERT(count == 3);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+}
+
+#if MJSON_ENABLE_RPC_SCHEMA
+static void set_led(struct jsonrpc_request *r) {
+  jsonrpc_return_success(r, "[%d,%.*s,%B]", r->num_args, r->args[1].len,
+                         r->args[1].ptr == NULL ? "" : r->args[1].ptr,
+                         r->args[2].num > 0);
+}
+
+static void test_rpc_schema(void) {
+  static const struct jsonrpc_param params[] = {
+      {"pin", MJSON_TOK_NUMBER, 1, 0, 40},
+      {"name", MJSON_TOK_STRING, 0, 1, 8},
+      {"on", MJSON_TOK_TRUE, 0, 0, 0},
+  };
+  struct jsonrpc_ctx ctx;
+  char *res = NULL;
+  const char *req;
+  struct {
+    const char *params, *reply;
+  } tests[] = {
+      {"{\"on\":true,\"x\":[1,{}],\"pin\":2,\"name\":\"a\"}",
+       "{\"id\":1,\"result\":[3,\"a\",true]}\n"},
+      {"[2, \"ab\", false]", "{\"id\":1,\"result\":[3,\"ab\",false]}\n"},
+      {"{\"pin\":2}", "{\"id\":1,\"result\":[3,,false]}\n"},
+      {"{ }",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"missing param\",\"data\":{\"param\":\"pin\"}}}\n"},
+      {"{\"pin\":\"2\"}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":\"pin\"}}}\n"},
+      {"[41]",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"param out of range\",\"data\":{\"param\":\"pin\"}}}\n"},
+      {"[1,\"\"]",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"param out of range\",\"data\":{\"param\":\"name\"}}}\n"},
+      {"3",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"invalid params\"}}\n"},
+      {"[1,]",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"invalid params\"}}\n"},
+  };
+  static const char *malformed[] = {"[1 2]", "{\"pin\":1]", "[tru]"};
+  size_t i;
+  char buf[100];
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  ASSERT(jsonrpc_ctx_export_schema(&ctx, "led", set_led, params,
+                                   MJSON_RPC_MAX_PARAMS + 1) == -1);
+  ASSERT(jsonrpc_ctx_export_schema(&ctx, "led", set_led, params, 3) == 0);
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    mjson_printf(mjson_print_fixed_buf, &fb,
+                 "{\"id\":1,\"method\":\"led\",\"params\":%s}",
+                 tests[i].params);
+    jsonrpc_ctx_process(&ctx, buf, fb.len, mjson_print_dynamic_buf, &res,
+                        NULL);
+    ASSERT(res != NULL && strcmp(res, tests[i].reply) == 0);
+    free(res), res = NULL;
+  }
+
+  // Malformed params make the whole frame invalid
+  for (i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++) {
+    struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+    mjson_printf(mjson_print_fixed_buf, &fb,
+                 "{\"id\":1,\"method\":\"led\",\"params\":%s}", malformed[i]);
+    jsonrpc_ctx_process(&ctx, buf, fb.len, mjson_print_dynamic_buf, &res,
+                        NULL);
+    ASSERT(res != NULL &&
+           strncmp(res, "{\"error\":{\"code\":-32700,", 24) == 0);
+    free(res), res = NULL;
+  }
+
+  // Missing params are validated too
+  req = "{\"id\":1,\"method\":\"led\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), mjson_print_dynamic_buf,
+                      &res, NULL);
+  ASSERT(res != NULL && strstr(res, "missing param") != NULL);
+  free(res);
+  jsonrpc_ctx_free(&ctx);
+}
+#endif
+
+#if defined(__cplusplus) && MJSON_ENABLE_RPC_SCHEMA
+struct Config {
+  int speed;
+  bool on;
+};
+
+static bool mjson_decode(const struct jsonrpc_arg &a, Config &c) {
+  double v = 0;
+  int on = 0;
+  if (!mjson_get_number(a.ptr, a.len, "$.speed", &v)) return false;
+  c.speed = (int) v;
+  if (!mjson_get_bool(a.ptr, a.len, "$.on", &on)) return false;
+  c.on = on != 0;
+  return true;
+}
+
+static int mjson_encode(mjson_print_fn_t fn, void *fd, const Config &c) {
+  return mjson_printf(fn, fd, "{%Q:%d,%Q:%B}", "speed", c.speed, "on",
+                      c.on ? 1 : 0);
+}
+
+static Config s_config;
+
+static int add(int a, int b) {
+  return a + b;
+}
+
+static jsonrpc::str name(const jsonrpc::str &s, bool upper) {
+  (void) upper;
+  return s;
+}
+
+static jsonrpc::status set_config(const Config &c) {
+  if (c.speed < 0) return jsonrpc::status{JSONRPC_ERROR_BAD_PARAMS, "speed"};
+  s_config = c;
+  return jsonrpc::status{0, NULL};
+}
+
+static Config get_config() {
+  return s_config;
+}
+
+static void reset(double x) {
+  s_config.speed = (int) x;
+}
+
+static unsigned twice(unsigned x) {
+  return x * 2;
+}
+
+static double scale(float x) {
+  return static_cast<double>(x) * 2;
+}
+
+static void test_rpc_typed(void) {
+  struct jsonrpc_ctx ctx, ctx2;
+  char *res = NULL;
+  struct {
+    const char *req, *reply;
+  } tests[] = {
+      {"{\"id\":1,\"method\":\"add\",\"params\":[2,3]}",
+       "{\"id\":1,\"result\":5}\n"},
+      {"{\"id\":1,\"method\":\"add\",\"params\":{\"b\":3,\"a\":-2}}",
+       "{\"id\":1,\"result\":1}\n"},
+      {"{\"id\":1,\"method\":\"add\",\"params\":[2.5,3]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":\"a\"}}}\n"},
+      {"{\"id\":1,\"method\":\"add\",\"params\":[2,\"3\"]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":\"b\"}}}\n"},
+      {"{\"id\":1,\"method\":\"name\",\"params\":[\"a\\\"b\",true]}",
+       "{\"id\":1,\"result\":\"a\\\"b\"}\n"},
+      {"{\"id\":1,\"method\":\"name\",\"params\":[\"a\"]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"missing param\",\"data\":{\"param\":1}}}\n"},
+      {"{\"id\":1,\"method\":\"set\",\"params\":{\"speed\":7,\"on\":true}}",
+       "{\"id\":1,\"result\":true}\n"},
+      {"{\"id\":1,\"method\":\"set\",\"params\":{\"speed\":-1,\"on\":true}}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":\"speed\"}}\n"},
+      {"{\"id\":1,\"method\":\"set\",\"params\":{\"speed\":1}}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"invalid params\"}}\n"},
+      {"{\"id\":1,\"method\":\"set\",\"params\":[1]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"invalid params\"}}\n"},
+      {"{\"id\":1,\"method\":\"get\"}",
+       "{\"id\":1,\"result\":{\"speed\":7,\"on\":true}}\n"},
+      {"{\"id\":1,\"method\":\"reset\",\"params\":[0]}",
+       "{\"id\":1,\"result\":null}\n"},
+      {"{\"id\":1,\"method\":\"add\",\"params\":[1e300,1]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":\"a\"}}}\n"},
+      {"{\"id\":1,\"method\":\"add\",\"params\":[1,-3e9]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":\"b\"}}}\n"},
+      {"{\"id\":1,\"method\":\"twice\",\"params\":[2147483648]}",
+       "{\"id\":1,\"result\":0}\n"},
+      {"{\"id\":1,\"method\":\"twice\",\"params\":[-1]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":0}}}\n"},
+      {"{\"id\":1,\"method\":\"twice\",\"params\":[2.5]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":0}}}\n"},
+      {"{\"id\":1,\"method\":\"twice\",\"params\":[4294967296]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":0}}}\n"},
+      {"{\"id\":1,\"method\":\"scale\",\"params\":[1.5]}",
+       "{\"id\":1,\"result\":3}\n"},
+      {"{\"id\":1,\"method\":\"scale\",\"params\":[1e300]}",
+       "{\"id\":1,\"error\":{\"code\":-32602,\"message\":"
+       "\"wrong param type\",\"data\":{\"param\":0}}}\n"},
+  }, sums[] = {
+      {"{\"id\":2,\"method\":\"sum\",\"params\":{\"x\":5,\"y\":2}}",
+       "{\"id\":2,\"result\":7}\n"},
+      {"{\"id\":2,\"method\":\"add\",\"params\":{\"a\":5,\"b\":2}}",
+       "{\"id\":2,\"result\":7}\n"},
+      {"{\"id\":2,\"method\":\"sum\",\"params\":[5,2]}",
+       "{\"id\":2,\"result\":7}\n"},
+      {"{\"id\":2,\"method\":\"sum\",\"params\":{\"x\":5,\"y\":2}}",
+       "{\"id\":2,\"error\":{\"code\":-32602,\"message\":"
+       "\"missing param\",\"data\":{\"param\":0}}}\n"},
+  };
+  size_t i;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(add)>(&ctx, "add", "a", "b")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(name)>(&ctx, "name")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(set_config)>(&ctx, "set")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(get_config)>(&ctx, "get")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(reset)>(&ctx, "reset")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(twice)>(&ctx, "twice")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(scale)>(&ctx, "scale")) == 0);
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    jsonrpc_ctx_process(&ctx, tests[i].req, (int) strlen(tests[i].req),
+                        mjson_print_dynamic_buf, &res, NULL);
+    ASSERT(res != NULL && strcmp(res, tests[i].reply) == 0);
+    free(res), res = NULL;
+  }
+  ASSERT(s_config.speed == 0 && s_config.on);
+
+  // Every registration keeps its own schema
+  jsonrpc_ctx_init(&ctx2, NULL, NULL);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(add)>(&ctx, "sum", "x", "y")) == 0);
+  ASSERT((jsonrpc::bind<MJSON_RPC_FN(add)>(&ctx2, "sum")) == 0);
+  for (i = 0; i < sizeof(sums) / sizeof(sums[0]); i++) {
+    jsonrpc_ctx_process(i < 2 ? &ctx : &ctx2, sums[i].req,
+                        (int) strlen(sums[i].req), mjson_print_dynamic_buf,
+                        &res, NULL);
+    ASSERT(res != NULL && strcmp(res, sums[i].reply) == 0);
+    free(res), res = NULL;
+  }
+  jsonrpc_ctx_free(&ctx);
+  jsonrpc_ctx_free(&ctx2);
+}
+#endif
+
+static int s_sink_max;
+
+static int limited_sink(const char *buf, int len, void *fn_data) {
+  if (len > s_sink_max) return 0;
+  return mjson_print_dynamic_buf(buf, len, fn_data);
+}
+
+static void test_rpc_frame(void) {
+  struct jsonrpc_frame *f = NULL;
+  char *a = NULL, *b = NULL, *c = NULL;
+  struct jsonrpc_sink sinks[] = {
+      {mjson_print_dynamic_buf, &a},
+      {mjson_print_dynamic_buf, &b},
+      {limited_sink, &c},
+  };
+  int i;
+
+  // Rendered once, sent to every sink as is
+  f = jsonrpc_frame_notify("Shadow.Report", "{%Q:%d}", "x", 1);
+  ASSERT(f != NULL && f->refs == 1);
+  ASSERT(f->len == 44);
+  s_sink_max = 10;
+  ASSERT(jsonrpc_frame_send(f, sinks, 3) == 2);
+  ASSERT(a != NULL && strcmp(a, "{\"method\":\"Shadow.Report\","
+                                "\"params\":{\"x\":1}}\n") == 0);
+  ASSERT(b != NULL && strcmp(a, b) == 0);
+  ASSERT(c == NULL);
+  ASSERT(jsonrpc_frame_ref(f) == f && f->refs == 2);
+  jsonrpc_frame_unref(f);
+  ASSERT(f->refs == 1);
+  jsonrpc_frame_unref(f);
+  jsonrpc_frame_unref(NULL);
+  free(a), free(b);
+
+  // Frames of any size, built by mjson_printf()
+  f = NULL;
+  mjson_printf(jsonrpc_frame_print, &f, "[");
+  for (i = 0; i < 200; i++) {
+    mjson_printf(jsonrpc_frame_print, &f, "%s%d", i == 0 ? "" : ",", i);
+  }
+  mjson_printf(jsonrpc_frame_print, &f, "]");
+  ASSERT(f != NULL && f->len == 2 + 199 + 10 + 90 * 2 + 100 * 3);
+  ASSERT(f->size >= f->len && f->buf[f->len - 1] == ']');
+  ASSERT(mjson_get_number(f->buf, f->len, "$[199]", NULL) == 1);
+  s_sink_max = f->len;
+  ASSERT(jsonrpc_frame_send(f, &sinks[2], 1) == 1);
+  ASSERT(c != NULL && (int) strlen(c) == f->len);
+  jsonrpc_frame_unref(f);
+  free(c);
+  ASSERT(jsonrpc_frame_send(NULL, sinks, 3) == 0);
+}
+
+#if MJSON_ENABLE_RPC_EXECUTOR
+static int s_locked, s_locks, s_wakes;
+
+static void lock_cb(void *data) {
+  ASSERT(s_locked == 0 && data == &s_locks);
+  s_locked = 1, s_locks++;
+}
+
+static void unlock_cb(void *data) {
+  ASSERT(s_locked == 1 && data == &s_locks);
+  s_locked = 0;
+}
+
+static void wake_cb(void *data) {
+  ASSERT(s_locked == 0 && data == &s_locks);
+  s_wakes++;
+}
+
+static int unlocked_print(const char *buf, int len, void *fn_data) {
+  ASSERT(s_locked == 0);
+  return mjson_print_dynamic_buf(buf, len, fn_data);
+}
+
+static struct jsonrpc_ctx *s_reenter;
+
+// Processes a request of its own before printing, once
+static int reentrant_print(const char *buf, int len, void *fn_data) {
+  struct jsonrpc_ctx *ctx = s_reenter;
+  const char *req = "{\"id\":9,\"method\":\"fast\",\"params\":9}";
+  s_reenter = NULL;
+  if (ctx != NULL) {
+    jsonrpc_ctx_process(ctx, req, (int) strlen(req), unlocked_print, fn_data,
+                        NULL);
+  }
+  return unlocked_print(buf, len, fn_data);
+}
+
+static void test_rpc_executor(void) {
+  struct jsonrpc_ctx ctx;
+  struct jsonrpc_executor ex;
+  char *res = NULL;
+  const char *req;
+
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_executor_init(&ex, lock_cb, unlock_cb, wake_cb, &s_locks);
+  ASSERT(jsonrpc_ctx_work(&ctx) == 0);
+  ctx.executor = &ex;
+  ASSERT(jsonrpc_ctx_export(&ctx, "fast", foo3) == 0);
+  ASSERT(jsonrpc_ctx_export_priority(&ctx, "slow", foo3, 2) == 0);
+  ASSERT(jsonrpc_ctx_export_priority(&ctx, "io", foo3, 1) == 0);
+  ASSERT(jsonrpc_ctx_export_priority(&ctx, "x", foo3, -1) == -1);
+  ASSERT(jsonrpc_ctx_export_priority(&ctx, "x", foo3, MJSON_RPC_PRIORITIES) ==
+         -1);
+
+  // Priority 0 runs inline, the response is printed outside the lock
+  req = "{\"id\":1,\"method\":\"fast\",\"params\":1}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), unlocked_print, &res, NULL);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":1,\"result\":1}\n") == 0);
+  ASSERT(s_locks == 0 && s_wakes == 0);
+  free(res), res = NULL;
+
+  // Other priorities are queued, the request buffer can be reused
+  {
+    char buf[100];
+    int i;
+    for (i = 2; i <= 4; i++) {
+      struct mjson_fixedbuf fb = {buf, sizeof(buf), 0};
+      mjson_printf(mjson_print_fixed_buf, &fb,
+                   "{\"id\":%d,\"method\":%Q,\"params\":%d}", i,
+                   i == 3 ? "io" : "slow", i);
+      jsonrpc_ctx_process(&ctx, buf, fb.len, unlocked_print, &res, NULL);
+      memset(buf, 0, sizeof(buf));
+    }
+  }
+  ASSERT(res == NULL);
+  ASSERT(ex.num_jobs == 3 && s_wakes == 3);
+
+  // Workers take the lowest priority number first, FIFO within a priority
+  ASSERT(jsonrpc_ctx_work(&ctx) == 1);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":3,\"result\":3}\n") == 0);
+  ASSERT(jsonrpc_ctx_work(&ctx) == 1);
+  ASSERT(jsonrpc_ctx_work(&ctx) == 1);
+  ASSERT(jsonrpc_ctx_work(&ctx) == 0);
+  ASSERT(ex.num_jobs == 0);
+  ASSERT(strcmp(res,
+                "{\"id\":3,\"result\":3}\n{\"id\":2,\"result\":2}\n"
+                "{\"id\":4,\"result\":4}\n") == 0);
+  free(res), res = NULL;
+
+  // A worker's printer can process requests, the lock is not held
+  req = "{\"id\":8,\"method\":\"slow\",\"params\":8}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), reentrant_print, &res,
+                      NULL);
+  s_reenter = &ctx;
+  ASSERT(jsonrpc_ctx_work(&ctx) == 1);
+  ASSERT(res != NULL && strcmp(res,
+                               "{\"id\":9,\"result\":9}\n"
+                               "{\"id\":8,\"result\":8}\n") == 0);
+  free(res), res = NULL;
+
+  // Batch elements run inline, so that the reply can be joined
+  req = "[{\"id\":5,\"method\":\"slow\",\"params\":5}]";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), unlocked_print, &res, NULL);
+  ASSERT(res != NULL && strcmp(res, "[{\"id\":5,\"result\":5}]\n") == 0);
+  free(res), res = NULL;
+
+  // Deferral from a worker takes the lock, and so does the late response
+  {
+    struct jsonrpc_pending slots[2];
+    int locks = s_locks;
+    jsonrpc_ctx_set_pending(&ctx, slots, 2);
+    ASSERT(jsonrpc_ctx_export_priority(&ctx, "forever", forever, 2) == 0);
+    req = "{\"id\":7,\"method\":\"forever\"}";
+    jsonrpc_ctx_process(&ctx, req, (int) strlen(req), unlocked_print, &res,
+                        NULL);
+    ASSERT(jsonrpc_ctx_work(&ctx) == 1);
+    ASSERT(res == NULL && s_handle >= 0 && s_locks == locks + 3);
+    ASSERT(jsonrpc_ctx_sweep(&ctx, 0) == 0);
+    ASSERT(jsonrpc_return_success_deferred(&ctx, s_handle, "%d", 7) == 0);
+    ASSERT(res != NULL && strcmp(res, "{\"id\":7,\"result\":7}\n") == 0);
+    free(res), res = NULL;
+    jsonrpc_ctx_set_pending(&ctx, NULL, 0);
+  }
+
+  // Requests left in the queue are dropped
+  req = "{\"id\":6,\"method\":\"slow\"}";
+  jsonrpc_ctx_process(&ctx, req, (int) strlen(req), unlocked_print, &res, NULL);
+  ASSERT(ex.num_jobs == 1);
+  jsonrpc_ctx_free(&ctx);
+  ASSERT(ex.num_jobs == 0 && ex.head[2] == NULL && res == NULL);
+}
+#endif
+
+static void test_rpc_ring(void) {
+  static unsigned long m1[(128 + 100) / sizeof(unsigned long)];
+  static unsigned long m2[(128 + 64) / sizeof(unsigned long)];
+  struct jsonrpc_ctx ctx, client;
+  struct jsonrpc_ring *in, *out;
+  char *res = NULL;
+
+  ASSERT(jsonrpc_ring_init(m1, 128) == NULL);
+  ASSERT((in = jsonrpc_ring_init(m1, sizeof(m1))) != NULL && in->size == 64);
+  ASSERT((out = jsonrpc_ring_init(m2, sizeof(m2))) != NULL && out->size == 64);
+  jsonrpc_ctx_init(&ctx, NULL, NULL);
+  jsonrpc_ctx_init(&client, mjson_print_dynamic_buf, &res);
+  jsonrpc_ctx_export(&ctx, "echo", foo3);
+
+  // A consumer about to wait must be woken up
+  ASSERT(jsonrpc_ring_idle(in) == 1);
+  ASSERT(jsonrpc_ring_commit(in) == 0);  // Nothing to commit
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:1,%Q:%Q,%Q:1}", "id", "method",
+               "echo", "params");
+  ASSERT(in->head == 0);
+  ASSERT(jsonrpc_ring_commit(in) == 0);
+  ASSERT(in->head == 40);
+  ASSERT(jsonrpc_ring_waiting(in) == 1);
+  ASSERT(jsonrpc_ring_process(&ctx, in, out, NULL) == 1);
+  ASSERT(jsonrpc_ring_waiting(in) == 0);
+  ASSERT(in->tail == 40 && out->head == 24);
+  ASSERT(jsonrpc_ring_process(&client, out, NULL, NULL) == 1);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":1,\"result\":1}\n") == 0);
+  free(res), res = NULL;
+
+  // A frame that reaches the ring end is moved to the ring start
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:2,%Q:%Q,", "id", "method", "echo");
+  mjson_printf(jsonrpc_ring_print, in, "%Q:2}", "params");
+  ASSERT(jsonrpc_ring_commit(in) == 0);
+  ASSERT(in->head == 64 + 40);
+  ASSERT(jsonrpc_ring_idle(in) == 0);
+  ASSERT(jsonrpc_ring_process(&ctx, in, out, NULL) == 1);
+  ASSERT(jsonrpc_ring_process(&client, out, NULL, NULL) == 1);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":2,\"result\":2}\n") == 0);
+  free(res), res = NULL;
+
+  // Frames that do not fit are dropped
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:3,%Q:%Q,", "id", "method", "echo");
+  ASSERT(jsonrpc_ring_commit(in) == 0);
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:4,%Q:%Q,", "id", "method", "echo");
+  ASSERT(in->wfail == 1);
+  ASSERT(jsonrpc_ring_commit(in) == -1);
+  mjson_printf(jsonrpc_ring_print, in, "%s", "[1,2,3,4,5,6,7,8,9,10,11,12,13,"
+               "14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29]");
+  ASSERT(jsonrpc_ring_commit(in) == -1);
+  ASSERT(jsonrpc_ring_process(&ctx, in, NULL, NULL) == 1);
+  ASSERT(in->tail == in->head && in->wstart == in->head);
+  ASSERT(out->tail == out->head);
+  ASSERT(in->dropped == 2 && out->dropped == 0);
+
+  // A response that does not fit is counted, and input is not consumed
+  // past it
+  ASSERT(jsonrpc_ring_init(m1, sizeof(m1)) == in);
+  ASSERT(jsonrpc_ring_init(m2, sizeof(m2)) == out);
+  jsonrpc_ctx_export(&ctx, "e", foo3);
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:5,%Q:%Q}", "id", "method", "x");
+  ASSERT(jsonrpc_ring_commit(in) == 0);  // Error response is 61 bytes
+  mjson_printf(jsonrpc_ring_print, in, "{%Q:6,%Q:%Q,%Q:1}", "id", "method",
+               "e", "params");
+  ASSERT(jsonrpc_ring_commit(in) == 0 && in->head == 64);
+  ASSERT(jsonrpc_ring_process(&ctx, in, out, NULL) == 1);
+  ASSERT(out->dropped == 1 && out->head == 0 && in->tail == 28);
+  ASSERT(jsonrpc_ring_process(&ctx, in, out, NULL) == 1);
+  ASSERT(out->dropped == 1 && in->tail == 64);
+  ASSERT(jsonrpc_ring_process(&client, out, NULL, NULL) == 1);
+  ASSERT(res != NULL && strcmp(res, "{\"id\":6,\"result\":1}\n") == 0);
+  free(res), res = NULL;
+  jsonrpc_ctx_free(&ctx);
+  jsonrpc_ctx_free(&client);
 }
 
 int main() {
   test_multiple_contexts();
   test_next();
   test_printf();
+  test_marshal();
   test_cb();
   test_find();
   test_get_number();
@@ -883,9 +2752,43 @@ int main() {
   test_get_string();
   test_print();
   test_rpc();
+  test_rpc_dispatch();
+  test_rpc_batch();
+  test_rpc_defer();
+  test_rpc_stream();
+  test_rpc_call();
+  test_rpc_frame();
+  test_rpc_ring();
+#if MJSON_ENABLE_RPC_EXECUTOR
+  test_rpc_executor();
+#endif
+#if MJSON_ENABLE_RPC_SCHEMA
+  test_rpc_schema();
+#endif
+#if defined(__cplusplus) && MJSON_ENABLE_RPC_SCHEMA
+  test_rpc_typed();
+#endif
+#if MJSON_ENABLE_RPC_STATS
+  test_rpc_stats();
+#endif
+#if MJSON_ENABLE_RPC_CACHE
+  test_rpc_cache();
+#endif
   test_merge();
+  test_merge_many();
+  test_diff();
   test_pretty();
+  test_minify();
   test_globmatch();
+#if MJSON_ENABLE_STATS
+  test_stats();
+#endif
+#if MJSON_ENABLE_GLOBSET
+  test_globset();
+#endif
+#if MJSON_ENABLE_ARENA
+  test_arena();
+#endif
   printf("%s. Total tests: %d, failed: %d\n",
          s_num_errors ? "FAILURE" : "SUCCESS", s_num_tests, s_num_errors);
   return s_num_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;